@@ -1,7 +1,10 @@
 #ifndef SCORING_H
 #define SCORING_H
 
+#ifndef SCORING_NO_MYSQL
 #include <mariadb/mysql.h>
+#endif
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <unordered_map>
@@ -10,9 +13,99 @@
 #include <map>
 #include <cmath>
 #include <cstdlib> 
+#include <mutex>
 
 constexpr double EARTH_RADIUS = 6371000.0;
 
+inline double deg2rad(double deg) {
+    return deg * M_PI / 180.0;
+}
+
+inline double haversine(double lat1, double lon1, double lat2, double lon2) {
+    double dLat = deg2rad(lat2 - lat1);
+    double dLon = deg2rad(lon2 - lon1);
+
+    lat1 = deg2rad(lat1);
+    lat2 = deg2rad(lat2);
+
+    double a = std::pow(std::sin(dLat / 2), 2) +
+            std::cos(lat1) * std::cos(lat2) * std::pow(std::sin(dLon / 2), 2);
+    double c = 2 * std::atan2(std::sqrt(a), std::sqrt(1 - a));
+
+    return EARTH_RADIUS * c;
+}
+
+// The weights of GetCafeScore, pre-divided by their total, with the score split by how often its
+// inputs change: rating and price level only with a re-import (static part), the crowd every
+// 15 seconds, the distance with every query. A score is finish(static + crowd + distance), so the
+// static part can be computed once per cafe and profile and reused by every query.
+struct ScoreProfile {
+    double rating = 0.0;
+    double price_level = 0.0;
+    double current_crowd = 0.0;
+    double distance = 0.0;
+
+    ScoreProfile() = default;
+
+    explicit ScoreProfile(const std::unordered_map<std::string, double>& weights) {
+        double total_weight = 0.0;
+        for (const auto& field_weight : weights) {
+            total_weight += field_weight.second;
+        }
+        double scale = total_weight > 0 ? 1.0 / total_weight : 1.0;
+
+        for (const auto& field_weight : weights) {
+            const std::string& key = field_weight.first;
+            if (key == "distance") {
+                distance += field_weight.second * scale;
+            } else if (key == "rating") {
+                rating += field_weight.second * scale;
+            } else if (key == "price_level") {
+                price_level += field_weight.second * scale;
+            } else if (key == "current_crowd") {
+                current_crowd += field_weight.second * scale;
+            }
+        }
+    }
+
+    double static_part(double cafe_rating, double cafe_price_level) const {
+        return rating * ((cafe_rating - 3.0) / 2.0) + price_level * (1 - (cafe_price_level / 5.0));
+    }
+
+    double crowd_part(double cafe_current_crowd) const {
+        return current_crowd * (1 - (cafe_current_crowd / 100.0));
+    }
+
+    // `distance` is in meters from the query point; `r_meters` is the query radius
+    double distance_part(double cafe_distance, double r_meters) const {
+        return distance * (1 - (cafe_distance / (r_meters * 2)));
+    }
+
+    // Rounded to 3 decimals
+    static double finish(double score) {
+        return std::round(score * 1000.0) / 1000.0;
+    }
+};
+
+// Weighted score of one cafe, normalized by the total weight and rounded to 3 decimals.
+// `distance` is in meters from the query point; `r_meters` is the query radius.
+inline double GetCafeScore(double rating, double price_level, double current_crowd, double distance, double r_meters,
+                           const std::unordered_map<std::string, double>& weights) {
+    ScoreProfile profile(weights);
+    return ScoreProfile::finish(profile.static_part(rating, price_level) + profile.crowd_part(current_crowd) +
+                                profile.distance_part(distance, r_meters));
+}
+
+// Same, reading the attributes from a row as returned by GetAllCafeData
+inline double GetCafeScore(const std::unordered_map<std::string, double>& cafeData, double distance, double r_meters,
+                           const std::unordered_map<std::string, double>& weights) {
+    auto field = [&cafeData](const char* key) {
+        auto it = cafeData.find(key);
+        return it != cafeData.end() ? it->second : 0.0;
+    };
+    return GetCafeScore(field("rating"), field("price_level"), field("current_crowd"), distance, r_meters, weights);
+}
+
 struct Cafe {
     int id;
     std::string name;
@@ -20,28 +113,13 @@ struct Cafe {
     int price_level, current_crowd;
 };
 
+#ifndef SCORING_NO_MYSQL
 class MySQLScoring {
 private:
     MYSQL* connection;
     std::string host, user, password, database;
-
-    double deg2rad(double deg) {
-        return deg * M_PI / 180.0;
-    }
-
-    double haversine(double lat1, double lon1, double lat2, double lon2) {
-        double dLat = deg2rad(lat2 - lat1);
-        double dLon = deg2rad(lon2 - lon1);
-
-        lat1 = deg2rad(lat1);
-        lat2 = deg2rad(lat2);
-
-        double a = std::pow(std::sin(dLat / 2), 2) +
-                std::cos(lat1) * std::cos(lat2) * std::pow(std::sin(dLon / 2), 2);
-        double c = 2 * std::atan2(std::sqrt(a), std::sqrt(1 - a));
-
-        return EARTH_RADIUS * c;
-    }
+    // One connection serves every thread, one statement at a time
+    std::mutex mutex;
     
 public:
     MySQLScoring() : connection(nullptr) {}
@@ -54,6 +132,7 @@ public:
     
     // Simple config loading from environment variables (ROOT ONLY)
     bool init() {
+        std::lock_guard<std::mutex> lock(mutex);
         // Use Docker environment variables
         const char* env_host = std::getenv("MYSQL_HOST");
         const char* env_user = std::getenv("MYSQL_USER");
@@ -85,25 +164,32 @@ public:
     
     // Import cafe data
     bool insert_cafes_to_mysql(const std::vector<Cafe>& cafes) {
+        std::lock_guard<std::mutex> lock(mutex);
         if (!connection) return false;
         
-        for (const auto& cafe : cafes) {
-            std::string escaped_name = cafe.name;
-            size_t pos = 0;
-            while ((pos = escaped_name.find("'", pos)) != std::string::npos) {
-                escaped_name.replace(pos, 1, "\\'");
-                pos += 2;
-            }
+        // Many rows per statement: one round trip per row made a CSV load crawl
+        const size_t rows_per_insert = 1000;
+        for (size_t first = 0; first < cafes.size(); first += rows_per_insert) {
+            size_t last = std::min(cafes.size(), first + rows_per_insert);
+            std::string query = "INSERT INTO Cafe (id, name, rating, lat, lon, price_level, current_crowd) VALUES ";
+            for (size_t i = first; i < last; ++i) {
+                const Cafe& cafe = cafes[i];
+                std::string escaped_name = cafe.name;
+                size_t pos = 0;
+                while ((pos = escaped_name.find("'", pos)) != std::string::npos) {
+                    escaped_name.replace(pos, 1, "\\'");
+                    pos += 2;
+                }
 
-            // std::cout << "Cafe Price Level: " << cafe.price_level << std::endl;
+                query += (i > first ? ", (" : "(") +
+                         std::to_string(cafe.id) + ", '" + escaped_name + "', " +
+                         std::to_string(cafe.rating) + ", " + std::to_string(cafe.lat) + ", " +
+                         std::to_string(cafe.lon) + ", " + std::to_string(cafe.price_level) + ", " +
+                         std::to_string(cafe.current_crowd) + ")";
+            }
+            query += " ON DUPLICATE KEY UPDATE name=VALUES(name), rating=VALUES(rating), lat=VALUES(lat), lon=VALUES(lon), "
+                     "price_level=VALUES(price_level), current_crowd=VALUES(current_crowd)";
 
-            std::string query = "INSERT INTO Cafe (id, name, rating, lat, lon, price_level, current_crowd) VALUES (" +
-                            std::to_string(cafe.id) + ", '" + escaped_name + "', " +
-                            std::to_string(cafe.rating) + ", " + std::to_string(cafe.lat) + ", " + 
-                            std::to_string(cafe.lon) + ", " + std::to_string(cafe.price_level) + ", " + 
-                            std::to_string(cafe.current_crowd) + ") " +
-                            "ON DUPLICATE KEY UPDATE name=VALUES(name)";
-            
             if (mysql_query(connection, query.c_str()) != 0) {
                 std::cerr << "Insert failed: " << mysql_error(connection) << std::endl;
                 return false;
@@ -111,10 +197,36 @@ public:
         }
         return true;
     }
+
+    bool move_cafe_in_mysql(int id, double lon, double lat) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!connection) return false;
+
+        std::string query = "UPDATE Cafe SET lat=" + std::to_string(lat) + ", lon=" + std::to_string(lon) +
+                            " WHERE id=" + std::to_string(id);
+        if (mysql_query(connection, query.c_str()) != 0) {
+            std::cerr << "Update failed: " << mysql_error(connection) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool remove_cafe_from_mysql(int id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!connection) return false;
+
+        std::string query = "DELETE FROM Cafe WHERE id=" + std::to_string(id);
+        if (mysql_query(connection, query.c_str()) != 0) {
+            std::cerr << "Delete failed: " << mysql_error(connection) << std::endl;
+            return false;
+        }
+        return true;
+    }
     
     std::unordered_map<int, std::unordered_map<std::string, double>> GetAllCafeData(double lon, double lat, double r_meters) {
         std::unordered_map<int, std::unordered_map<std::string, double>> cafeDatas;
         
+        std::lock_guard<std::mutex> lock(mutex);
         if (!connection) return cafeDatas;
 
 
@@ -158,54 +270,19 @@ public:
         mysql_free_result(res);
         return cafeDatas;
     }
-
-    std::vector<double> GetLeafNodeScores(const std::vector<int>& dataIds, 
-                                const double lon, const double lat, const double r_meters,
-                                const std::unordered_map<std::string, double>& weights,
-                                std::unordered_map<int, std::unordered_map<std::string, double>>& cafeDatas) {
-        std::vector<double> scores;
-        
-        for (int id : dataIds) {
-            auto it = cafeDatas.find(id);
-            if (it == cafeDatas.end()) {
-                scores.push_back(0.0);
-                continue;
-            }
-            
-            const auto& cafeData = it->second;
-            double score = 0.0;
-            double total_weight = 0.0;
-
-            for (const auto& field_weight : weights) {
-                const std::string& key = field_weight.first;
-                double weight = field_weight.second;
-                double norm = 0.0;
-                
-                if (key == "distance") {
-                    norm = 1 - (cafeData.at("distance") / (r_meters * 2));
-                }
-                else if (key == "rating") {
-                    norm = (cafeData.at("rating") - 3.0) / 2.0;
-                } 
-                else if (key == "price_level") {
-                    norm = 1 - (cafeData.at("price_level") / 5.0);
-                }
-                else if (key == "current_crowd") {
-                    norm = 1 - (cafeData.at("current_crowd") / 100.0);
-                }
-                
-                score += norm * weight;
-                total_weight += weight;
-            }
-
-            score = total_weight > 0 ? score / total_weight : score;
-            scores.push_back(std::round(score * 1000.0) / 1000.0);
-            cafeDatas[id]["score"] = std::round(score * 1000.0) / 1000.0;
-        }
-
-        return scores;    
-    }
 };
+#else
+// Built without the MySQL client (SCORING_NO_MYSQL, e.g. the benchmarks): there is never a
+// connection, so writes fail and reads come back empty, as they do when the server is down
+class MySQLScoring {
+public:
+    bool init() { return false; }
+    bool insert_cafes_to_mysql(const std::vector<Cafe>&) { return false; }
+    bool move_cafe_in_mysql(int, double, double) { return false; }
+    bool remove_cafe_from_mysql(int) { return false; }
+    std::unordered_map<int, std::unordered_map<std::string, double>> GetAllCafeData(double, double, double) { return {}; }
+};
+#endif // SCORING_NO_MYSQL
 
 MySQLScoring mysql_db;
 
@@ -217,10 +294,33 @@ bool insert_cafes_to_mysql(const std::vector<Cafe>& cafes) {
     return mysql_db.insert_cafes_to_mysql(cafes);
 }
 
+bool move_cafe_in_mysql(int id, double lon, double lat) {
+    return mysql_db.move_cafe_in_mysql(id, lon, lat);
+}
+
+bool remove_cafe_from_mysql(int id) {
+    return mysql_db.remove_cafe_from_mysql(id);
+}
+
 std::vector<double> GetLeafNodeScores(const std::vector<int>& dataIds, const double lon, const double lat, const double r_meters,
                                       const std::unordered_map<std::string, double>& weights,
                                     std::unordered_map<int, std::unordered_map<std::string, double>>& cafeDatas) {
-    return mysql_db.GetLeafNodeScores(dataIds, lon, lat, r_meters, weights, cafeDatas);
+    std::vector<double> scores;
+    
+    for (int id : dataIds) {
+        auto it = cafeDatas.find(id);
+        if (it == cafeDatas.end()) {
+            scores.push_back(0.0);
+            continue;
+        }
+        
+        const auto& cafeData = it->second;
+        double score = GetCafeScore(cafeData, cafeData.at("distance"), r_meters, weights);
+        scores.push_back(score);
+        cafeDatas[id]["score"] = score;
+    }
+
+    return scores;    
 }
 
 std::unordered_map<int, std::unordered_map<std::string, double>> GetAllCafeData(double lon, double lat, double r_meters) {
@@ -9,7 +9,11 @@
 #include <cmath>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <string>
+#ifndef _WIN32
+  #include <unistd.h>
+#endif //_WIN32
 
 #include <algorithm>
 #include <functional>
@@ -17,9 +21,11 @@
 #include <queue>
 #include <map>
 #include <limits>
+#include <stdint.h>
 
 #include <thread>
 #include <future>
+#include <memory>
 #include <unordered_map>
 #include "../../MYsqlDB/Scoring.h"
 
@@ -34,6 +40,11 @@
 #else
   #define RTREE_MAX std::max
 #endif //Max
+#if defined(__GNUC__) || defined(__clang__)
+  #define RTREE_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+  #define RTREE_PREFETCH(addr)
+#endif //__GNUC__
 
 //
 // RTree.h
@@ -45,8 +56,102 @@
 #define RTREE_DONT_USE_MEMPOOLS // This version does not contain a fixed memory allocator, fill in lines with EXAMPLE to implement one.
 #define RTREE_USE_SPHERICAL_VOLUME // Better split classification, may be slower on some systems
 
+// Node weight aggregations for LabelNodeWeight.  Leaf() combines the scores of a leaf's entries,
+// Internal() the weights of a node's children.  Both get at most MAXNODES values in a scratch buffer
+// they may reorder, and return 0 for an empty node.
+
+/// Arithmetic mean (of child means, for internal nodes)
+struct RTreeAggregateMean
+{
+  static double Leaf(double* a_values, int a_count)
+  {
+    double sum = 0;
+    for(int index = 0; index < a_count; ++index)
+    {
+      sum += a_values[index];
+    }
+    return a_count > 0 ? sum / a_count : 0;
+  }
+  static double Internal(double* a_values, int a_count)     { return Leaf(a_values, a_count); }
+};
+
+/// Median, by selection instead of sorting; the mean of the two middle values for an even count
+struct RTreeAggregateMedian
+{
+  static double Leaf(double* a_values, int a_count)
+  {
+    if(a_count <= 0)
+    {
+      return 0;
+    }
+    int mid = a_count / 2;
+    std::nth_element(a_values, a_values + mid, a_values + a_count);
+    if(a_count % 2 != 0)
+    {
+      return a_values[mid];
+    }
+    // Everything before mid is <= a_values[mid] now; the largest of them is the other middle value
+    return (*std::max_element(a_values, a_values + mid) + a_values[mid]) / 2;
+  }
+  static double Internal(double* a_values, int a_count)     { return Leaf(a_values, a_count); }
+};
+
+/// Mean without the lowest and highest value (plain mean for two values or fewer)
+struct RTreeAggregateTrimmedMean
+{
+  static double Leaf(double* a_values, int a_count)
+  {
+    if(a_count <= 2)
+    {
+      return RTreeAggregateMean::Leaf(a_values, a_count);
+    }
+    double sum = 0;
+    double low = a_values[0];
+    double high = a_values[0];
+    for(int index = 0; index < a_count; ++index)
+    {
+      sum += a_values[index];
+      low = RTREE_MIN(low, a_values[index]);
+      high = RTREE_MAX(high, a_values[index]);
+    }
+    return (sum - low - high) / (a_count - 2);
+  }
+  static double Internal(double* a_values, int a_count)     { return Leaf(a_values, a_count); }
+};
+
+/// Best score in the subtree
+struct RTreeAggregateMax
+{
+  static double Leaf(double* a_values, int a_count)         { return a_count > 0 ? *std::max_element(a_values, a_values + a_count) : 0; }
+  static double Internal(double* a_values, int a_count)     { return Leaf(a_values, a_count); }
+};
+
+/// Worst score in the subtree
+struct RTreeAggregateMin
+{
+  static double Leaf(double* a_values, int a_count)         { return a_count > 0 ? *std::min_element(a_values, a_values + a_count) : 0; }
+  static double Internal(double* a_values, int a_count)     { return Leaf(a_values, a_count); }
+};
+
+/// Number of entries in the subtree
+struct RTreeAggregateCount
+{
+  static double Leaf(double*, int a_count)                  { return a_count; }
+  static double Internal(double* a_values, int a_count)
+  {
+    double sum = 0;
+    for(int index = 0; index < a_count; ++index)
+    {
+      sum += a_values[index];
+    }
+    return sum;
+  }
+};
+
 // Fwd decl
 class RTFileStream;  // File I/O helper class, look below for implementation and notes.
+template<class RECORD, class ELEMTYPE, int NUMDIMS, int MAXNODES>
+class RTreeSnapshot; // Frozen, memory-mappable copy of a tree, see RTreeSnapshot.h
 
 
 /// \class RTree
@@ -91,6 +196,7 @@ public:
   {
     MAXNODES = TMAXNODES,                         ///< Max elements in node
     MINNODES = TMINNODES,                         ///< Min elements in node
+    MAX_QUERY_GROUP = 64,                         ///< Max queries per SearchGroup call (one bit each)
   };
 
 public:
@@ -105,7 +211,8 @@ public:
   /// \param a_dataId Positive Id of data.  Maybe zero, but negative numbers not allowed.
   void Insert(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], const DATATYPE& a_dataId);
 
-  /// Remove entry (traverse the whole tree and removes every occurrence)
+  /// Remove entry (traverse the whole tree and removes every occurrence).
+  /// With the data index enabled only the leaf holding it and its ancestors are touched.
   /// \param a_dataId Positive Id of data.  Maybe zero, but negative numbers not allowed.
   void Remove(const DATATYPE& a_dataId);
 
@@ -115,14 +222,119 @@ public:
   /// \param a_dataId Positive Id of data.  Maybe zero, but negative numbers not allowed.
   void Remove(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], const DATATYPE& a_dataId);
 
+  /// Maintain a hash map from data to the leaf slot holding it, built from the current contents.
+  /// Leaves are linked to the root through parent links, so Locate(), Move() and Remove() by data
+  /// cost O(log n) instead of a full-tree walk.  Data must be unique and hashable while it is enabled.
+  void EnableDataIndex();
+
+  bool HasDataIndex() const                       { return m_dataIndexEnabled; }
+
+  /// Bounds of the entry holding a_dataId, looked up in the data index
+  /// \return Returns false if the index is disabled or the data is not in the tree
+  bool Locate(const DATATYPE& a_dataId, ELEMTYPE a_min[NUMDIMS], ELEMTYPE a_max[NUMDIMS]) const;
+
+  /// Change the bounds of an entry, looked up in the data index.  If the new bounds stay inside the
+  /// leaf's current cover the entry is updated in place, otherwise it is removed and reinserted.
+  /// \return Returns false if the index is disabled or the data is not in the tree
+  bool Move(const DATATYPE& a_dataId, const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS]);
+
+  /// Flag the leaf holding a_dataId (and its ancestors) for RefreshBounds(), after the value the
+  /// bound is computed from changed for that entry.  Requires the data index.
+  /// \return Returns false if the index is disabled or the data is not in the tree
+  bool MarkDirty(const DATATYPE& a_dataId);
+
+  /// Recompute the per-node bound (max of a_value over the node's entries) of every node that changed
+  /// since the last call: marked entries, inserts, removals, moves and splits.  Clean subtrees are
+  /// skipped, so the cost follows the number of changed leaves, not the tree size.
+  void RefreshBounds(std::function<ELEMTYPEREAL (const DATATYPE&)> a_value);
+
+  /// Flag every node for RefreshBounds(), after the value function itself changed
+  void InvalidateBounds();
+
+  /// True if no node changed since the last RefreshBounds()
+  bool BoundsFresh() const                        { return !m_root->m_dirty; }
+
+  /// Upper bound on the score of any entry below a node, given the node's cover and its RefreshBounds() bound
+  typedef std::function<ELEMTYPEREAL (const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], ELEMTYPEREAL a_bound)> NodeBoundFunc;
+
+  /// How far SearchBestFirst() got before it returned
+  struct BestFirstProgress
+  {
+    bool m_interrupted;                           ///< Ended by a_interrupt, with nodes left unexpanded
+    int m_leavesScanned;
+    double m_leavesLeft;                          ///< Estimated leaves below the nodes left in the queue
+    ELEMTYPEREAL m_boundLeft;                     ///< Nothing left unreported scores above this; lowest() if nothing is left
+  };
+
+  /// Work done by a search, for instrumentation.  Searches add to it, so one struct can sum several.
+  struct SearchCounters
+  {
+    uint64_t m_nodesVisited;                      ///< Nodes whose branches were examined
+    uint64_t m_nodesPruned;                       ///< Child subtrees skipped, by overlap or score bound
+    uint64_t m_leavesScanned;                     ///< Leaf nodes among the visited
+    uint64_t m_overlapTests;                      ///< Branch rects tested against the search rect
+    uint64_t m_hits;                              ///< Entries reported
+  };
+
   /// Find all within search rectangle
   /// \param a_min Min of search bounding rect
   /// \param a_max Max of search bounding rect
   /// \param a_searchResult Search result array.  Caller should set grow size. Function will reset, not append to array.
   /// \param a_resultCallback Callback function to return result.  Callback should return 'true' to continue searching
   /// \param a_context User context to pass as parameter to a_resultCallback
+  /// \param a_counters Optional, the work done is added to it
   /// \return Returns the number of entries found and SearchPathReocrd if returnSearchPath is true.
-  std::pair<int, std::vector<SearchPathRecord>> Search(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], std::function<bool (const DATATYPE&)> callback, bool a_returnSearchPath, int min_score);
+  std::pair<int, std::vector<SearchPathRecord>> Search(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], std::function<bool (const DATATYPE&)> callback, bool a_returnSearchPath, int min_score,
+                                                       SearchCounters* a_counters = NULL);
+
+  /// Find all within search rectangle, in tree order and without touching node weights or the search path.
+  /// Read-only, so several threads may call it concurrently as long as nobody mutates the tree.
+  /// \param a_min Min of search bounding rect
+  /// \param a_max Max of search bounding rect
+  /// \param a_resultCallback Callback function to return result.  Callback should return 'true' to continue searching
+  /// \return Returns the number of entries found
+  int Search(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], std::function<bool (const DATATYPE&)> callback) const;
+
+  /// Find all within up to MAX_QUERY_GROUP search rectangles in one traversal.
+  /// Every node is visited once for the whole group and tested against all queries still active in it,
+  /// and children are prefetched before they are descended, so the cache miss on one query's child
+  /// overlaps with the overlap tests of the others.  Read-only like the plain Search overload.
+  /// \param a_min Min of each search bounding rect
+  /// \param a_max Max of each search bounding rect
+  /// \param a_queryCount Number of rects, at most MAX_QUERY_GROUP
+  /// \param a_resultCallback Called with the query index and the data.  Callback should return 'true' to continue searching
+  /// \param a_nodeBound Optional score bound of a subtree for one query (see SearchBounded()); a query leaves a subtree bounded below a_minBound
+  /// \return Returns the number of (query, entry) pairs found
+  int SearchGroup(const ELEMTYPE a_min[][NUMDIMS], const ELEMTYPE a_max[][NUMDIMS], int a_queryCount,
+                  std::function<bool (int, const DATATYPE&)> callback,
+                  std::function<ELEMTYPEREAL (int, const ELEMTYPE*, const ELEMTYPE*, ELEMTYPEREAL)> a_nodeBound = nullptr, ELEMTYPEREAL a_minBound = 0) const;
+
+  /// Find all within search rectangle, pruned and ordered by a score bound: the children of a node are
+  /// descended best bound first, and subtrees whose bound is below a_minBound are skipped.  Entries are
+  /// not filtered, the callback scores them.  Bounds must be fresh (see BoundsFresh()).  Read-only like
+  /// the plain Search overload.
+  /// \param a_nodeBound Upper bound for a child, from its cover and stored bound
+  /// \param a_minBound Skip subtrees bounded below this
+  /// \return Returns the number of entries found
+  int SearchBounded(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], const NodeBoundFunc& a_nodeBound,
+                    ELEMTYPEREAL a_minBound, std::function<bool (const DATATYPE&)> callback) const;
+
+  /// Find all within search rectangle scoring at least a_minScore, best first: entries are reported in
+  /// non-increasing score order, so the first n reported are the top n.  Nodes and scored entries share
+  /// one priority queue, nodes keyed by their bound; an entry is reported once no node left in the queue
+  /// can hold a better one.  a_nodeBound must be a true upper bound of a_score below the node.
+  /// Bounds must be fresh (see BoundsFresh()).  Read-only like the plain Search overload.
+  /// \param a_score Exact score of an entry
+  /// \param a_resultCallback Called with the entry and its score.  Callback should return 'true' to continue searching
+  /// \param a_interrupt Polled before every node is expanded and every entry reported; returning 'true' ends the search there
+  /// \param a_progress Optional, filled with where the search ended; the entries reported up to an interrupt are the best of the rect
+  /// \param a_counters Optional, the work done is added to it
+  /// \return Returns the number of entries reported
+  int SearchBestFirst(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], const NodeBoundFunc& a_nodeBound,
+                      std::function<ELEMTYPEREAL (const DATATYPE&)> a_score, ELEMTYPEREAL a_minScore,
+                      std::function<bool (const DATATYPE&, ELEMTYPEREAL)> callback,
+                      std::function<bool ()> a_interrupt = nullptr, BestFirstProgress* a_progress = NULL,
+                      SearchCounters* a_counters = NULL) const;
 
   /// Find the nearest neighbors
   /// \param a_min Min of search bounding rect
@@ -135,9 +347,29 @@ public:
   /// Remove all entries from tree
   void RemoveAll();
 
+  /// An entry for BulkLoad()
+  struct BulkEntry
+  {
+    ELEMTYPE m_min[NUMDIMS];                      ///< Min dimensions of bounding box
+    ELEMTYPE m_max[NUMDIMS];                      ///< Max dimensions of bounding box
+    DATATYPE m_data;
+  };
+
+  /// Replace the contents of the tree with a_entries, packed bottom up by Sort-Tile-Recursive: the
+  /// branches of each level are sorted into tiles of a_fill * MAXNODES neighbours and every tile
+  /// becomes one node.  O(n log n), and far less overlap and dead space than inserting one by one.
+  /// \param a_fill Share of each node to fill, the rest is room for later inserts; at least MINNODES branches
+  void BulkLoad(std::vector<BulkEntry> a_entries, double a_fill = 1.0);
+
+  /// Exchange the contents of two trees in O(1), e.g. to put one built elsewhere in place
+  void Swap(RTree& a_other);
+
   /// Count the data elements in this container.  This is slow as no internal counter is maintained.
   int Count();
 
+  /// Nodes in the tree, counted as they are allocated and freed, so O(1)
+  int NodeCount() const { return m_nodeCount; }
+
   /// Load tree contents from file
   bool Load(const char* a_fileName);
   /// Load tree contents from stream
@@ -151,9 +383,117 @@ public:
 
   // Get complete tree structure with hierarchy information
   void LabelNodeId();
-  std::unordered_map<int, std::unordered_map<std::string, double>> LabelNodeWeight(const std::string& mode, const double lon, const double lat, const double r_meters, std::unordered_map<std::string, double> weights = {});
+  /// Score every entry for the query at (lon, lat) and set each node's weight to the AGGREGATE
+  /// (one of the RTreeAggregate* policies) of its entries' scores or its children's weights.
+  /// \param a_fetch Returns the attributes of every cafe, with "distance" to (lon, lat); defaults to GetAllCafeData
+  /// \param a_score Scores one entry directly; when set, nothing is fetched, weights are unused and the returned map is empty
+  /// \param a_interrupt Polled before every node is labelled; once it returns 'true' the remaining nodes keep their old weights
+  template<class AGGREGATE>
+  std::unordered_map<int, std::unordered_map<std::string, double>> LabelNodeWeight(const double lon, const double lat, const double r_meters, std::unordered_map<std::string, double> weights = {},
+                                                                                   std::function<std::unordered_map<int, std::unordered_map<std::string, double>> ()> a_fetch = nullptr,
+                                                                                   std::function<double (const DATATYPE&)> a_score = nullptr,
+                                                                                   std::function<bool ()> a_interrupt = nullptr);
+  /// Same, with the aggregation picked by name: "mean", "median", "trimmed_mean", "max", "min" or "count"
+  std::unordered_map<int, std::unordered_map<std::string, double>> LabelNodeWeight(const std::string& mode, const double lon, const double lat, const double r_meters, std::unordered_map<std::string, double> weights = {},
+                                                                                   std::function<std::unordered_map<int, std::unordered_map<std::string, double>> ()> a_fetch = nullptr,
+                                                                                   std::function<double (const DATATYPE&)> a_score = nullptr,
+                                                                                   std::function<bool ()> a_interrupt = nullptr);
   TreeStructure GetTreeStructure() const;
 
+  /// Shape, quality and memory of the tree, see Stats()
+  struct TreeStats
+  {
+    int m_height;                                 ///< Levels, 1 when the root is a leaf
+    int m_nodes;
+    int m_entries;
+    std::vector<int> m_nodesPerLevel;             ///< Index 0 = leaves
+    std::vector<double> m_fillPerLevel;           ///< Mean branches per node / MAXNODES, by level
+    double m_fillFactor;                          ///< Mean branches per node / MAXNODES over all nodes
+    double m_coverArea;                           ///< Sum of the node covers' areas (volumes in other than 2D)
+    double m_overlapArea;                         ///< Sum over nodes of the area covered by two or more of its branches
+    double m_pairwiseOverlapArea;                 ///< Sum over nodes of the intersection areas of every pair of its branches
+    double m_deadSpace;                           ///< Sum over nodes of the cover area covered by none of its branches
+    size_t m_nodeBytes;                           ///< Node allocations, entries included
+    size_t m_dataBytes;                           ///< Entries, part of m_nodeBytes
+    size_t m_indexBytes;                          ///< Estimated size of the data index (EnableDataIndex())
+  };
+
+  /// Walk the whole tree for its TreeStats.  Overlap and dead space are exact: every node's branch
+  /// rects are rasterized on the grid of their own coordinates, O(MAXNODES^(NUMDIMS+1)) per node.
+  TreeStats Stats() const;
+  /// TreeStats of the top a_levels levels only (the root alone for 1), at most MAXNODES^a_levels
+  /// nodes whatever the size of the tree.  Counts, fill, areas and node bytes cover the walked
+  /// nodes; m_height and m_indexBytes are still those of the whole tree.
+  TreeStats Stats(int a_levels) const;
+
+  /// A node as Snapshot() copies it
+  struct FrameNode
+  {
+    const void* m_node;                           ///< The node itself, the same across snapshots while it lives
+    int m_level;
+    double m_weight;
+    ELEMTYPE m_min[NUMDIMS];                      ///< Cover of its entries, zero when it has none
+    ELEMTYPE m_max[NUMDIMS];
+    int m_first;                                  ///< First of its entries in FrameSnapshot::m_entries
+    int m_count;
+  };
+
+  /// A branch as Snapshot() copies it
+  struct FrameEntry
+  {
+    ELEMTYPE m_min[NUMDIMS];
+    ELEMTYPE m_max[NUMDIMS];
+    int m_child;                                  ///< Index of the child in FrameSnapshot::m_nodes, -1 in leaves
+    DATATYPE m_data;                              ///< Leaves only
+  };
+
+  /// Flat copy of the tree, nodes breadth-first from the root as LabelNodeId numbers them
+  struct FrameSnapshot
+  {
+    std::vector<FrameNode> m_nodes;
+    std::vector<FrameEntry> m_entries;
+  };
+
+  /// Copy the tree into a_snapshot, reusing its storage: one copy per node and entry, where
+  /// GetTreeStructure() allocates several vectors each.  For frame writers (RTreeFrameLog.h).
+  void Snapshot(FrameSnapshot& a_snapshot) const;
+
+  struct VersionNode;
+  typedef std::shared_ptr<const VersionNode> Version; ///< Root of one committed version
+
+  /// A branch as CommitVersion() froze it
+  struct VersionBranch
+  {
+    ELEMTYPE m_min[NUMDIMS];
+    ELEMTYPE m_max[NUMDIMS];
+    Version m_child;                              ///< Internal nodes only
+    DATATYPE m_data;                              ///< Leaves only
+  };
+
+  /// A node as CommitVersion() froze it.  Never changes, and is shared by every version it is part of.
+  struct VersionNode
+  {
+    const void* m_node;                           ///< The tree node it was copied from, as in FrameNode
+    int m_level;
+    double m_weight;
+    std::vector<VersionBranch> m_branches;
+  };
+
+  /// Freeze the tree as it is now into a new version, numbered from 0.  Only the nodes changed since
+  /// the previous commit (by inserts, removals, moves or LabelNodeWeight()) are copied, the others are
+  /// shared with the versions before: committing after an insert copies about one root-to-leaf path.
+  /// Data is copied by value, so when DATATYPE is a pointer every version sees the pointee as it is now.
+  int CommitVersion();
+  int Versions() const                            { return (int)m_versions.size(); }
+  /// Root of a committed version.  Holding it keeps the version alive; it may be read from any thread.
+  Version GetVersion(int a_version) const         { return m_versions.at(a_version); }
+  /// Drop all versions, and the copies of the current nodes kept for the next commit
+  void ClearVersions();
+  /// The tree as it was at a_version, with the ids LabelNodeId() would have given it then
+  TreeStructure GetTreeStructure(int a_version) const;
+  /// Copy a version into a_snapshot, as Snapshot() copies the current tree
+  static void Snapshot(FrameSnapshot& a_snapshot, const Version& a_version);
+
   /// Iterator is not remove safe.
   class Iterator
   {
@@ -315,6 +655,8 @@ public:
   /// Get object at iterator position
   DATATYPE& GetAt(Iterator& a_it)                 { return *a_it; }
 
+  template<class, class, int, int> friend class RTreeSnapshot; // Writes the node structure out directly
+
 protected:
 
   /// Minimal bounding rectangle (n-dimensional)
@@ -346,7 +688,19 @@ protected:
 
     // Add these custom parameters
     int m_id = -1;
-    double m_weight;
+    double m_weight = 0;
+    Node* m_parent = NULL;                        ///< Node holding the branch to this one, NULL for the root
+    bool m_dirty = true;                          ///< m_bound is stale; if set, it is set on all ancestors too
+    bool m_changed = true;                        ///< Differs from m_image; if set, it is set on all ancestors too
+    Version m_image;                              ///< Copy made by the last CommitVersion(), shared with the versions
+    ELEMTYPEREAL m_bound;                         ///< Max over the subtree of the RefreshBounds() value
+  };
+
+  /// Where a data entry lives, for the data index
+  struct DataSlot
+  {
+    Node* m_node;                                 ///< Leaf
+    int m_index;                                  ///< Branch within the leaf
   };
 
   /// A link list of nodes for reinsertion after a delete operation
@@ -385,6 +739,7 @@ protected:
     std::vector<int> dataPointIds;
     double weight;
     DATATYPE data;  // Only meaningful for data points
+    const void* node = NULL;  // The tree node itself, the same across calls while it lives (ids are renumbered)
   };
   struct TreeStructure {
     std::vector<TreeNodeInfo> treeNodes;   // Regular tree nodes (internal + leaves)
@@ -397,6 +752,7 @@ protected:
 	// };
 	bool m_returnSearchPath = false;
 	mutable std::vector<SearchPathRecord> m_searchPath;
+	SearchCounters* m_searchCounters = NULL;     ///< Of the running weighted Search(), if it was given some
 
 
   Node* AllocNode();
@@ -427,7 +783,23 @@ protected:
   bool Overlap(Rect* a_rectA, Rect* a_rectB) const;
   ELEMTYPE SquareDistance(Rect const& a_rectA, Rect const& a_rectB) const;
   void ReInsert(Node* a_node, ListNode** a_listNode);
+  void CondenseRoot(ListNode* a_reInsertList, Node** a_root);
+  void Attach(Node* a_node, int a_index);
+  void MarkDirtyPath(Node* a_node);
+  void MarkChangedPath(Node* a_node);
+  Version CommitVersionRec(Node* a_node);
+  void ClearVersionsRec(Node* a_node);
+  void RefreshBoundsRec(Node* a_node, const std::function<ELEMTYPEREAL (const DATATYPE&)>& a_value);
+  void InvalidateBoundsRec(Node* a_node);
+  int ChildIndex(Node* a_parent, Node* a_child);
+  bool RemoveIndexed(const DATATYPE& a_dataId);
   bool Search(Node* a_node, Rect* a_rect, int& a_foundCount, std::function<bool (const DATATYPE&)> callback, int min_score) const;
+  bool Search(Node* a_node, Rect* a_rect, int& a_foundCount, const std::function<bool (const DATATYPE&)>& callback) const;
+  bool SearchBounded(Node* a_node, Rect* a_rect, int& a_foundCount, const NodeBoundFunc& a_nodeBound,
+                     ELEMTYPEREAL a_minBound, const std::function<bool (const DATATYPE&)>& callback) const;
+  static int LowestBit(uint64_t a_bits);
+  static void PackTiles(typename std::vector<Branch>::iterator a_begin, typename std::vector<Branch>::iterator a_end, int a_axis, int a_perNode);
+  static void BranchCoverage(const Node* a_node, double& a_union, double& a_multiple, double& a_pairwise);
   void RemoveAllRec(Node* a_node);
   void Reset();
   void CountRec(Node* a_node, int& a_count);
@@ -437,7 +809,11 @@ protected:
   void CopyRec(Node* current, Node* other);
 
   Node* m_root;                                    ///< Root of tree
+  int m_nodeCount = 0;                             ///< Nodes allocated, see NodeCount()
   ELEMTYPEREAL m_unitSphereVolume;                 ///< Unit sphere constant for required number of dimensions
+  bool m_dataIndexEnabled = false;                 ///< Maintain m_dataIndex
+  std::unordered_map<DATATYPE, DataSlot> m_dataIndex; ///< Data to leaf slot, see EnableDataIndex()
+  std::vector<Version> m_versions;                 ///< Roots of the committed versions, see CommitVersion()
 
 public:
   // return all the AABBs that form the RTree
@@ -493,6 +869,17 @@ public:
     }
   }
 
+  /// Flush buffered writes and ask the OS to put them on disk
+  bool Sync()
+  {
+    RTREE_ASSERT(m_file);
+#ifdef _WIN32
+    return fflush(m_file) == 0;
+#else
+    return fflush(m_file) == 0 && fsync(fileno(m_file)) == 0;
+#endif //_WIN32
+  }
+
   template< typename TYPE >
   size_t Write(const TYPE& a_value)
   {
@@ -558,6 +945,7 @@ RTREE_QUAL::RTree()
 RTREE_TEMPLATE
 RTREE_QUAL::RTree(const RTree& other) : RTree()
 {
+  m_dataIndexEnabled = other.m_dataIndexEnabled;
   CopyRec(m_root, other.m_root);
 }
 
@@ -596,10 +984,178 @@ void RTREE_QUAL::Insert(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMD
 RTREE_TEMPLATE
 void RTREE_QUAL::Remove(const DATATYPE& a_dataId)
 {
+  if(m_dataIndexEnabled)
+  {
+    RemoveIndexed(a_dataId);
+    return;
+  }
   RemoveRect(NULL, a_dataId, &m_root);
 }
 
 
+RTREE_TEMPLATE
+void RTREE_QUAL::EnableDataIndex()
+{
+  m_dataIndexEnabled = true;
+  m_dataIndex.clear();
+
+  std::vector<Node*> stack(1, m_root);
+  while(!stack.empty())
+  {
+    Node* node = stack.back();
+    stack.pop_back();
+    for(int index = 0; index < node->m_count; ++index)
+    {
+      Attach(node, index);
+      if(node->IsInternalNode())
+      {
+        stack.push_back(node->m_branch[index].m_child);
+      }
+    }
+  }
+}
+
+
+RTREE_TEMPLATE
+bool RTREE_QUAL::MarkDirty(const DATATYPE& a_dataId)
+{
+  auto it = m_dataIndex.find(a_dataId);
+  if(it == m_dataIndex.end())
+  {
+    return false;
+  }
+  MarkDirtyPath(it->second.m_node);
+  return true;
+}
+
+
+RTREE_TEMPLATE
+void RTREE_QUAL::RefreshBounds(std::function<ELEMTYPEREAL (const DATATYPE&)> a_value)
+{
+  if(m_root->m_dirty)
+  {
+    RefreshBoundsRec(m_root, a_value);
+  }
+}
+
+
+RTREE_TEMPLATE
+void RTREE_QUAL::RefreshBoundsRec(Node* a_node, const std::function<ELEMTYPEREAL (const DATATYPE&)>& a_value)
+{
+  ELEMTYPEREAL bound = std::numeric_limits<ELEMTYPEREAL>::lowest();
+  for(int index = 0; index < a_node->m_count; ++index)
+  {
+    Branch& branch = a_node->m_branch[index];
+    if(a_node->IsInternalNode())
+    {
+      if(branch.m_child->m_dirty)
+      {
+        RefreshBoundsRec(branch.m_child, a_value);
+      }
+      bound = RTREE_MAX(bound, branch.m_child->m_bound);
+    }
+    else
+    {
+      bound = RTREE_MAX(bound, a_value(branch.m_data));
+    }
+  }
+  a_node->m_bound = bound;
+  a_node->m_dirty = false;
+}
+
+
+RTREE_TEMPLATE
+void RTREE_QUAL::InvalidateBounds()
+{
+  InvalidateBoundsRec(m_root);
+}
+
+
+RTREE_TEMPLATE
+void RTREE_QUAL::InvalidateBoundsRec(Node* a_node)
+{
+  a_node->m_dirty = true;
+  if(a_node->IsInternalNode())
+  {
+    for(int index = 0; index < a_node->m_count; ++index)
+    {
+      InvalidateBoundsRec(a_node->m_branch[index].m_child);
+    }
+  }
+}
+
+
+RTREE_TEMPLATE
+bool RTREE_QUAL::Locate(const DATATYPE& a_dataId, ELEMTYPE a_min[NUMDIMS], ELEMTYPE a_max[NUMDIMS]) const
+{
+  auto it = m_dataIndex.find(a_dataId);
+  if(it == m_dataIndex.end())
+  {
+    return false;
+  }
+
+  const Rect& rect = it->second.m_node->m_branch[it->second.m_index].m_rect;
+  for(int axis=0; axis<NUMDIMS; ++axis)
+  {
+    a_min[axis] = rect.m_min[axis];
+    a_max[axis] = rect.m_max[axis];
+  }
+  return true;
+}
+
+
+RTREE_TEMPLATE
+bool RTREE_QUAL::Move(const DATATYPE& a_dataId, const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS])
+{
+  auto it = m_dataIndex.find(a_dataId);
+  if(it == m_dataIndex.end())
+  {
+    return false;
+  }
+
+  Rect rect;
+  for(int axis=0; axis<NUMDIMS; ++axis)
+  {
+    rect.m_min[axis] = a_min[axis];
+    rect.m_max[axis] = a_max[axis];
+  }
+
+  Node* leaf = it->second.m_node;
+  bool inPlace = true;
+  if(leaf->m_parent)
+  {
+    const Rect& cover = leaf->m_parent->m_branch[ChildIndex(leaf->m_parent, leaf)].m_rect;
+    for(int axis=0; axis<NUMDIMS; ++axis)
+    {
+      inPlace = inPlace && cover.m_min[axis] <= rect.m_min[axis] && rect.m_max[axis] <= cover.m_max[axis];
+    }
+  }
+
+  if(!inPlace)
+  {
+    DATATYPE data = a_dataId; // a_dataId may refer to the branch being removed
+    RemoveIndexed(data);
+    Insert(a_min, a_max, data);
+    return true;
+  }
+
+  // Still inside the leaf's cover: update the entry and shrink the covers above it where possible
+  leaf->m_branch[it->second.m_index].m_rect = rect;
+  MarkDirtyPath(leaf);
+  for(Node* node = leaf; node->m_parent; node = node->m_parent)
+  {
+    Rect& cover = node->m_parent->m_branch[ChildIndex(node->m_parent, node)].m_rect;
+    Rect newCover = NodeCover(node);
+    if(memcmp(&cover, &newCover, sizeof(Rect)) == 0)
+    {
+      break;
+    }
+    cover = newCover;
+  }
+  return true;
+}
+
+
 RTREE_TEMPLATE
 void RTREE_QUAL::Remove(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], const DATATYPE& a_dataId)
 {
@@ -623,7 +1179,8 @@ void RTREE_QUAL::Remove(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMD
 
 
 RTREE_TEMPLATE
-std::pair<int, std::vector<typename RTREE_QUAL::SearchPathRecord>> RTREE_QUAL::Search(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], std::function<bool (const DATATYPE&)> callback, bool a_returnSearchPath, int min_score)
+std::pair<int, std::vector<typename RTREE_QUAL::SearchPathRecord>> RTREE_QUAL::Search(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], std::function<bool (const DATATYPE&)> callback, bool a_returnSearchPath, int min_score,
+                                                                                      SearchCounters* a_counters)
 {
 #ifdef _DEBUG
   for(int index=0; index<NUMDIMS; ++index)
@@ -645,16 +1202,297 @@ std::pair<int, std::vector<typename RTREE_QUAL::SearchPathRecord>> RTREE_QUAL::S
   int foundCount = 0;
 	m_returnSearchPath = a_returnSearchPath;
 	m_searchPath.clear();
+	m_searchCounters = a_counters;
 
 	// If we are not returning the search path, just call the search function
 	// and return the number of found elements.
 	 
   Search(m_root, &rect, foundCount, callback, min_score);
+  m_searchCounters = NULL;
 
   return std::make_pair(foundCount, m_searchPath);
   
 }
 
+RTREE_TEMPLATE
+int RTREE_QUAL::Search(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], std::function<bool (const DATATYPE&)> callback) const
+{
+#ifdef _DEBUG
+  for(int index=0; index<NUMDIMS; ++index)
+  {
+    RTREE_ASSERT(a_min[index] <= a_max[index]);
+  }
+#endif //_DEBUG
+
+  Rect rect;
+
+  for(int axis=0; axis<NUMDIMS; ++axis)
+  {
+    rect.m_min[axis] = a_min[axis];
+    rect.m_max[axis] = a_max[axis];
+  }
+
+  int foundCount = 0;
+  Search(m_root, &rect, foundCount, callback);
+
+  return foundCount;
+}
+
+RTREE_TEMPLATE
+int RTREE_QUAL::SearchGroup(const ELEMTYPE a_min[][NUMDIMS], const ELEMTYPE a_max[][NUMDIMS], int a_queryCount,
+                            std::function<bool (int, const DATATYPE&)> callback,
+                            std::function<ELEMTYPEREAL (int, const ELEMTYPE*, const ELEMTYPE*, ELEMTYPEREAL)> a_nodeBound, ELEMTYPEREAL a_minBound) const
+{
+  RTREE_ASSERT(a_queryCount >= 0 && a_queryCount <= MAX_QUERY_GROUP);
+  RTREE_ASSERT(!a_nodeBound || BoundsFresh());
+
+  Rect rects[MAX_QUERY_GROUP];
+  for(int query=0; query<a_queryCount; ++query)
+  {
+    for(int axis=0; axis<NUMDIMS; ++axis)
+    {
+      rects[query].m_min[axis] = a_min[query][axis];
+      rects[query].m_max[axis] = a_max[query][axis];
+    }
+  }
+
+  // Each stack entry carries the set of queries whose rect overlaps the node, one bit per query
+  std::vector<std::pair<Node*, uint64_t>> toVisit;
+  uint64_t all = (a_queryCount == 64) ? ~uint64_t(0) : ((uint64_t(1) << a_queryCount) - 1);
+  if(all)
+  {
+    toVisit.emplace_back(m_root, all);
+  }
+
+  int foundCount = 0;
+
+  while(!toVisit.empty())
+  {
+    Node* node = toVisit.back().first;
+    uint64_t active = toVisit.back().second;
+    toVisit.pop_back();
+
+    for(int index=0; index < node->m_count; ++index)
+    {
+      Branch& branch = node->m_branch[index];
+
+      uint64_t hits = 0;
+      for(uint64_t rest = active; rest; rest &= rest - 1)
+      {
+        int query = LowestBit(rest);
+        if(Overlap(&rects[query], &branch.m_rect))
+        {
+          hits |= uint64_t(1) << query;
+        }
+      }
+      if(!hits)
+      {
+        continue;
+      }
+
+      if(node->IsInternalNode())
+      {
+        if(a_nodeBound)
+        {
+          for(uint64_t rest = hits; rest; rest &= rest - 1)
+          {
+            int query = LowestBit(rest);
+            if(a_nodeBound(query, branch.m_rect.m_min, branch.m_rect.m_max, branch.m_child->m_bound) < a_minBound)
+            {
+              hits &= ~(uint64_t(1) << query);
+            }
+          }
+          if(!hits)
+          {
+            continue;
+          }
+        }
+        RTREE_PREFETCH(branch.m_child);
+        toVisit.emplace_back(branch.m_child, hits);
+      }
+      else
+      {
+        for(; hits; hits &= hits - 1)
+        {
+          ++foundCount;
+          if(callback && !callback(LowestBit(hits), branch.m_data))
+          {
+            return foundCount; // Don't continue searching
+          }
+        }
+      }
+    }
+  }
+
+  return foundCount;
+}
+
+RTREE_TEMPLATE
+int RTREE_QUAL::SearchBounded(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], const NodeBoundFunc& a_nodeBound,
+                              ELEMTYPEREAL a_minBound, std::function<bool (const DATATYPE&)> callback) const
+{
+  RTREE_ASSERT(BoundsFresh());
+
+  Rect rect;
+  for(int axis=0; axis<NUMDIMS; ++axis)
+  {
+    rect.m_min[axis] = a_min[axis];
+    rect.m_max[axis] = a_max[axis];
+  }
+
+  int foundCount = 0;
+  SearchBounded(m_root, &rect, foundCount, a_nodeBound, a_minBound, callback);
+  return foundCount;
+}
+
+RTREE_TEMPLATE
+int RTREE_QUAL::SearchBestFirst(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], const NodeBoundFunc& a_nodeBound,
+                                std::function<ELEMTYPEREAL (const DATATYPE&)> a_score, ELEMTYPEREAL a_minScore,
+                                std::function<bool (const DATATYPE&, ELEMTYPEREAL)> callback,
+                                std::function<bool ()> a_interrupt, BestFirstProgress* a_progress,
+                                SearchCounters* a_counters) const
+{
+  RTREE_ASSERT(BoundsFresh());
+
+  Rect rect;
+  for(int axis=0; axis<NUMDIMS; ++axis)
+  {
+    rect.m_min[axis] = a_min[axis];
+    rect.m_max[axis] = a_max[axis];
+  }
+
+  // A node to expand, or (m_node == NULL) a scored entry to report
+  struct QueueItem
+  {
+    ELEMTYPEREAL m_key;
+    Node* m_node;
+    const DATATYPE* m_data;
+
+    // Highest key on top; on a tie entries go first, they can be reported right away
+    bool operator<(const QueueItem& a_other) const
+    {
+      if(m_key != a_other.m_key)
+      {
+        return m_key < a_other.m_key;
+      }
+      return m_node && !a_other.m_node;
+    }
+  };
+
+  std::priority_queue<QueueItem> queue;
+  queue.push(QueueItem{std::numeric_limits<ELEMTYPEREAL>::max(), m_root, NULL});
+
+  int foundCount = 0;
+  bool interrupted = false;
+  int leavesScanned = 0;
+  int internalScanned = 0;
+  int internalBranches = 0;
+  uint64_t pruned = 0;
+  uint64_t overlapTests = 0;
+  std::vector<int> queuedPerLevel(m_root->m_level + 1, 0);  // Nodes in the queue by level
+  while(!queue.empty())
+  {
+    if(a_interrupt && a_interrupt())
+    {
+      interrupted = true;
+      break;
+    }
+
+    QueueItem item = queue.top();
+    queue.pop();
+
+    if(!item.m_node)
+    {
+      ++foundCount;
+      if(callback && !callback(*item.m_data, item.m_key))
+      {
+        break; // Don't continue searching
+      }
+      continue;
+    }
+
+    Node* node = item.m_node;
+    if(node != m_root)
+    {
+      --queuedPerLevel[node->m_level];
+    }
+    overlapTests += node->m_count;
+    if(node->IsLeaf())
+    {
+      ++leavesScanned;
+    }
+    else
+    {
+      ++internalScanned;
+      internalBranches += node->m_count;
+    }
+
+    for(int index=0; index < node->m_count; ++index)
+    {
+      Branch& branch = node->m_branch[index];
+      if(!Overlap(&rect, &branch.m_rect))
+      {
+        pruned += node->IsInternalNode();
+        continue;
+      }
+
+      if(node->IsInternalNode())
+      {
+        ELEMTYPEREAL bound = a_nodeBound(branch.m_rect.m_min, branch.m_rect.m_max, branch.m_child->m_bound);
+        if(bound >= a_minScore)
+        {
+          queue.push(QueueItem{bound, branch.m_child, NULL});
+          ++queuedPerLevel[branch.m_child->m_level];
+        }
+        else
+        {
+          ++pruned;
+        }
+      }
+      else
+      {
+        ELEMTYPEREAL score = a_score(branch.m_data);
+        if(score >= a_minScore)
+        {
+          queue.push(QueueItem{score, NULL, &branch.m_data});
+        }
+      }
+    }
+  }
+
+  if(a_counters)
+  {
+    a_counters->m_nodesVisited += leavesScanned + internalScanned;
+    a_counters->m_nodesPruned += pruned;
+    a_counters->m_leavesScanned += leavesScanned;
+    a_counters->m_overlapTests += overlapTests;
+    a_counters->m_hits += foundCount;
+  }
+
+  if(a_progress)
+  {
+    a_progress->m_interrupted = interrupted;
+    a_progress->m_leavesScanned = leavesScanned;
+    a_progress->m_leavesLeft = 0;
+    a_progress->m_boundLeft = queue.empty() ? std::numeric_limits<ELEMTYPEREAL>::lowest() : queue.top().m_key;
+    if(interrupted)
+    {
+      // A queued node at level L covers about fanout^L leaves, fanout as seen so far
+      double fanout = internalScanned ? (double)internalBranches / internalScanned : (double)(MINNODES + MAXNODES) / 2;
+      if(leavesScanned + internalScanned == 0)
+      {
+        ++queuedPerLevel[m_root->m_level]; // Interrupted before the root was expanded
+      }
+      for(int level = 0; level < (int)queuedPerLevel.size(); ++level)
+      {
+        a_progress->m_leavesLeft += queuedPerLevel[level] * pow(fanout, level);
+      }
+    }
+  }
+
+  return foundCount;
+}
+
 RTREE_TEMPLATE
 size_t RTREE_QUAL::NNSearch(
     const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS],
@@ -739,7 +1577,7 @@ size_t RTREE_QUAL::NNSearch(
 RTREE_TEMPLATE
 int RTREE_QUAL::Count()
 {
-  double count = 0;
+  int count = 0;
   CountRec(m_root, count);
 
   return count;
@@ -849,6 +1687,7 @@ bool RTREE_QUAL::LoadRec(Node* a_node, RTFileStream& a_stream)
 
       curBranch->m_child = AllocNode();
       LoadRec(curBranch->m_child, a_stream);
+      Attach(a_node, index);
     }
   }
   else // A leaf node
@@ -861,6 +1700,7 @@ bool RTREE_QUAL::LoadRec(Node* a_node, RTFileStream& a_stream)
       a_stream.ReadArray(curBranch->m_rect.m_max, NUMDIMS);
 
       a_stream.Read(curBranch->m_data);
+      Attach(a_node, index);
     }
   }
 
@@ -891,6 +1731,7 @@ void RTREE_QUAL::CopyRec(Node* current, Node* other)
 
       currentBranch->m_child = AllocNode();
       CopyRec(currentBranch->m_child, otherBranch->m_child);
+      Attach(current, index);
     }
   }
   else // A leaf node
@@ -909,6 +1750,7 @@ void RTREE_QUAL::CopyRec(Node* current, Node* other)
                 currentBranch->m_rect.m_max);
 
       currentBranch->m_data = otherBranch->m_data;
+      Attach(current, index);
     }
   }
 }
@@ -998,12 +1840,292 @@ void RTREE_QUAL::RemoveAll()
 {
   // Delete all existing nodes
   Reset();
+  m_dataIndex.clear();
 
   m_root = AllocNode();
   m_root->m_level = 0;
 }
 
 
+RTREE_TEMPLATE
+void RTREE_QUAL::BulkLoad(std::vector<BulkEntry> a_entries, double a_fill)
+{
+  RemoveAll();
+
+  const int perNode = RTREE_MAX((int)MINNODES, RTREE_MIN((int)MAXNODES, (int)(a_fill * MAXNODES)));
+
+  std::vector<Branch> branches(a_entries.size());
+  for(size_t index=0; index < a_entries.size(); ++index)
+  {
+    for(int axis=0; axis<NUMDIMS; ++axis)
+    {
+      branches[index].m_rect.m_min[axis] = a_entries[index].m_min[axis];
+      branches[index].m_rect.m_max[axis] = a_entries[index].m_max[axis];
+    }
+    branches[index].m_data = a_entries[index].m_data;
+  }
+  if(m_dataIndexEnabled)
+  {
+    m_dataIndex.reserve(a_entries.size());
+  }
+  std::vector<BulkEntry>().swap(a_entries);
+
+  // Pack one level into nodes until the branches left fit in the root
+  int level = 0;
+  std::vector<Branch> parents;
+  while(branches.size() > (size_t)MAXNODES)
+  {
+    PackTiles(branches.begin(), branches.end(), 0, perNode);
+
+    parents.clear();
+    for(size_t start=0; start < branches.size(); start += perNode)
+    {
+      Node* node = AllocNode();
+      node->m_level = level;
+      node->m_count = (int)RTREE_MIN(branches.size() - start, (size_t)perNode);
+      for(int index=0; index < node->m_count; ++index)
+      {
+        node->m_branch[index] = branches[start + index];
+        Attach(node, index);
+      }
+
+      Branch parent;
+      parent.m_rect = NodeCover(node);
+      parent.m_child = node;
+      parents.push_back(parent);
+    }
+    branches.swap(parents);
+    ++level;
+  }
+
+  m_root->m_level = level;
+  m_root->m_count = (int)branches.size();
+  for(int index=0; index < m_root->m_count; ++index)
+  {
+    m_root->m_branch[index] = branches[index];
+    Attach(m_root, index);
+  }
+}
+
+
+// Sort a run of branches into tiles of a_perNode for BulkLoad(): by center along a_axis, cut into
+// slabs of whole tiles, and each slab sorted along the next axis the same way.
+RTREE_TEMPLATE
+void RTREE_QUAL::PackTiles(typename std::vector<Branch>::iterator a_begin, typename std::vector<Branch>::iterator a_end, int a_axis, int a_perNode)
+{
+  std::sort(a_begin, a_end, [a_axis](const Branch& a_branchA, const Branch& a_branchB) {
+    return a_branchA.m_rect.m_min[a_axis] + a_branchA.m_rect.m_max[a_axis] < a_branchB.m_rect.m_min[a_axis] + a_branchB.m_rect.m_max[a_axis];
+  });
+  if(a_axis == NUMDIMS - 1)
+  {
+    return;
+  }
+
+  const size_t count = a_end - a_begin;
+  const double tiles = ceil((double)count / a_perNode);
+  const double slabs = ceil(pow(tiles, 1.0 / (NUMDIMS - a_axis)));
+  const size_t slabSize = (size_t)ceil(tiles / slabs) * a_perNode;
+  for(size_t start=0; start < count; start += slabSize)
+  {
+    PackTiles(a_begin + start, a_begin + RTREE_MIN(start + slabSize, count), a_axis + 1, a_perNode);
+  }
+}
+
+
+RTREE_TEMPLATE
+void RTREE_QUAL::Snapshot(FrameSnapshot& a_snapshot) const
+{
+  a_snapshot.m_nodes.clear();
+  a_snapshot.m_entries.clear();
+  if(!m_root)
+  {
+    return;
+  }
+
+  // m_nodes doubles as the breadth-first queue
+  FrameNode root;
+  root.m_node = m_root;
+  a_snapshot.m_nodes.push_back(root);
+  for(size_t next=0; next < a_snapshot.m_nodes.size(); ++next)
+  {
+    const Node* node = static_cast<const Node*>(a_snapshot.m_nodes[next].m_node);
+    FrameNode frameNode;
+    frameNode.m_node = node;
+    frameNode.m_level = node->m_level;
+    frameNode.m_weight = node->m_weight;
+    frameNode.m_first = (int)a_snapshot.m_entries.size();
+    frameNode.m_count = node->m_count;
+    for(int axis=0; axis<NUMDIMS; ++axis)
+    {
+      frameNode.m_min[axis] = node->m_count > 0 ? node->m_branch[0].m_rect.m_min[axis] : ELEMTYPE(0);
+      frameNode.m_max[axis] = node->m_count > 0 ? node->m_branch[0].m_rect.m_max[axis] : ELEMTYPE(0);
+    }
+
+    for(int index=0; index < node->m_count; ++index)
+    {
+      const Branch& branch = node->m_branch[index];
+      FrameEntry entry;
+      for(int axis=0; axis<NUMDIMS; ++axis)
+      {
+        entry.m_min[axis] = branch.m_rect.m_min[axis];
+        entry.m_max[axis] = branch.m_rect.m_max[axis];
+        frameNode.m_min[axis] = RTREE_MIN(frameNode.m_min[axis], branch.m_rect.m_min[axis]);
+        frameNode.m_max[axis] = RTREE_MAX(frameNode.m_max[axis], branch.m_rect.m_max[axis]);
+      }
+      entry.m_child = -1;
+      entry.m_data = DATATYPE();
+      if(node->m_level > 0)
+      {
+        entry.m_child = (int)a_snapshot.m_nodes.size();
+        FrameNode child;
+        child.m_node = branch.m_child;
+        a_snapshot.m_nodes.push_back(child);
+      }
+      else
+      {
+        entry.m_data = branch.m_data;
+      }
+      a_snapshot.m_entries.push_back(entry);
+    }
+    a_snapshot.m_nodes[next] = frameNode;
+  }
+}
+
+
+RTREE_TEMPLATE
+void RTREE_QUAL::Snapshot(FrameSnapshot& a_snapshot, const Version& a_version)
+{
+  a_snapshot.m_nodes.clear();
+  a_snapshot.m_entries.clear();
+
+  // Images queued breadth-first, as Snapshot() queues nodes
+  std::vector<const VersionNode*> images(1, a_version.get());
+  for(size_t next=0; next < images.size(); ++next)
+  {
+    const VersionNode* image = images[next];
+    FrameNode frameNode;
+    frameNode.m_node = image->m_node;
+    frameNode.m_level = image->m_level;
+    frameNode.m_weight = image->m_weight;
+    frameNode.m_first = (int)a_snapshot.m_entries.size();
+    frameNode.m_count = (int)image->m_branches.size();
+    for(int axis=0; axis<NUMDIMS; ++axis)
+    {
+      frameNode.m_min[axis] = frameNode.m_count > 0 ? image->m_branches[0].m_min[axis] : ELEMTYPE(0);
+      frameNode.m_max[axis] = frameNode.m_count > 0 ? image->m_branches[0].m_max[axis] : ELEMTYPE(0);
+    }
+
+    for(const VersionBranch& branch : image->m_branches)
+    {
+      FrameEntry entry;
+      for(int axis=0; axis<NUMDIMS; ++axis)
+      {
+        entry.m_min[axis] = branch.m_min[axis];
+        entry.m_max[axis] = branch.m_max[axis];
+        frameNode.m_min[axis] = RTREE_MIN(frameNode.m_min[axis], branch.m_min[axis]);
+        frameNode.m_max[axis] = RTREE_MAX(frameNode.m_max[axis], branch.m_max[axis]);
+      }
+      entry.m_child = -1;
+      entry.m_data = DATATYPE();
+      if(image->m_level > 0)
+      {
+        entry.m_child = (int)images.size();
+        images.push_back(branch.m_child.get());
+      }
+      else
+      {
+        entry.m_data = branch.m_data;
+      }
+      a_snapshot.m_entries.push_back(entry);
+    }
+    a_snapshot.m_nodes.push_back(frameNode);
+  }
+}
+
+
+RTREE_TEMPLATE
+int RTREE_QUAL::CommitVersion()
+{
+  m_versions.push_back(CommitVersionRec(m_root));
+  return (int)m_versions.size() - 1;
+}
+
+
+// Copy the changed nodes of the subtree, reusing the last copy of every unchanged one
+RTREE_TEMPLATE
+typename RTREE_QUAL::Version RTREE_QUAL::CommitVersionRec(Node* a_node)
+{
+  if(!a_node->m_changed)
+  {
+    return a_node->m_image;
+  }
+
+  std::shared_ptr<VersionNode> image = std::make_shared<VersionNode>();
+  image->m_node = a_node;
+  image->m_level = a_node->m_level;
+  image->m_weight = a_node->m_weight;
+  image->m_branches.resize(a_node->m_count);
+  for(int index=0; index < a_node->m_count; ++index)
+  {
+    const Branch& branch = a_node->m_branch[index];
+    VersionBranch& frozen = image->m_branches[index];
+    for(int axis=0; axis<NUMDIMS; ++axis)
+    {
+      frozen.m_min[axis] = branch.m_rect.m_min[axis];
+      frozen.m_max[axis] = branch.m_rect.m_max[axis];
+    }
+    if(a_node->IsInternalNode())
+    {
+      frozen.m_child = CommitVersionRec(branch.m_child);
+    }
+    else
+    {
+      frozen.m_data = branch.m_data;
+    }
+  }
+
+  a_node->m_image = image;
+  a_node->m_changed = false;
+  return a_node->m_image;
+}
+
+
+RTREE_TEMPLATE
+void RTREE_QUAL::ClearVersions()
+{
+  m_versions.clear();
+  if(m_root)
+  {
+    ClearVersionsRec(m_root);
+  }
+}
+
+
+RTREE_TEMPLATE
+void RTREE_QUAL::ClearVersionsRec(Node* a_node)
+{
+  a_node->m_image.reset();
+  a_node->m_changed = true;
+  if(a_node->IsInternalNode())
+  {
+    for(int index=0; index < a_node->m_count; ++index)
+    {
+      ClearVersionsRec(a_node->m_branch[index].m_child);
+    }
+  }
+}
+
+
+RTREE_TEMPLATE
+void RTREE_QUAL::Swap(RTree& a_other)
+{
+  std::swap(m_root, a_other.m_root);
+  std::swap(m_nodeCount, a_other.m_nodeCount);
+  std::swap(m_dataIndexEnabled, a_other.m_dataIndexEnabled);
+  m_dataIndex.swap(a_other.m_dataIndex);
+}
+
+
 RTREE_TEMPLATE
 void RTREE_QUAL::Reset()
 {
@@ -1044,6 +2166,7 @@ typename RTREE_QUAL::Node* RTREE_QUAL::AllocNode()
   // EXAMPLE
 #endif // RTREE_DONT_USE_MEMPOOLS
   InitNode(newNode);
+  ++m_nodeCount;
   return newNode;
 }
 
@@ -1052,6 +2175,7 @@ RTREE_TEMPLATE
 void RTREE_QUAL::FreeNode(Node* a_node)
 {
   RTREE_ASSERT(a_node);
+  --m_nodeCount;
 
 #ifdef RTREE_DONT_USE_MEMPOOLS
   delete a_node;
@@ -1090,6 +2214,10 @@ void RTREE_QUAL::InitNode(Node* a_node)
 {
   a_node->m_count = 0;
   a_node->m_level = -1;
+  a_node->m_parent = NULL;
+  a_node->m_dirty = true;
+  a_node->m_changed = true;
+  a_node->m_image.reset();
 }
 
 
@@ -1244,6 +2372,7 @@ bool RTREE_QUAL::AddBranch(const Branch* a_branch, Node* a_node, Node** a_newNod
   {
     a_node->m_branch[a_node->m_count] = *a_branch;
     ++a_node->m_count;
+    Attach(a_node, a_node->m_count - 1);
 
     return false;
   }
@@ -1265,10 +2394,82 @@ void RTREE_QUAL::DisconnectBranch(Node* a_node, int a_index)
   RTREE_ASSERT(a_node && (a_index >= 0) && (a_index < MAXNODES));
   RTREE_ASSERT(a_node->m_count > 0);
 
-  // Remove element by swapping with the last element to prevent gaps in array
-  a_node->m_branch[a_index] = a_node->m_branch[a_node->m_count - 1];
+  if(m_dataIndexEnabled && a_node->IsLeaf())
+  {
+    m_dataIndex.erase(a_node->m_branch[a_index].m_data);
+  }
+  MarkDirtyPath(a_node);
+
+  // Remove element by swapping with the last element to prevent gaps in array
+  a_node->m_branch[a_index] = a_node->m_branch[a_node->m_count - 1];
+
+  --a_node->m_count;
+  if(a_index < a_node->m_count)
+  {
+    Attach(a_node, a_index);
+  }
+}
+
+
+// Point the moved-in branch back at its new place: the child's parent link, or the data index slot.
+RTREE_TEMPLATE
+void RTREE_QUAL::Attach(Node* a_node, int a_index)
+{
+  Branch& branch = a_node->m_branch[a_index];
+  if(a_node->IsInternalNode())
+  {
+    branch.m_child->m_parent = a_node;
+  }
+  else if(m_dataIndexEnabled)
+  {
+    DataSlot& slot = m_dataIndex[branch.m_data];
+    slot.m_node = a_node;
+    slot.m_index = a_index;
+  }
+
+  // The node gained an entry or subtree, so its bound may have grown
+  MarkDirtyPath(a_node);
+}
+
+
+// Flag a node and its ancestors for RefreshBounds() and the next CommitVersion().  Stops at the first
+// one with both flags, whose ancestors have them already.
+RTREE_TEMPLATE
+void RTREE_QUAL::MarkDirtyPath(Node* a_node)
+{
+  for(Node* node = a_node; node && !(node->m_dirty && node->m_changed); node = node->m_parent)
+  {
+    node->m_dirty = true;
+    node->m_changed = true;
+  }
+}
+
+
+// Flag a node and its ancestors for the next CommitVersion() only, for changes that leave the
+// bounds alone (weights)
+RTREE_TEMPLATE
+void RTREE_QUAL::MarkChangedPath(Node* a_node)
+{
+  for(Node* node = a_node; node && !node->m_changed; node = node->m_parent)
+  {
+    node->m_changed = true;
+  }
+}
+
 
-  --a_node->m_count;
+// Index of the branch in a_parent that points to a_child
+RTREE_TEMPLATE
+int RTREE_QUAL::ChildIndex(Node* a_parent, Node* a_child)
+{
+  for(int index = 0; index < a_parent->m_count; ++index)
+  {
+    if(a_parent->m_branch[index].m_child == a_child)
+    {
+      return index;
+    }
+  }
+  RTREE_ASSERT(0);
+  return -1;
 }
 
 
@@ -1664,41 +2865,87 @@ bool RTREE_QUAL::RemoveRect(Rect* a_rect, const DATATYPE& a_id, Node** a_root)
   if(!RemoveRectRec(a_rect, a_id, *a_root, &reInsertList))
   {
     // Found and deleted a data item
-    // Reinsert any branches from eliminated nodes
-    while(reInsertList)
-    {
-      Node* tempNode = reInsertList->m_node;
+    CondenseRoot(reInsertList, a_root);
+    return false;
+  }
+  else
+  {
+    return true;
+  }
+}
 
-      for(int index = 0; index < tempNode->m_count; ++index)
-      {
-        // TODO go over this code. should I use (tempNode->m_level - 1)?
-        InsertRect(tempNode->m_branch[index],
-                   a_root,
-                   tempNode->m_level);
-      }
 
-      ListNode* remLNode = reInsertList;
-      reInsertList = reInsertList->m_next;
+// Same as RemoveRect, but finds the leaf through the data index and walks up the parent links
+// instead of descending from the root.  Returns true if the data was found and removed.
+RTREE_TEMPLATE
+bool RTREE_QUAL::RemoveIndexed(const DATATYPE& a_dataId)
+{
+  auto it = m_dataIndex.find(a_dataId);
+  if(it == m_dataIndex.end())
+  {
+    return false;
+  }
+
+  Node* node = it->second.m_node;
+  DisconnectBranch(node, it->second.m_index);
 
-      FreeNode(remLNode->m_node);
-      FreeListNode(remLNode);
+  // Shrink covers on the path to the root, eliminating nodes that fell below the minimum fill
+  ListNode* reInsertList = NULL;
+  while(node->m_parent)
+  {
+    Node* parent = node->m_parent;
+    int index = ChildIndex(parent, node);
+    if(node->m_count >= MINNODES)
+    {
+      parent->m_branch[index].m_rect = NodeCover(node);
     }
-
-    // Check for redundant root (not leaf, 1 child) and eliminate TODO replace
-    // if with while? In case there is a whole branch of redundant roots...
-    if((*a_root)->m_count == 1 && (*a_root)->IsInternalNode())
+    else
     {
-      Node* tempNode = (*a_root)->m_branch[0].m_child;
+      ReInsert(node, &reInsertList);
+      DisconnectBranch(parent, index);
+    }
+    node = parent;
+  }
+
+  CondenseRoot(reInsertList, &m_root);
+  return true;
+}
+
+
+// Second half of a removal: reinsert the branches of eliminated nodes and drop a redundant root.
+RTREE_TEMPLATE
+void RTREE_QUAL::CondenseRoot(ListNode* a_reInsertList, Node** a_root)
+{
+  // Reinsert any branches from eliminated nodes
+  while(a_reInsertList)
+  {
+    Node* tempNode = a_reInsertList->m_node;
 
-      RTREE_ASSERT(tempNode);
-      FreeNode(*a_root);
-      *a_root = tempNode;
+    for(int index = 0; index < tempNode->m_count; ++index)
+    {
+      // TODO go over this code. should I use (tempNode->m_level - 1)?
+      InsertRect(tempNode->m_branch[index],
+                 a_root,
+                 tempNode->m_level);
     }
-    return false;
+
+    ListNode* remLNode = a_reInsertList;
+    a_reInsertList = a_reInsertList->m_next;
+
+    FreeNode(remLNode->m_node);
+    FreeListNode(remLNode);
   }
-  else
+
+  // Check for redundant root (not leaf, 1 child) and eliminate TODO replace
+  // if with while? In case there is a whole branch of redundant roots...
+  if((*a_root)->m_count == 1 && (*a_root)->IsInternalNode())
   {
-    return true;
+    Node* tempNode = (*a_root)->m_branch[0].m_child;
+
+    RTREE_ASSERT(tempNode);
+    FreeNode(*a_root);
+    *a_root = tempNode;
+    tempNode->m_parent = NULL;
   }
 }
 
@@ -1820,6 +3067,14 @@ bool RTREE_QUAL::Search(Node* a_node, Rect* a_rect, int& a_foundCount,
     m_searchPath.push_back(record);
   }
 
+  if (m_searchCounters) {
+    ++m_searchCounters->m_nodesVisited;
+    m_searchCounters->m_overlapTests += a_node->m_count;
+    if (a_node->IsLeaf()) {
+      ++m_searchCounters->m_leavesScanned;
+    }
+  }
+
 
   // struct DescendingByFirst {
   //     bool operator()(const std::pair<int, Node*>& a, const std::pair<int, Node*>& b) const {
@@ -1835,6 +3090,9 @@ bool RTREE_QUAL::Search(Node* a_node, Rect* a_rect, int& a_foundCount,
         candidates.emplace_back(child->m_weight, child);
       }
     }
+    if (m_searchCounters) {
+      m_searchCounters->m_nodesPruned += a_node->m_count - candidates.size();
+    }
     
     std::sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
 
@@ -1861,6 +3119,9 @@ bool RTREE_QUAL::Search(Node* a_node, Rect* a_rect, int& a_foundCount,
       double weight = pair.first;
       DATATYPE id = pair.second;
       ++a_foundCount;
+      if (m_searchCounters) {
+        ++m_searchCounters->m_hits;
+      }
 
       if (m_returnSearchPath) {
         SearchPathRecord dataRecord;
@@ -1880,6 +3141,128 @@ bool RTREE_QUAL::Search(Node* a_node, Rect* a_rect, int& a_foundCount,
   return true;
 }
 
+// Bounded search in an index tree or subtree, see SearchBounded().
+RTREE_TEMPLATE
+bool RTREE_QUAL::SearchBounded(Node* a_node, Rect* a_rect, int& a_foundCount, const NodeBoundFunc& a_nodeBound,
+                               ELEMTYPEREAL a_minBound, const std::function<bool (const DATATYPE&)>& callback) const
+{
+  RTREE_ASSERT(a_node);
+  RTREE_ASSERT(a_node->m_level >= 0);
+  RTREE_ASSERT(a_rect);
+
+  if(a_node->IsInternalNode())
+  {
+    // Bound every overlapping child, then descend best first
+    std::pair<ELEMTYPEREAL, Node*> candidates[MAXNODES];
+    int candidateCount = 0;
+    for(int index=0; index < a_node->m_count; ++index)
+    {
+      Branch& branch = a_node->m_branch[index];
+      if(Overlap(a_rect, &branch.m_rect))
+      {
+        ELEMTYPEREAL bound = a_nodeBound(branch.m_rect.m_min, branch.m_rect.m_max, branch.m_child->m_bound);
+        if(bound >= a_minBound)
+        {
+          // Insertion sort, best first, over at most MAXNODES entries (std::sort here trips -Warray-bounds)
+          int slot = candidateCount++;
+          for(; slot > 0 && candidates[slot - 1].first < bound; --slot)
+          {
+            candidates[slot] = candidates[slot - 1];
+          }
+          candidates[slot] = std::make_pair(bound, branch.m_child);
+        }
+      }
+    }
+
+    for(int index=0; index < candidateCount; ++index)
+    {
+      if(!SearchBounded(candidates[index].second, a_rect, a_foundCount, a_nodeBound, a_minBound, callback))
+      {
+        return false; // Don't continue searching
+      }
+    }
+  }
+  else
+  {
+    for(int index=0; index < a_node->m_count; ++index)
+    {
+      if(Overlap(a_rect, &a_node->m_branch[index].m_rect))
+      {
+        ++a_foundCount;
+        if(callback && !callback(a_node->m_branch[index].m_data))
+        {
+          return false; // Don't continue searching
+        }
+      }
+    }
+  }
+
+  return true; // Continue searching
+}
+
+// Index of the lowest set bit, a_bits must not be zero.
+RTREE_TEMPLATE
+int RTREE_QUAL::LowestBit(uint64_t a_bits)
+{
+  RTREE_ASSERT(a_bits);
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(a_bits);
+#else
+  int index = 0;
+  while(!(a_bits & 1))
+  {
+    a_bits >>= 1;
+    ++index;
+  }
+  return index;
+#endif //__GNUC__
+}
+
+// Plain overlap search: no weight ordering, no search path, no shared state.
+RTREE_TEMPLATE
+bool RTREE_QUAL::Search(Node* a_node, Rect* a_rect, int& a_foundCount,
+                        const std::function<bool (const DATATYPE&)>& callback) const
+{
+  RTREE_ASSERT(a_node);
+  RTREE_ASSERT(a_node->m_level >= 0);
+  RTREE_ASSERT(a_rect);
+
+  if(a_node->IsInternalNode())
+  {
+    // This is an internal node in the tree
+    for(int index=0; index < a_node->m_count; ++index)
+    {
+      if(Overlap(a_rect, &a_node->m_branch[index].m_rect))
+      {
+        if(!Search(a_node->m_branch[index].m_child, a_rect, a_foundCount, callback))
+        {
+          // The callback indicated to stop searching
+          return false;
+        }
+      }
+    }
+  }
+  else
+  {
+    // This is a leaf node
+    for(int index=0; index < a_node->m_count; ++index)
+    {
+      if(Overlap(a_rect, &a_node->m_branch[index].m_rect))
+      {
+        const DATATYPE& id = a_node->m_branch[index].m_data;
+        ++a_foundCount;
+
+        if(callback && !callback(id))
+        {
+          return false; // Don't continue searching
+        }
+      }
+    }
+  }
+
+  return true; // Continue searching
+}
+
 RTREE_TEMPLATE
 std::vector<typename RTREE_QUAL::Rect> RTREE_QUAL::ListTree() const
 {
@@ -1916,6 +3299,180 @@ std::vector<typename RTREE_QUAL::Rect> RTREE_QUAL::ListTree() const
   return treeList;
 }
 
+RTREE_TEMPLATE
+typename RTREE_QUAL::TreeStats RTREE_QUAL::Stats() const
+{
+  RTREE_ASSERT(m_root);
+  return Stats(m_root->m_level + 1);
+}
+
+RTREE_TEMPLATE
+typename RTREE_QUAL::TreeStats RTREE_QUAL::Stats(int a_levels) const
+{
+  RTREE_ASSERT(m_root);
+
+  // Levels below this one are not walked
+  const int lowestLevel = std::max(0, m_root->m_level + 1 - a_levels);
+
+  TreeStats stats = TreeStats();
+  stats.m_height = m_root->m_level + 1;
+  stats.m_nodesPerLevel.assign(stats.m_height, 0);
+  std::vector<int> branchesPerLevel(stats.m_height, 0);
+
+  std::vector<Node*> toVisit;
+  toVisit.push_back(m_root);
+
+  while (!toVisit.empty()) {
+    Node* node = toVisit.back();
+    toVisit.pop_back();
+
+    ++stats.m_nodesPerLevel[node->m_level];
+    branchesPerLevel[node->m_level] += node->m_count;
+    if(node->IsLeaf())
+    {
+      stats.m_entries += node->m_count;
+    }
+    else if(node->m_level > lowestLevel)
+    {
+      for(int index=0; index < node->m_count; ++index)
+      {
+        toVisit.push_back(node->m_branch[index].m_child);
+      }
+    }
+    if(node->m_count == 0)
+    {
+      continue;
+    }
+
+    Rect cover = node->m_branch[0].m_rect;
+    for(int index=1; index < node->m_count; ++index)
+    {
+      for(int axis=0; axis<NUMDIMS; ++axis)
+      {
+        cover.m_min[axis] = std::min(cover.m_min[axis], node->m_branch[index].m_rect.m_min[axis]);
+        cover.m_max[axis] = std::max(cover.m_max[axis], node->m_branch[index].m_rect.m_max[axis]);
+      }
+    }
+    double coverArea = 1;
+    for(int axis=0; axis<NUMDIMS; ++axis)
+    {
+      coverArea *= (double)cover.m_max[axis] - (double)cover.m_min[axis];
+    }
+
+    double unionArea, multipleArea, pairwiseArea;
+    BranchCoverage(node, unionArea, multipleArea, pairwiseArea);
+    stats.m_coverArea += coverArea;
+    stats.m_overlapArea += multipleArea;
+    stats.m_pairwiseOverlapArea += pairwiseArea;
+    stats.m_deadSpace += coverArea - unionArea;
+  }
+
+  int branches = 0;
+  stats.m_fillPerLevel.assign(stats.m_height, 0);
+  for(int level=0; level < stats.m_height; ++level)
+  {
+    stats.m_nodes += stats.m_nodesPerLevel[level];
+    branches += branchesPerLevel[level];
+    if(stats.m_nodesPerLevel[level])
+    {
+      stats.m_fillPerLevel[level] = (double)branchesPerLevel[level] / ((double)stats.m_nodesPerLevel[level] * MAXNODES);
+    }
+  }
+  stats.m_fillFactor = stats.m_nodes ? (double)branches / ((double)stats.m_nodes * MAXNODES) : 0;
+
+  stats.m_nodeBytes = stats.m_nodes * sizeof(Node);
+  stats.m_dataBytes = stats.m_entries * sizeof(DATATYPE);
+  // One heap node per element plus the bucket array, as in common unordered_map implementations
+  stats.m_indexBytes = m_dataIndex.size() * (sizeof(typename std::unordered_map<DATATYPE, DataSlot>::value_type) + 2 * sizeof(void*))
+                     + m_dataIndex.bucket_count() * sizeof(void*);
+  return stats;
+}
+
+// Area of a node's cover taken by at least one branch (a_union) and by two or more (a_multiple), and
+// the sum of the pairwise intersections (a_pairwise).  The branch rects cut the cover into a grid
+// of at most (2 * MAXNODES - 1)^NUMDIMS cells, each covered by a fixed set of branches.
+RTREE_TEMPLATE
+void RTREE_QUAL::BranchCoverage(const Node* a_node, double& a_union, double& a_multiple, double& a_pairwise)
+{
+  a_union = a_multiple = a_pairwise = 0;
+  const int count = a_node->m_count;
+
+  for(int indexA=0; indexA < count; ++indexA)
+  {
+    for(int indexB=indexA + 1; indexB < count; ++indexB)
+    {
+      double area = 1;
+      for(int axis=0; axis<NUMDIMS && area > 0; ++axis)
+      {
+        double low = std::max<double>(a_node->m_branch[indexA].m_rect.m_min[axis], a_node->m_branch[indexB].m_rect.m_min[axis]);
+        double high = std::min<double>(a_node->m_branch[indexA].m_rect.m_max[axis], a_node->m_branch[indexB].m_rect.m_max[axis]);
+        area *= std::max(high - low, 0.0);
+      }
+      a_pairwise += area;
+    }
+  }
+
+  double coords[NUMDIMS][2 * MAXNODES];
+  int cells[NUMDIMS];
+  for(int axis=0; axis<NUMDIMS; ++axis)
+  {
+    for(int index=0; index < count; ++index)
+    {
+      coords[axis][2 * index] = a_node->m_branch[index].m_rect.m_min[axis];
+      coords[axis][2 * index + 1] = a_node->m_branch[index].m_rect.m_max[axis];
+    }
+    std::sort(coords[axis], coords[axis] + 2 * count);
+    cells[axis] = (int)(std::unique(coords[axis], coords[axis] + 2 * count) - coords[axis]) - 1;
+    if(cells[axis] < 1)
+    {
+      return; // Flat in this axis, nothing has area
+    }
+  }
+
+  int cell[NUMDIMS] = {0};
+  for(;;)
+  {
+    double area = 1;
+    double center[NUMDIMS];
+    for(int axis=0; axis<NUMDIMS; ++axis)
+    {
+      area *= coords[axis][cell[axis] + 1] - coords[axis][cell[axis]];
+      center[axis] = (coords[axis][cell[axis] + 1] + coords[axis][cell[axis]]) / 2;
+    }
+
+    int covering = 0;
+    for(int index=0; index < count && covering < 2; ++index)
+    {
+      bool inside = true;
+      for(int axis=0; axis<NUMDIMS && inside; ++axis)
+      {
+        inside = a_node->m_branch[index].m_rect.m_min[axis] <= center[axis] && center[axis] <= a_node->m_branch[index].m_rect.m_max[axis];
+      }
+      covering += inside;
+    }
+    if(covering >= 1)
+    {
+      a_union += area;
+    }
+    if(covering >= 2)
+    {
+      a_multiple += area;
+    }
+
+    // Next cell, last axis fastest
+    int axis = NUMDIMS - 1;
+    while(axis >= 0 && ++cell[axis] == cells[axis])
+    {
+      cell[axis] = 0;
+      --axis;
+    }
+    if(axis < 0)
+    {
+      break;
+    }
+  }
+}
+
 // Using BFS to label nodes with unique IDs (from top to bottom, left to right).
 RTREE_TEMPLATE
 void RTREE_QUAL::LabelNodeId() {
@@ -1940,114 +3497,93 @@ void RTREE_QUAL::LabelNodeId() {
 }
 
 RTREE_TEMPLATE
-std::unordered_map<int, std::unordered_map<std::string, double>> RTREE_QUAL::LabelNodeWeight(const std::string& mode, const double lon, const double lat, const double r_meters, std::unordered_map<std::string, double> weights) {
-    // std::unordered_map<int, std::unordered_map<std::string, double>> cafeDatas;
-    // std::unordered_map<int, std::unordered_map<std::string, double>> cafeDatas = GetAllCafeData(lon, lat, r_meters);
+std::unordered_map<int, std::unordered_map<std::string, double>> RTREE_QUAL::LabelNodeWeight(const std::string& mode, const double lon, const double lat, const double r_meters, std::unordered_map<std::string, double> weights,
+                            std::function<std::unordered_map<int, std::unordered_map<std::string, double>> ()> a_fetch,
+                            std::function<double (const DATATYPE&)> a_score, std::function<bool ()> a_interrupt) {
+    if (mode == "mean") {
+        return LabelNodeWeight<RTreeAggregateMean>(lon, lat, r_meters, weights, a_fetch, a_score, a_interrupt);
+    } else if (mode == "median") {
+        return LabelNodeWeight<RTreeAggregateMedian>(lon, lat, r_meters, weights, a_fetch, a_score, a_interrupt);
+    } else if (mode == "trimmed_mean") {
+        return LabelNodeWeight<RTreeAggregateTrimmedMean>(lon, lat, r_meters, weights, a_fetch, a_score, a_interrupt);
+    } else if (mode == "max") {
+        return LabelNodeWeight<RTreeAggregateMax>(lon, lat, r_meters, weights, a_fetch, a_score, a_interrupt);
+    } else if (mode == "min") {
+        return LabelNodeWeight<RTreeAggregateMin>(lon, lat, r_meters, weights, a_fetch, a_score, a_interrupt);
+    } else if (mode == "count") {
+        return LabelNodeWeight<RTreeAggregateCount>(lon, lat, r_meters, weights, a_fetch, a_score, a_interrupt);
+    }
+    throw std::invalid_argument("Unsupported mode: " + mode);
+}
 
+RTREE_TEMPLATE
+template<class AGGREGATE>
+std::unordered_map<int, std::unordered_map<std::string, double>> RTREE_QUAL::LabelNodeWeight(const double lon, const double lat, const double r_meters, std::unordered_map<std::string, double> weights,
+                            std::function<std::unordered_map<int, std::unordered_map<std::string, double>> ()> a_fetch,
+                            std::function<double (const DATATYPE&)> a_score, std::function<bool ()> a_interrupt) {
     if (!m_root) {
         return {}; 
     }
 
-    std::future<std::unordered_map<int, std::unordered_map<std::string, double>>> cafeDataFuture = 
-        std::async(std::launch::async, [=]() {
-            return GetAllCafeData(lon, lat, r_meters);
+    std::future<std::unordered_map<int, std::unordered_map<std::string, double>>> cafeDataFuture;
+    if (!a_score) {
+        cafeDataFuture = std::async(std::launch::async, [=]() {
+            return a_fetch ? a_fetch() : GetAllCafeData(lon, lat, r_meters);
         });
+    }
 
     std::unordered_map<int, std::unordered_map<std::string, double>> cafeDatas;
-    bool dataReady = false;
+    bool dataReady = static_cast<bool>(a_score);
+    bool interrupted = false;
 
     std::function<double(Node*)> calculateWeight = [&](Node* node) -> double {
-        if (!node) return 0;
+        if (interrupted || (a_interrupt && a_interrupt())) {
+            interrupted = true;
+            return node->m_weight;
+        }
+
+        // Scores of the entries or weights of the children; the aggregation may reorder them
+        double values[MAXNODES];
+        double weight;
+        int count = node->m_count;
 
         if (node->IsLeaf()) {
-            std::vector<int> dataIds;
-            for (int i = 0; i < node->m_count; ++i) {
-                DATATYPE data = node->m_branch[i].m_data;
-                if (data) {
-                    dataIds.push_back(data->id);
+            if (a_score) {
+                for (int i = 0; i < count; ++i) {
+                    values[i] = a_score(node->m_branch[i].m_data);
+                }
+            } else {
+                std::vector<int> dataIds;
+                for (int i = 0; i < count; ++i) {
+                    dataIds.push_back(node->m_branch[i].m_data->id);
                 }
-            }
-
-            if (!dataReady) {
-                cafeDatas = cafeDataFuture.get(); // Wait for background fetch to complete
-                dataReady = true;
-            }
 
-            std::vector<double> scores = GetLeafNodeScores(dataIds, lon, lat, r_meters, weights, cafeDatas);
+                if (!dataReady) {
+                    cafeDatas = cafeDataFuture.get(); // Wait for background fetch to complete
+                    dataReady = true;
+                }
 
-            for (int i = 0; i < node->m_count; ++i) {
-                node->m_branch[i].m_data->weight = scores[i];
+                std::vector<double> scores = GetLeafNodeScores(dataIds, lon, lat, r_meters, weights, cafeDatas);
+                std::copy(scores.begin(), scores.end(), values);
             }
 
-            if (mode == "mean") {
-                double sum = 0;
-                for (double c : scores) sum += c;
-                node->m_weight = sum / static_cast<int>(scores.size());
-            } else if (mode == "median") {
-                std::sort(scores.begin(), scores.end());
-                size_t mid = scores.size() / 2;
-                node->m_weight = (scores.size() % 2 == 0)
-                    ? (scores[mid - 1] + scores[mid]) / 2
-                    : scores[mid];
-            } else if (mode == "trimmed_mean") {
-                std::sort(scores.begin(), scores.end());
-                if (scores.size() <= 2) {
-                    // Too small to trim, just take mean
-                    double sum = 0;
-                    for (double c : scores) sum += c;
-                    node->m_weight = sum / static_cast<int>(scores.size());
-                } else {
-                    double sum = 0;
-                    for (size_t i = 1; i < scores.size() - 1; ++i) {
-                        sum += scores[i];
-                    }
-                    node->m_weight = sum / static_cast<int>(scores.size() - 2);
-                }
-            } else {
-                throw std::invalid_argument("Unsupported mode: " + mode);
+            for (int i = 0; i < count; ++i) {
+                node->m_branch[i].m_data->weight = values[i];
             }
-
-            return node->m_weight;
+            weight = AGGREGATE::Leaf(values, count);
         } else {
-            std::vector<double> childWeights;
-            for (int i = 0; i < node->m_count; ++i) {
-                Node* child = node->m_branch[i].m_child;
-                if (child) {
-                    childWeights.push_back(calculateWeight(child));
-                }
-            }
-
-            if (childWeights.empty()) {
-                node->m_weight = 0;
-            } else if (mode == "mean") {
-                double sum = 0;
-                for (int w : childWeights) sum += w;
-                node->m_weight = sum / static_cast<int>(childWeights.size());
-            } else if (mode == "median") {
-                std::sort(childWeights.begin(), childWeights.end());
-                size_t mid = childWeights.size() / 2;
-                node->m_weight = (childWeights.size() % 2 == 0)
-                    ? (childWeights[mid - 1] + childWeights[mid]) / 2
-                    : childWeights[mid];
-            } else if (mode == "trimmed_mean") {
-                std::sort(childWeights.begin(), childWeights.end());
-                if (childWeights.size() <= 2) {
-                    double sum = 0;
-                    for (double w : childWeights) sum += w;
-                    node->m_weight = sum / static_cast<int>(childWeights.size());
-                } else {
-                    double sum = 0;
-                    for (size_t i = 1; i < childWeights.size() - 1; ++i) {
-                        sum += childWeights[i];
-                    }
-                    node->m_weight = sum / static_cast<int>(childWeights.size() - 2);
-                }
-            } else {
-                throw std::invalid_argument("Unsupported mode: " + mode);
+            for (int i = 0; i < count; ++i) {
+                values[i] = calculateWeight(node->m_branch[i].m_child);
             }
+            weight = AGGREGATE::Internal(values, count);
+        }
 
-            return node->m_weight;
+        // Versions only copy the nodes whose weight moved
+        if (weight != node->m_weight) {
+            node->m_weight = weight;
+            MarkChangedPath(node);
         }
+        return node->m_weight;
     };
 
     calculateWeight(m_root);
@@ -2077,6 +3613,7 @@ typename RTREE_QUAL::TreeStructure RTREE_QUAL::GetTreeStructure() const
         
         TreeNodeInfo info;
         info.id = node->m_id;
+        info.node = node;
         info.level = node->m_level;
         info.isLeaf = node->IsLeaf();
         info.weight = node->m_weight;
@@ -2140,6 +3677,56 @@ typename RTREE_QUAL::TreeStructure RTREE_QUAL::GetTreeStructure() const
     return result;
 }
 
+RTREE_TEMPLATE
+typename RTREE_QUAL::TreeStructure RTREE_QUAL::GetTreeStructure(int a_version) const
+{
+    TreeStructure result;
+
+    // Images in breadth-first order, so an image's index is its id
+    std::vector<const VersionNode*> images(1, m_versions.at(a_version).get());
+    for (size_t next = 0; next < images.size(); ++next) {
+        const VersionNode* image = images[next];
+
+        TreeNodeInfo info;
+        info.id = (int)next;
+        info.node = image->m_node;
+        info.level = image->m_level;
+        info.isLeaf = image->m_level == 0;
+        info.weight = image->m_weight;
+        info.min.assign(NUMDIMS, ELEMTYPE(0));
+        info.max.assign(NUMDIMS, ELEMTYPE(0));
+
+        for (size_t i = 0; i < image->m_branches.size(); i++) {
+            const VersionBranch& branch = image->m_branches[i];
+            for (int d = 0; d < NUMDIMS; d++) {
+                info.min[d] = i == 0 ? branch.m_min[d] : RTREE_MIN(info.min[d], branch.m_min[d]);
+                info.max[d] = i == 0 ? branch.m_max[d] : RTREE_MAX(info.max[d], branch.m_max[d]);
+            }
+
+            if (image->m_level > 0) {
+                info.childIds.push_back((int)images.size());
+                images.push_back(branch.m_child.get());
+            } else {
+                TreeNodeInfo dataPoint;
+                dataPoint.level = -1;
+                dataPoint.isLeaf = true;
+                dataPoint.weight = branch.m_data->current_crowd;
+                dataPoint.min.assign(branch.m_min, branch.m_min + NUMDIMS);
+                dataPoint.max.assign(branch.m_max, branch.m_max + NUMDIMS);
+                dataPoint.data = branch.m_data;
+                dataPoint.id = branch.m_data->id;
+
+                info.dataPointIds.push_back(dataPoint.id);
+                result.dataPoints.push_back(dataPoint);
+            }
+        }
+
+        result.treeNodes.push_back(info);
+    }
+
+    return result;
+}
+
 #undef RTREE_TEMPLATE
 #undef RTREE_QUAL
 
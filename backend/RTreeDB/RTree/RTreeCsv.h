@@ -0,0 +1,263 @@
+#ifndef RTREE_CSV_H
+#define RTREE_CSV_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//
+// RTreeCsv.h
+//
+// Memory-mapped CSV file for bulk loading.  The lines after the header are split into chunks of
+// whole lines that separate threads can parse, and fields are parsed where they lie in the
+// mapping: no line is copied and no number goes through a string.  Fields may be quoted, but a
+// quoted field must not span lines.
+//
+
+/// \class RTreeCsvFile
+/// Read-only mapping of a CSV file
+class RTreeCsvFile
+{
+public:
+
+  typedef std::pair<const char*, const char*> Range; ///< [first, second)
+
+  RTreeCsvFile() : m_base(NULL), m_size(0) {}
+  ~RTreeCsvFile()                                 { Close(); }
+
+  RTreeCsvFile(const RTreeCsvFile&) = delete;
+  RTreeCsvFile& operator=(const RTreeCsvFile&) = delete;
+
+  bool Open(const char* a_fileName)
+  {
+    Close();
+
+    int fd = open(a_fileName, O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+      close(fd);
+      return false;
+    }
+
+    m_size = (size_t)info.st_size;
+    if (m_size == 0) {
+      close(fd);
+      m_base = "";
+      return true;
+    }
+
+    void* base = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+      m_size = 0;
+      return false;
+    }
+    madvise(base, m_size, MADV_SEQUENTIAL);
+    m_base = static_cast<const char*>(base);
+    return true;
+  }
+
+  void Close()
+  {
+    if (m_base && m_size > 0) {
+      munmap(const_cast<char*>(m_base), m_size);
+    }
+    m_base = NULL;
+    m_size = 0;
+  }
+
+  bool IsOpen() const                             { return m_base != NULL; }
+
+  /// The first line
+  Range Header() const
+  {
+    const char* end = m_base + m_size;
+    return Range(m_base, LineEnd(m_base, end));
+  }
+
+  /// The lines after the header, cut into at most a_count runs of whole lines of about equal size
+  std::vector<Range> Chunks(int a_count) const
+  {
+    const char* end = m_base + m_size;
+    const char* begin = LineEnd(m_base, end);
+    begin = begin < end ? begin + 1 : end;
+
+    std::vector<Range> chunks;
+    const size_t size = end - begin;
+    for (int i = 0; i < a_count && begin < end; ++i) {
+      const char* cut = (i == a_count - 1) ? end : begin + size / a_count;
+      cut = LineEnd(cut, end);
+      cut = cut < end ? cut + 1 : end;
+      chunks.push_back(Range(begin, cut));
+      begin = cut;
+    }
+    return chunks;
+  }
+
+  /// Where the line holding a_pos ends: its '\n', or a_end
+  static const char* LineEnd(const char* a_pos, const char* a_end)
+  {
+    const char* newline = a_pos < a_end ? static_cast<const char*>(memchr(a_pos, '\n', a_end - a_pos)) : NULL;
+    return newline ? newline : a_end;
+  }
+
+protected:
+
+  const char* m_base;
+  size_t m_size;
+};
+
+
+/// \class RTreeCsvCursor
+/// Walks the lines of a chunk and the fields of each line
+class RTreeCsvCursor
+{
+public:
+
+  explicit RTreeCsvCursor(RTreeCsvFile::Range a_chunk) : m_pos(a_chunk.first), m_end(a_chunk.second), m_lineEnd(a_chunk.first), m_fieldsLeft(false) {}
+
+  /// Move to the next line that is not blank
+  /// \return Returns false at the end of the chunk
+  bool NextLine()
+  {
+    m_pos = m_lineEnd;
+    while (m_pos < m_end && (*m_pos == '\n' || *m_pos == '\r')) {
+      ++m_pos;
+    }
+    if (m_pos >= m_end) {
+      m_fieldsLeft = false;
+      return false;
+    }
+
+    m_lineEnd = RTreeCsvFile::LineEnd(m_pos, m_end);
+    m_fieldEnd = m_lineEnd;
+    while (m_fieldEnd > m_pos && m_fieldEnd[-1] == '\r') {
+      --m_fieldEnd;
+    }
+    m_fieldsLeft = true;
+    return true;
+  }
+
+  /// The next field of the line, without its quotes (a doubled quote inside stays doubled)
+  /// \return Returns false past the last field
+  bool Field(const char*& a_begin, const char*& a_end)
+  {
+    if (!m_fieldsLeft) {
+      return false;
+    }
+
+    if (m_pos < m_fieldEnd && *m_pos == '"') {
+      a_begin = ++m_pos;
+      while (m_pos < m_fieldEnd && !(*m_pos == '"' && (m_pos + 1 == m_fieldEnd || m_pos[1] != '"'))) {
+        m_pos += (*m_pos == '"') ? 2 : 1;
+      }
+      a_end = m_pos;
+      if (m_pos < m_fieldEnd) {
+        ++m_pos;
+      }
+    }
+    else {
+      a_begin = m_pos;
+      const char* comma = static_cast<const char*>(memchr(m_pos, ',', m_fieldEnd - m_pos));
+      m_pos = comma ? comma : m_fieldEnd;
+      a_end = m_pos;
+    }
+
+    // Past the comma, or done with the line
+    if (m_pos < m_fieldEnd && *m_pos == ',') {
+      ++m_pos;
+    }
+    else {
+      m_fieldsLeft = false;
+    }
+    return true;
+  }
+
+  /// Decimal integer, optionally signed
+  static bool ParseInt(const char* a_begin, const char* a_end, int32_t& a_value)
+  {
+    const char* pos = a_begin;
+    bool negative = pos < a_end && *pos == '-';
+    if (pos < a_end && (*pos == '-' || *pos == '+')) {
+      ++pos;
+    }
+    if (pos == a_end) {
+      return false;
+    }
+
+    int64_t value = 0;
+    for (; pos < a_end; ++pos) {
+      if (*pos < '0' || *pos > '9' || value > INT32_MAX) {
+        return false;
+      }
+      value = value * 10 + (*pos - '0');
+    }
+    value = negative ? -value : value;
+    if (value < INT32_MIN || value > INT32_MAX) {
+      return false;
+    }
+    a_value = (int32_t)value;
+    return true;
+  }
+
+  /// Decimal number.  Plain decimals of up to 15 digits are parsed in place, exactly as strtod
+  /// would (both the digits and the power of ten are exact doubles, so the one division rounds
+  /// correctly); exponents and longer numbers go through strtod.
+  static bool ParseDouble(const char* a_begin, const char* a_end, double& a_value)
+  {
+    static const double POWERS_OF_TEN[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+
+    const char* pos = a_begin;
+    bool negative = pos < a_end && *pos == '-';
+    if (pos < a_end && (*pos == '-' || *pos == '+')) {
+      ++pos;
+    }
+
+    uint64_t digits = 0;
+    int count = 0;
+    int fraction = 0;
+    for (; pos < a_end && *pos >= '0' && *pos <= '9'; ++pos, ++count) {
+      digits = digits * 10 + (*pos - '0');
+    }
+    if (pos < a_end && *pos == '.') {
+      for (++pos; pos < a_end && *pos >= '0' && *pos <= '9'; ++pos, ++count, ++fraction) {
+        digits = digits * 10 + (*pos - '0');
+      }
+    }
+    if (pos == a_end && count > 0 && count <= 15) {
+      a_value = (double)digits / POWERS_OF_TEN[fraction];
+      a_value = negative ? -a_value : a_value;
+      return true;
+    }
+
+    char buffer[64];
+    size_t length = a_end - a_begin;
+    if (length == 0 || length >= sizeof(buffer)) {
+      return false;
+    }
+    memcpy(buffer, a_begin, length);
+    buffer[length] = '\0';
+    char* stop;
+    a_value = strtod(buffer, &stop);
+    return stop == buffer + length;
+  }
+
+protected:
+
+  const char* m_pos;                              ///< Next field, or next line once m_fieldsLeft is false
+  const char* m_end;                              ///< End of the chunk
+  const char* m_lineEnd;                          ///< '\n' of the current line, or m_end
+  const char* m_fieldEnd;                         ///< End of the current line's last field ('\r' trimmed)
+  bool m_fieldsLeft;
+};
+
+#endif //RTREE_CSV_H
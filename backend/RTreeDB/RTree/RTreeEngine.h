@@ -1,6 +1,10 @@
 #include "RTree.h"
+#include "RTreeSnapshot.h"
+#include "RTreeWAL.h"
+#include "RTreeResultCache.h"
+#include "RTreeHistogram.h"
+#include "RTreeCsv.h"
 #include "../../MYsqlDB/Scoring.h"
-#include <pybind11/pybind11.h>
 #include <vector>
 #include <cmath>
 #include <string>
@@ -11,6 +15,13 @@
 #include <queue>
 #include <chrono>
 #include <iomanip>
+#include <tuple>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
 
 #define NUMDIMS 2
 
@@ -21,28 +32,439 @@ struct CafeLoc {
     CafeLoc(int id, double lon, double lat) : id(id), lon(lon), lat(lat) {}
 };
 
+// What a leaf holds per cafe: its slot in the engine's CafeLoc store plus the fields every
+// search reads, so scanning a leaf never leaves the node. Equality and hashing go by slot.
+struct CafeRef {
+    uint32_t index;         // Slot in RTreeEngine's store
+    int32_t id;
+    double weight;          // Score from the last LabelNodeWeight
+
+    // The tree reads data->id / data->weight, as it would through a pointer
+    CafeRef* operator->() { return this; }
+    const CafeRef* operator->() const { return this; }
+
+    bool operator==(const CafeRef& other) const { return index == other.index; }
+};
+
+namespace std {
+template<> struct hash<CafeRef> {
+    size_t operator()(const CafeRef& ref) const { return std::hash<uint32_t>()(ref.index); }
+};
+}
+
+typedef RTree<CafeRef, double, NUMDIMS> CafeTree;
+
+// Scoring inputs of one cafe, kept by the engine in the slot of its CafeLoc
+struct CafeAttributes {
+    double rating;
+    int32_t price_level;
+    int32_t current_crowd;
+};
+
+// (cafe_id, current_crowd) of one update in a crowd feed batch
+typedef std::pair<int, int> CrowdUpdate;
+
+// Inline, pointer-free cafe as stored in a snapshot file: location plus the attributes
+// as of the time the snapshot was written
+struct CafeRecord {
+    int32_t id;
+    int32_t price_level;
+    int32_t current_crowd;
+    int32_t reserved;
+    double lon, lat;
+    double rating;
+};
+
+typedef RTreeSnapshot<CafeRecord, double, NUMDIMS, 8> CafeSnapshot;
+
+// Write-ahead log of tree mutations, one CafeRecord per entry
+typedef RTreeWAL<CafeRecord> CafeLog;
+
+enum CafeLogOp : uint32_t {
+    CAFE_LOG_UPSERT = 1,    // Whole record
+    CAFE_LOG_MOVE = 2,      // id, lon, lat
+    CAFE_LOG_REMOVE = 3,    // id
+};
+
+// What search returns, kept by the result cache: hits by descending score plus the attribute row
+// (with score and distance) of each hit
+struct CachedSearch {
+    std::vector<CafeLoc> cafes;
+    std::unordered_map<int, std::unordered_map<std::string, double>> cafeDatas;
+};
+
+typedef RTreeResultCache<CachedSearch> SearchCache;
+
+// (lon, lat, r_meters) of one query in a batch
+typedef std::tuple<double, double, double> BatchQuery;
+
+// Columnar result of search_batch: hits of query i are [offsets[i], offsets[i + 1]),
+// sorted by descending score within each query.
+struct BatchSearchResult {
+    std::vector<int> offsets;
+    std::vector<int> ids;
+    std::vector<double> scores;
+    std::vector<double> distances;
+};
+
+// Result of search_profiles: the cafes in the query box reaching min_score under at least one of
+// the weight profiles, each scored under all of them. rankings[p] lists the indices of the hits
+// reaching min_score under profile p, best first.
+struct ProfileSearchResult {
+    std::vector<CafeLoc> cafes;                 // weight = score under the first profile
+    std::vector<double> distances;
+    std::vector<double> ratings;
+    std::vector<int> price_levels;
+    std::vector<int> current_crowds;
+    std::vector<std::vector<double>> scores;    // scores[p][i]: hit i under profile p
+    std::vector<std::vector<int>> rankings;
+};
+
+// Heap allocations made by the calling thread. Only counted in programs whose operator new adds to
+// it (bindings.cpp built with RTREE_COUNT_ALLOCATIONS); elsewhere it stays 0, and so does
+// SearchStats::allocations.
+inline uint64_t& thread_allocation_count() {
+    static thread_local uint64_t count = 0;
+    return count;
+}
+
+// What one search did and where its time went, in ms. The scoring, fetch and callback times spent
+// inside a traversal are extrapolated from a sample of the calls and taken out of traversal_ms.
+struct SearchStats {
+    uint64_t nodes_visited = 0;
+    uint64_t nodes_pruned = 0;      // Child subtrees skipped by overlap or score bound
+    uint64_t leaves_scanned = 0;
+    uint64_t overlap_tests = 0;     // Branch rects tested against the query box
+    uint64_t hits = 0;
+    double fetch_ms = 0;            // Attribute reads: MySQL rows, or the rows of the hits
+    double scoring_ms = 0;
+    double traversal_ms = 0;
+    double callback_ms = 0;         // In the caller's callback (streams)
+    double total_ms = 0;
+    uint64_t allocations = 0;       // See thread_allocation_count
+    bool cached = false;            // Served from the result cache
+};
+
+// How complete a search result is. A search that ran out of its time budget (or was cancelled)
+// returns the best hits found so far: every cafe scoring above complete_above is among them, and
+// coverage estimates the share of the query box's leaves that was scanned (0 where the search
+// cannot tell, i.e. a cancelled labelling pass or an interrupted scan of a mapped snapshot).
+struct SearchStatus {
+    bool partial = false;
+    double coverage = 1.0;
+    double complete_above = 0.0;
+    SearchStats stats;
+};
+
+// Lets another thread end a running search, e.g. the one serving a client that went away. The
+// searches check it once per tree node they visit and once per hit.
+class SearchCancel {
+public:
+    void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+    bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<bool> cancelled_{false};
+};
+
 class RTreeEngine {
 public:
-    RTree<CafeLoc*, double, NUMDIMS> tree;
+    CafeTree tree;
+
+    // mode: how search labels nodes with the scores below them, one of "mean", "median",
+    // "trimmed_mean", "max", "min" or "count" (see the RTreeAggregate* policies in RTree.h)
+    explicit RTreeEngine(const std::string& mode = "trimmed_mean") : mode_(mode) {
+        if (mode == "mean") {
+            label_nodes_ = &RTreeEngine::label_nodes<RTreeAggregateMean>;
+        } else if (mode == "median") {
+            label_nodes_ = &RTreeEngine::label_nodes<RTreeAggregateMedian>;
+        } else if (mode == "trimmed_mean") {
+            label_nodes_ = &RTreeEngine::label_nodes<RTreeAggregateTrimmedMean>;
+        } else if (mode == "max") {
+            label_nodes_ = &RTreeEngine::label_nodes<RTreeAggregateMax>;
+        } else if (mode == "min") {
+            label_nodes_ = &RTreeEngine::label_nodes<RTreeAggregateMin>;
+        } else if (mode == "count") {
+            label_nodes_ = &RTreeEngine::label_nodes<RTreeAggregateCount>;
+        } else {
+            throw std::invalid_argument("Unsupported mode: " + mode);
+        }
+
+        // Lets move/remove go straight to a cafe's leaf
+        tree.EnableDataIndex();
+
+        // Until told otherwise, node bounds are the best crowd term alone
+        bound_profile_ = make_profile_scores({{"current_crowd", 1.0}});
+    }
+
+    ~RTreeEngine() {
+        if (rebuild_) {
+            rebuild_->worker.join();
+        }
+        if (retire_worker_.joinable()) {
+            retire_worker_.join();
+        }
+    }
 
     bool init_mysql_connection() {
         return init_mysql();
     }
 
+    // Same as upsert: a cafe id that is already in the tree is moved, not duplicated
     void insert(const std::vector<Cafe>& cafes) {
-        // Mysql
-        if (!insert_cafes_to_mysql(cafes)) {
-            std::cout << "❌ Failed to insert cafes to MySQL\n";
+        upsert(cafes);
+    }
+
+    // Insert new cafes and update existing ones (location and attributes) by id
+    void upsert(const std::vector<Cafe>& cafes) {
+        PendingWrite pending;
+        {
+            WriteLock lock(mutex_);
+            // The mapped snapshot is read-only, so move its contents into the tree before changing anything
+            thaw_snapshot();
+            pending = log_cafes(cafes);
+
+            // Rtree
+            for (const auto& cafe : cafes) {
+                upsert_into_tree(cafe.id, cafe.lon, cafe.lat, {cafe.rating, cafe.price_level, cafe.current_crowd});
+            }
+            maybe_start_rebuild();
+        }
+        persist(pending, [&cafes] { return insert_cafes_to_mysql(cafes); }, "❌ Failed to insert cafes to MySQL\n");
+    }
+
+    // Upsert the cafes of a CSV file in the columns of csvs/cafes_*.csv (matched by header name, in
+    // any order; id, latitude and longitude are required), without building a Cafe per row in
+    // Python. The file is mapped and its lines parsed in chunks on num_threads threads (0: one per
+    // core). Into an empty tree the cafes are bulk-loaded (see RTree::BulkLoad) rather than
+    // inserted one by one. Rows that do not parse are skipped. Returns the number of cafes loaded,
+    // or -1 if the file cannot be read or lacks a required column.
+    long long load_csv(const std::string& path, int num_threads = 0) {
+        RTreeCsvFile file;
+        if (!file.Open(path.c_str())) {
+            std::cout << "❌ Failed to open " << path << "\n";
+            return -1;
+        }
+
+        enum Column { SKIP, ID, NAME, LAT, LON, RATING, PRICE_LEVEL, CURRENT_CROWD };
+        static const std::unordered_map<std::string, Column> names = {
+            {"id", ID}, {"name", NAME}, {"latitude", LAT}, {"longitude", LON},
+            {"rating", RATING}, {"price_level", PRICE_LEVEL}, {"current_crowd", CURRENT_CROWD}};
+        std::vector<Column> columns;
+        RTreeCsvCursor header(file.Header());
+        const char* name_begin;
+        const char* name_end;
+        header.NextLine();
+        while (header.Field(name_begin, name_end)) {
+            auto it = names.find(std::string(name_begin, name_end));
+            columns.push_back(it != names.end() ? it->second : SKIP);
+        }
+        for (Column required : {ID, LAT, LON}) {
+            if (std::find(columns.begin(), columns.end(), required) == columns.end()) {
+                std::cout << "❌ " << path << " has no id, latitude or longitude column\n";
+                return -1;
+            }
+        }
+
+        if (num_threads <= 0) {
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        std::vector<RTreeCsvFile::Range> chunks = file.Chunks(num_threads);
+        std::vector<std::vector<Cafe>> parsed(chunks.size());
+        std::vector<size_t> skipped(chunks.size(), 0);
+
+        auto parse = [&](size_t c) {
+            RTreeCsvCursor cursor(chunks[c]);
+            const char* begin;
+            const char* end;
+            while (cursor.NextLine()) {
+                Cafe cafe = {0, "", 0.0, 0.0, 0.0, 0, 0};
+                bool valid = true;
+                size_t found = 0;
+                for (Column column : columns) {
+                    if (!cursor.Field(begin, end)) {
+                        break;
+                    }
+                    ++found;
+                    switch (column) {
+                    case ID:            valid &= RTreeCsvCursor::ParseInt(begin, end, cafe.id); break;
+                    case NAME:          cafe.name.assign(begin, end); break;
+                    case LAT:           valid &= RTreeCsvCursor::ParseDouble(begin, end, cafe.lat); break;
+                    case LON:           valid &= RTreeCsvCursor::ParseDouble(begin, end, cafe.lon); break;
+                    case RATING:        valid &= RTreeCsvCursor::ParseDouble(begin, end, cafe.rating); break;
+                    case PRICE_LEVEL:   valid &= RTreeCsvCursor::ParseInt(begin, end, cafe.price_level); break;
+                    case CURRENT_CROWD: valid &= RTreeCsvCursor::ParseInt(begin, end, cafe.current_crowd); break;
+                    case SKIP:          break;
+                    }
+                }
+                if (valid && found == columns.size()) {
+                    parsed[c].push_back(std::move(cafe));
+                } else {
+                    ++skipped[c];
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t c = 1; c < chunks.size(); ++c) {
+            workers.emplace_back(parse, c);
+        }
+        if (!chunks.empty()) {
+            parse(0);
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+        file.Close();
+
+        // Chunks in file order, so a later row of the same id wins as it would in upsert
+        std::vector<Cafe> cafes;
+        size_t total_skipped = 0;
+        for (size_t c = 0; c < parsed.size(); ++c) {
+            cafes.insert(cafes.end(), std::make_move_iterator(parsed[c].begin()), std::make_move_iterator(parsed[c].end()));
+            total_skipped += skipped[c];
+        }
+        if (total_skipped > 0) {
+            std::cout << "❌ Skipped " << total_skipped << " malformed rows of " << path << "\n";
+        }
+
+        // Only the parsing, the log flush and MySQL run without the lock
+        PendingWrite pending;
+        {
+            WriteLock lock(mutex_);
+            thaw_snapshot();
+            pending = log_cafes(cafes);
+
+            if (!slots_.empty() || rebuild_) {
+                for (const auto& cafe : cafes) {
+                    upsert_into_tree(cafe.id, cafe.lon, cafe.lat, {cafe.rating, cafe.price_level, cafe.current_crowd});
+                }
+                maybe_start_rebuild();
+            } else {
+                ++attribute_epoch_;
+                reserve_store(cafes.size());
+                for (const auto& cafe : cafes) {
+                    uint32_t slot = place_in_store(cafe.id, cafe.lon, cafe.lat, {cafe.rating, cafe.price_level, cafe.current_crowd});
+                    update_static_scores(slot);
+                }
+                bulk_load_store();
+            }
+        }
+        persist(pending, [&cafes] { return insert_cafes_to_mysql(cafes); }, "❌ Failed to insert cafes to MySQL\n");
+        return static_cast<long long>(cafes.size());
+    }
+
+    // Apply a batch of crowd readings to the attribute store and flag the leaves holding those
+    // cafes for a bound refresh, instead of re-reading the whole table on the next search.
+    // A mapped snapshot stays mapped: the readings go to an overlay its searches read instead.
+    // Unknown ids are skipped. Returns the number of cafes updated.
+    size_t update_crowd(const std::vector<CrowdUpdate>& updates) {
+        if (updates.empty()) {
+            return 0;
         }
+        WriteLock lock(mutex_);
+        if (std::shared_ptr<const CafeSnapshot> snapshot = current_snapshot()) {
+            return update_snapshot_crowd(snapshot, updates);
+        }
+
+        size_t applied = 0;
+        for (const CrowdUpdate& update : updates) {
+            auto it = slots_.find(update.first);
+            if (it == slots_.end()) continue;
+
+            attributes_[it->second].current_crowd = update.second;
+            raise_peaks(it->second);
+            apply_tree_op({TreeOp::MARK_DIRTY, ref_to(it->second), 0, 0});
+            ++applied;
+        }
+        if (applied > 0) {
+            ++attribute_epoch_;
+        }
+        maybe_start_rebuild();
+        return applied;
+    }
 
-        // Rtree
-        for (const auto& cafe : cafes) {
-            double min[2] = {cafe.lon, cafe.lat};
-            double max[2] = {cafe.lon, cafe.lat};
+    // Pull the current crowd of every cafe from MySQL (which rewrites it every 15 seconds). Nothing
+    // to do while a snapshot is mapped: its searches read the MySQL rows as they go.
+    size_t sync_crowd() {
+        {
+            ReadLock lock(mutex_);
+            if (current_snapshot()) {
+                return 0;
+            }
+        }
 
-            CafeLoc* newCafe = new CafeLoc(cafe.id, cafe.lon, cafe.lat);
-            tree.Insert(min, max, newCafe);
+        std::vector<CrowdUpdate> updates;
+        for (const auto& row : GetAllCafeData(0, 0, 0)) {
+            auto crowd = row.second.find("current_crowd");
+            if (crowd != row.second.end()) {
+                updates.emplace_back(row.first, static_cast<int>(crowd->second));
+            }
         }
+        return update_crowd(updates);
+    }
+
+    // Bumped by every change to the cafes (insert, move, remove) or their attributes, so cached
+    // results can tell whether they are still current
+    uint64_t attribute_epoch() const {
+        ReadLock lock(mutex_);
+        return attribute_epoch_;
+    }
+
+    // Bring the per-node bounds up to date: the best query-independent part of the score (static
+    // part plus crowd term, see set_bound_profile) in each subtree. Only nodes changed since the
+    // last refresh are recomputed.
+    void refresh_bounds() {
+        WriteLock lock(mutex_);
+        refresh_tree_bounds();
+    }
+
+    // Keep the per-node bounds for this weight profile (normally the one the server queries with).
+    // Recomputes every bound.
+    void set_bound_profile(const std::unordered_map<std::string, double>& weights) {
+        WriteLock lock(mutex_);
+        bound_profile_ = make_profile_scores(weights);
+        apply_tree_op({TreeOp::INVALIDATE_BOUNDS, CafeRef(), 0, 0});
+        refresh_tree_bounds();
+    }
+
+    // Relocate one cafe. O(log n): the cafe's leaf is found through the tree's data index.
+    // Returns false if the id is unknown.
+    bool move(int id, double lon, double lat) {
+        PendingWrite pending;
+        bool moved;
+        {
+            WriteLock lock(mutex_);
+            thaw_snapshot();
+            if (slots_.find(id) == slots_.end()) {
+                return false;
+            }
+
+            pending = log_mutation(CAFE_LOG_MOVE, id, lon, lat);
+            moved = move_in_tree(id, lon, lat);
+            maybe_start_rebuild();
+        }
+        persist(pending, [=] { return move_cafe_in_mysql(id, lon, lat); }, "❌ Failed to move cafe in MySQL\n");
+        return moved;
+    }
+
+    // Drop one cafe. Returns false if the id is unknown.
+    bool remove(int id) {
+        PendingWrite pending;
+        bool removed;
+        {
+            WriteLock lock(mutex_);
+            thaw_snapshot();
+            if (slots_.find(id) == slots_.end()) {
+                return false;
+            }
+
+            pending = log_mutation(CAFE_LOG_REMOVE, id, 0, 0);
+            removed = remove_from_tree(id);
+            maybe_start_rebuild();
+        }
+        persist(pending, [id] { return remove_cafe_from_mysql(id); }, "❌ Failed to remove cafe from MySQL\n");
+        return removed;
     }
 
     void bounding_box(double lon, double lat, double r_meters, double* min, double* max) {
@@ -71,66 +493,1873 @@ public:
         max[1] = lat + r_lat;
     }
 
-    std::pair<std::vector<CafeLoc>, std::unordered_map<int, std::unordered_map<std::string, double>>> search(double lon, double lat, double r_meters, double min_score, std::unordered_map<std::string, double> weights = {}) {
-        
-        auto start_time = std::chrono::high_resolution_clock::now();
+    // Every hit reaching min_score, best first, with the attribute row of each. With limit > 0 only
+    // the top limit hits are returned; they come from a best-first traversal that stops at the
+    // limit-th hit (see stream_search_ranked), so the tree is neither labelled nor fully searched.
+    // Once cancel is cancelled the search returns the hits found so far and caches nothing.
+    // With budget_ms > 0 the search is best first as with a limit and returns once the budget is
+    // spent, with the best hits found by then; *status (if given) says whether that happened and
+    // holds the search's stats.
+    std::pair<std::vector<CafeLoc>, std::unordered_map<int, std::unordered_map<std::string, double>>> search(double lon, double lat, double r_meters, double min_score, std::unordered_map<std::string, double> weights = {},
+                                                                                                             size_t limit = 0, std::shared_ptr<SearchCancel> cancel = nullptr,
+                                                                                                             double budget_ms = 0, SearchStatus* status = nullptr) {
+        QueryTrace trace(*this);
+        TimePoint deadline = deadline_after(budget_ms);
+        bool ranked = limit > 0 || budget_ms > 0;
+        SearchLock lock(*this, ranked ? READS_BOUNDS : WRITES_TREE);
+        SearchStatus result_status;
+        result_status.complete_above = min_score;
+        auto done = [&](size_t hits) {
+            trace.finish(result_status, hits);
+            if (status) {
+                *status = result_status;
+            }
+        };
 
-        std::unordered_map<int, std::unordered_map<std::string, double>> cafeDatas = tree.LabelNodeWeight(mode_, lon, lat, r_meters, weights);
-        
-        auto end_time = std::chrono::high_resolution_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
-        double seconds = duration.count() / 1000000.0; 
-        std::cout << std::fixed << std::setprecision(3) << "[LabelNodeWeight Time (Regular)] " << seconds << "s" << std::endl;
-        
-        double min[2], max[2];
-        bounding_box(lon, lat, r_meters, min, max);
+        if (std::shared_ptr<const CafeSnapshot> snapshot = current_snapshot()) {
+            std::unordered_map<int, std::unordered_map<std::string, double>> cafeDatas;
+            trace.time(trace.fetch_ms, [&] { cafeDatas = GetAllCafeData(lon, lat, r_meters); });
+            std::vector<CafeLoc> result;
+            trace.time(trace.traversal_ms, [&] {
+                result = search_snapshot(snapshot, lon, lat, r_meters, min_score, weights, cafeDatas, interrupt_for(cancel, deadline), result_status);
+            });
+            if (limit > 0 && result.size() > limit) {
+                result.erase(result.begin() + limit, result.end());
+            }
+            done(result.size());
+            return std::make_pair(result, cafeDatas);
+        }
 
-        std::vector<CafeLoc> result;
-        auto callback = [&result](CafeLoc* cafe) {
-            result.push_back(*cafe);
-            return true;
+        // Same view as an earlier query and nothing changed since: skip labelling and searching
+        SearchCache::Key key = cache_.MakeKey(lon, lat, r_meters, profile_hash(weights, min_score, limit, ranked));
+        uint64_t epoch = attribute_epoch_;
+        if (std::shared_ptr<const CachedSearch> cached = cache_.Find(key, epoch)) {
+            result_status.stats.cached = true;
+            done(cached->cafes.size());
+            return std::make_pair(cached->cafes, cached->cafeDatas);
+        }
+
+        std::function<bool ()> interrupt = interrupt_for(cancel, deadline);
+
+        // Only the rows of the hits are returned (and cached), not the whole table
+        std::shared_ptr<CachedSearch> entry = std::make_shared<CachedSearch>();
+        auto add_hit = [&](const CafeRef& ref) {
+            return trace.fetch([&] {
+                entry->cafes.push_back(cafe_at(ref));
+                entry->cafeDatas[ref.id] = hit_row(ref, lon, lat);
+                return true;
+            });
         };
 
-        tree.Search(min, max, callback, false, min_score);
-        std::sort(result.begin(), result.end(), [](const CafeLoc& a, const CafeLoc& b) {
-            return a.weight > b.weight;
-        });
-        return std::make_pair(result, cafeDatas);
+        if (ranked) {
+            result_status = search_ranked_pass(lon, lat, r_meters, min_score, weights, interrupt, trace, [&](const CafeRef& scored) {
+                add_hit(scored);
+                return limit == 0 || entry->cafes.size() < limit;
+            });
+        } else {
+            // Only the distance and crowd terms are computed per query, the rest comes precomputed
+            std::shared_ptr<const ProfileScores> scores = scores_for(weights);
+            trace.time(trace.scoring_ms, [&] {
+                (this->*label_nodes_)(lon, lat, r_meters, [&](const CafeRef& ref) {
+                    return score_of(*scores, ref.index, lon, lat, r_meters);
+                }, interrupt);
+            });
+            
+            double min[2], max[2];
+            bounding_box(lon, lat, r_meters, min, max);
+
+            auto callback = [&](const CafeRef& ref) {
+                if (interrupt && interrupt()) {
+                    return false;
+                }
+                return add_hit(ref);
+            };
+
+            trace.time(trace.traversal_ms, [&] {
+                if (!(interrupt && interrupt())) {
+                    tree.Search(min, max, callback, false, min_score, &trace.counters);
+                }
+                std::sort(entry->cafes.begin(), entry->cafes.end(), [](const CafeLoc& a, const CafeLoc& b) {
+                    return a.weight > b.weight;
+                });
+            });
+            if (cancel && cancel->cancelled()) {
+                result_status = cancelled_status();
+            }
+        }
+
+        done(entry->cafes.size());
+        if (!result_status.partial && cache_.IsEnabled()) {
+            cache_.Store(key, epoch, entry, entry->cafes.size());
+            return std::make_pair(entry->cafes, entry->cafeDatas);
+        }
+        // Not shared with the cache, so the hits are handed over instead of copied
+        return std::make_pair(std::move(entry->cafes), std::move(entry->cafeDatas));
     }
 
-    void stream_search(double lon, double lat, double r_meters, double min_score, 
+    // Passes every hit reaching min_score to callback as soon as it is found. The stream ends early
+    // after limit hits (0 = no limit), after the first hit stop_when returns true for, or once
+    // cancel is cancelled, e.g. from the thread serving a client that went away; the traversal
+    // stops there instead of running to completion. limit and stop_when see hits in tree order,
+    // stream_search_ranked gives the top n. A stream that ended early is not cached, and one with a
+    // limit or stop_when is not replayed from the cache, whose hits are kept best first.
+    // With budget_ms > 0 the hits come best first as in stream_search_ranked and the stream ends
+    // once the budget is spent; the returned status tells whether it ended that way.
+    SearchStatus stream_search(double lon, double lat, double r_meters, double min_score, 
                                    std::unordered_map<std::string, double> weights,
-                                   std::function<void(const CafeLoc&, const std::unordered_map<std::string, double>&)> callback) {
+                                   std::function<void(const CafeLoc&, const std::unordered_map<std::string, double>&)> callback,
+                                   size_t limit = 0, std::function<bool (const CafeLoc&)> stop_when = nullptr,
+                                   std::shared_ptr<SearchCancel> cancel = nullptr, double budget_ms = 0) {
+      QueryTrace trace(*this);
+      TimePoint deadline = deadline_after(budget_ms);
+      SearchLock lock(*this, budget_ms > 0 ? READS_BOUNDS : WRITES_TREE);
+      StreamStop stop(limit, stop_when, cancel);
+      auto emit = [&](const CafeLoc& cafe, const std::unordered_map<std::string, double>& row) {
+          return trace.callback([&] {
+              callback(cafe, row);
+              return true;
+          });
+      };
+      auto done = [&]() {
+          SearchStatus status = stop.status(min_score);
+          trace.finish(status, stop.emitted());
+          return status;
+      };
       
-      auto start_time = std::chrono::high_resolution_clock::now();
-                              
-      std::unordered_map<int, std::unordered_map<std::string, double>> cafeDatas = 
-          tree.LabelNodeWeight(mode_, lon, lat, r_meters, weights);
-
-      auto end_time = std::chrono::high_resolution_clock::now();
-      auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
-      double seconds = duration.count() / 1000000.0; 
-      std::cout << std::fixed << std::setprecision(3) << "[LabelNodeWeight Time (Optimization)] " << seconds << "s" << std::endl;
+      if (std::shared_ptr<const CafeSnapshot> snapshot = current_snapshot()) {
+          std::unordered_map<int, std::unordered_map<std::string, double>> cafeDatas;
+          trace.time(trace.fetch_ms, [&] { cafeDatas = GetAllCafeData(lon, lat, r_meters); });
+          std::vector<CafeLoc> result;
+          SearchStatus scan;
+          trace.time(trace.traversal_ms, [&] {
+              result = search_snapshot(snapshot, lon, lat, r_meters, min_score, weights, cafeDatas, interrupt_for(cancel, deadline), scan);
+          });
+          for (const CafeLoc& cafe : result) {
+              if (stop.cancelled()) break;
+              emit(cafe, cafeDatas[cafe.id]);
+              if (!stop.count(cafe)) break;
+          }
+          if (!scan.partial) {
+              return done();
+          }
+          trace.finish(scan, stop.emitted());
+          return scan;
+      }
+
+      // With a budget only the results of a complete best-first pass are replayed (see search)
+      SearchCache::Key key = cache_.MakeKey(lon, lat, r_meters, profile_hash(weights, min_score, 0, budget_ms > 0));
+      uint64_t epoch = attribute_epoch_;
+      // limit and stop_when see the labelled traversal's hits in tree order, while a replay comes
+      // best first and would end on other cafes: such streams run the traversal every time
+      bool replayable = budget_ms > 0 || (limit == 0 && !stop_when);
+      std::shared_ptr<const CachedSearch> cached = replayable ? cache_.Find(key, epoch) : nullptr;
+      if (cached) {
+          for (const CafeLoc& cafe : cached->cafes) {
+              if (stop.cancelled()) break;
+              emit(cafe, cached->cafeDatas.at(cafe.id));
+              if (!stop.count(cafe)) break;
+          }
+          SearchStatus status = done();
+          status.stats.cached = true;
+          return status;
+      }
+
+      if (budget_ms > 0) {
+          return ranked_stream(lon, lat, r_meters, min_score, weights, callback, limit, stop_when, cancel, deadline);
+      }
+
+      std::function<bool ()> interrupt = interrupt_for(cancel);
+      std::shared_ptr<const ProfileScores> scores = scores_for(weights);
+      trace.time(trace.scoring_ms, [&] {
+          (this->*label_nodes_)(lon, lat, r_meters, [&](const CafeRef& ref) {
+              return score_of(*scores, ref.index, lon, lat, r_meters);
+          }, interrupt);
+      });
     
+      if (stop.cancelled()) {
+          return done();
+      }
       
       double min[2], max[2];
       bounding_box(lon, lat, r_meters, min, max);
 
-      auto search_callback = [&](CafeLoc* cafe) {
-          if (cafe && cafe->weight >= min_score) {
+      std::shared_ptr<CachedSearch> entry = std::make_shared<CachedSearch>();
+      auto search_callback = [&](const CafeRef& ref) {
+          if (stop.cancelled()) {
+              return false;
+          }
+          if (ref.weight >= min_score) {
               // Get cafe details
-              auto cafe_details = cafeDatas.find(cafe->id) != cafeDatas.end() ? 
-                                cafeDatas[cafe->id] : std::unordered_map<std::string, double>{};
+              std::unordered_map<std::string, double> cafe_details = trace.fetch([&] { return hit_row(ref, lon, lat); });
               
               // Call Python callback immediately
-              callback(*cafe, cafe_details);
+              CafeLoc cafe = cafe_at(ref);
+              emit(cafe, cafe_details);
+
+              entry->cafes.push_back(cafe);
+              entry->cafeDatas[ref.id] = std::move(cafe_details);
+              return stop.count(cafe);
           }
           return true; // Continue searching
       };
 
-      tree.Search(min, max, search_callback, false, min_score);
+      trace.time(trace.traversal_ms, [&] { tree.Search(min, max, search_callback, false, min_score, &trace.counters); });
+      if (stop.ended()) {
+          return done();
+      }
+
+      // Replays come out best first
+      std::sort(entry->cafes.begin(), entry->cafes.end(), [](const CafeLoc& a, const CafeLoc& b) {
+          return a.weight > b.weight;
+      });
+      cache_.Store(key, epoch, entry, entry->cafes.size());
+      return done();
+    }
+
+    // Like stream_search, but hits come best first: scores never increase along the stream, so the
+    // first n hits are the top n. Cafes are scored as the traversal reaches them, driven by score
+    // upper bounds per node, instead of labelling the whole tree first; node weights are left as is.
+    // Bounds are tight for the bound profile (set_bound_profile), looser for other weights.
+    // limit, stop_when, cancel and budget_ms end the stream as in stream_search; with limit = n the
+    // traversal stops right after the n-th best hit.
+    SearchStatus stream_search_ranked(double lon, double lat, double r_meters, double min_score,
+                              std::unordered_map<std::string, double> weights,
+                              std::function<void(const CafeLoc&, const std::unordered_map<std::string, double>&)> callback,
+                              size_t limit = 0, std::function<bool (const CafeLoc&)> stop_when = nullptr,
+                              std::shared_ptr<SearchCancel> cancel = nullptr, double budget_ms = 0) {
+        TimePoint deadline = deadline_after(budget_ms);
+        SearchLock lock(*this, READS_BOUNDS);
+        return ranked_stream(lon, lat, r_meters, min_score, weights, callback, limit, stop_when, cancel, deadline);
+    }
+
+    // p50 and p99 (in ms) and the number of searches of each search phase since the last
+    // reset_latency_stats(), keyed by phase: "total", "fetch", "scoring", "traversal", "callback".
+    // A search is counted in the phases it ran.
+    std::unordered_map<std::string, std::unordered_map<std::string, double>> latency_stats() const {
+        std::unordered_map<std::string, std::unordered_map<std::string, double>> stats;
+        for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+            const RTreeLatencyHistogram& histogram = latency_[phase];
+            stats[phase_name(phase)] = {
+                {"count", static_cast<double>(histogram.Count())},
+                {"p50", histogram.Percentile(0.50) / 1000.0},
+                {"p99", histogram.Percentile(0.99) / 1000.0}};
+        }
+        return stats;
+    }
+
+    void reset_latency_stats() {
+        for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+            latency_[phase].Reset();
+        }
+    }
+
+    // Score the cafes around (lon, lat) under several weight profiles at once, e.g. the variants of
+    // an A/B test: one tree traversal and one attribute read per cafe instead of one search per
+    // profile. Each profile uses its own precomputed static parts and score bounds; a subtree is
+    // skipped only when none of the profiles can reach min_score in it. Node weights are left as is.
+    ProfileSearchResult search_profiles(double lon, double lat, double r_meters, double min_score,
+                                        const std::vector<std::unordered_map<std::string, double>>& profiles) {
+        ProfileSearchResult result;
+        result.scores.resize(profiles.size());
+        result.rankings.resize(profiles.size());
+
+        search_profiles_pass(lon, lat, r_meters, min_score, profiles, [&](const CafeLoc& cafe, const CafeAttributes& attributes,
+                                                                          double distance, const std::vector<double>& scores) {
+            result.cafes.push_back(cafe);
+            result.distances.push_back(distance);
+            result.ratings.push_back(attributes.rating);
+            result.price_levels.push_back(attributes.price_level);
+            result.current_crowds.push_back(attributes.current_crowd);
+            for (size_t p = 0; p < scores.size(); ++p) {
+                result.scores[p].push_back(scores[p]);
+            }
+        });
+
+        for (size_t p = 0; p < profiles.size(); ++p) {
+            const std::vector<double>& scores = result.scores[p];
+            std::vector<int>& ranking = result.rankings[p];
+            for (size_t i = 0; i < scores.size(); ++i) {
+                if (scores[i] >= min_score) {
+                    ranking.push_back(static_cast<int>(i));
+                }
+            }
+            std::stable_sort(ranking.begin(), ranking.end(), [&scores](int a, int b) {
+                return scores[a] > scores[b];
+            });
+        }
+        return result;
+    }
+
+    // Streaming variant of search_profiles: each hit is passed on as soon as it is found, with its
+    // attribute row and its score under every profile (in profile order)
+    void stream_search_profiles(double lon, double lat, double r_meters, double min_score,
+                                const std::vector<std::unordered_map<std::string, double>>& profiles,
+                                std::function<void(const CafeLoc&, const std::unordered_map<std::string, double>&, const std::vector<double>&)> callback) {
+        search_profiles_pass(lon, lat, r_meters, min_score, profiles, [&](const CafeLoc& cafe, const CafeAttributes& attributes,
+                                                                          double distance, const std::vector<double>& scores) {
+            std::unordered_map<std::string, double> row = {
+                {"id", cafe.id}, {"lon", cafe.lon}, {"lat", cafe.lat}, {"rating", attributes.rating},
+                {"price_level", attributes.price_level}, {"current_crowd", attributes.current_crowd},
+                {"distance", distance}};
+            callback(cafe, row, scores);
+        });
+    }
+
+    // Batch search scored from the engine's attribute store. The tree is only read, node
+    // weights are left untouched, so the queries are spread over num_threads workers
+    // (0 = one per hardware thread).
+    // With group_size > 1 the queries are put in Z-order and every worker runs groups of
+    // group_size nearby queries through one RTree::SearchGroup traversal, so a node is fetched
+    // once per group instead of once per query. group_size = 1 searches one query at a time.
+    BatchSearchResult search_batch(const std::vector<BatchQuery>& queries, std::unordered_map<std::string, double> weights = {},
+                                   double min_score = 0, int num_threads = 0, int group_size = 32) {
+        bool mapped;
+        {
+            ReadLock lock(mutex_);
+            mapped = current_snapshot() != nullptr;
+        }
+        if (mapped) {
+            // A mapped snapshot has no attribute store; one MySQL read for the whole batch
+            std::unordered_map<int, std::unordered_map<std::string, double>> cafeDatas = GetAllCafeData(0, 0, 0);
+            return run_search_batch(queries, weights, min_score, &cafeDatas, num_threads, group_size);
+        }
+        return run_search_batch(queries, weights, min_score, nullptr, num_threads, group_size);
+    }
+
+    // Batch search against a caller-provided attribute snapshot instead of the attribute store
+    BatchSearchResult search_batch(const std::vector<BatchQuery>& queries, const std::unordered_map<std::string, double>& weights,
+                                   double min_score, const std::unordered_map<int, std::unordered_map<std::string, double>>& cafeDatas,
+                                   int num_threads = 0, int group_size = 32) {
+        return run_search_batch(queries, weights, min_score, &cafeDatas, num_threads, group_size);
+    }
+
+    // Shape, overlap and memory of the in-memory tree (see RTree::Stats()); empty while searches
+    // are served from an opened snapshot. A falling fill factor or growing overlap and dead space
+    // after many inserts and moves is the sign to rebuild.
+    CafeTree::TreeStats tree_stats() const {
+        ReadLock lock(mutex_);
+        return tree.Stats();
+    }
+
+    // Rebuild the tree in the background: a packed tree of the current cafes (see
+    // RTree::BulkLoad) is built on a worker thread while searches and mutations go on against the
+    // current one. Mutations made meanwhile are replayed onto the new tree, which then takes the
+    // current one's place on the next engine call, in O(1) plus the last few replays. Returns
+    // false if a rebuild is running already or searches are served from a snapshot.
+    bool start_rebuild() {
+        WriteLock lock(mutex_);
+        return begin_rebuild();
+    }
+
+    // Put a finished rebuild in place of the tree, first waiting for it if wait is set. Returns
+    // true if the tree was replaced. Engine calls do this on their own once the rebuild is done.
+    bool finish_rebuild(bool wait = false) {
+        WriteLock lock(mutex_);
+        return swap_in_rebuild(wait);
+    }
+
+    bool rebuilding() const {
+        ReadLock lock(mutex_);
+        return rebuild_ != nullptr;
+    }
+
+    // Trees put in place by finish_rebuild() so far
+    size_t rebuild_count() const {
+        ReadLock lock(mutex_);
+        return rebuilds_;
+    }
+
+    // Rebuild on its own once the tree has degraded: every check_every inserts, moves and removes
+    // (crowd updates do not count), a rebuild starts if the fill factor has dropped below min_fill
+    // or, in the top levels of the tree, the area covered by two or more siblings exceeds
+    // max_overlap of the nodes' cover area. A check walks a few hundred nodes at most, on the
+    // mutating thread. check_every = 0 turns this off.
+    void configure_auto_rebuild(size_t check_every, double max_overlap = 0.25, double min_fill = 0.5) {
+        WriteLock lock(mutex_);
+        auto_rebuild_every_ = check_every;
+        auto_rebuild_overlap_ = max_overlap;
+        auto_rebuild_fill_ = min_fill;
+        mutations_since_check_ = 0;
+    }
+
+    // Bounds and grid of the search result cache. Queries whose point falls in the same coord_step
+    // cell and whose radius rounds to the same radius_step share an entry. max_entries = 0 turns
+    // the cache off; max_hits bounds the total number of cached hits (0 = no bound).
+    void configure_result_cache(size_t max_entries, size_t max_hits = 0, double coord_step = 1e-5, double radius_step = 1.0) {
+        cache_.Configure(max_entries, max_hits, coord_step, radius_step);
+    }
+
+    SearchCache::Stats result_cache_stats() {
+        return cache_.GetStats();
+    }
+
+    void clear_result_cache() {
+        cache_.Clear();
+    }
+
+    // Write the tree to a memory-mappable snapshot file (see RTreeSnapshot.h). The current
+    // attributes from the attribute store are stored with each cafe.
+    bool save_snapshot(const std::string& path) {
+        WriteLock lock(mutex_);
+        return write_snapshot(path);
+    }
+
+    // Serve searches straight from a mapped snapshot file, without rebuilding the tree.
+    // The next insert copies the snapshot into the tree and unmaps it.
+    bool open_snapshot(const std::string& path) {
+        WriteLock lock(mutex_);
+        return map_snapshot(path);
+    }
+
+    // Writer side of a shared index: write the tree and attributes to the next snapshot file
+    // under `prefix` (e.g. /dev/shm/rtree_engine) and bump the generation in `prefix`.gen.
+    // Several processes may publish to the same prefix: each holds a lock on `prefix`.gen from
+    // reading the generation until it has stored the next one.
+    // Returns the new generation, or 0 on failure.
+    uint64_t publish_shared(const std::string& prefix) {
+        WriteLock lock(mutex_);
+        RTreeSnapshotGeneration generation;
+        if (!generation.Open((prefix + ".gen").c_str(), true) || !generation.Lock()) {
+            std::cout << "❌ Failed to open and lock " << prefix << ".gen\n";
+            return 0;
+        }
+
+        uint64_t published = generation.Load();
+        uint64_t next = published + 1;
+        if (!write_snapshot(shared_snapshot_path(prefix, next))) {
+            return 0;
+        }
+        generation.Store(next);
+
+        // Readers still on the old generation keep their mapping alive after the unlink
+        if (published > 0) {
+            std::remove(shared_snapshot_path(prefix, published).c_str());
+        }
+        return next;
+    }
+
+    // Reader side of a shared index: map the published snapshot under `prefix` read-only.
+    // Every search checks the generation counter and remaps when the writer publishes again,
+    // so workers share one copy of the index instead of building their own.
+    bool attach_shared(const std::string& prefix) {
+        WriteLock lock(mutex_);
+        detach_shared();
+        if (!shared_generation_.Open((prefix + ".gen").c_str(), false)) {
+            std::cout << "❌ No shared index published at " << prefix << "\n";
+            return false;
+        }
+        shared_prefix_ = prefix;
+        clear_snapshot_crowd();
+        clear_tree();
+        return current_snapshot() != nullptr;
+    }
+
+    // Generation of the mapped shared snapshot, 0 if not attached
+    uint64_t shared_generation() const {
+        ReadLock lock(mutex_);
+        return shared_generation_.IsOpen() ? mapped_generation_.load() : 0;
+    }
+
+    // Recover from the last checkpoint plus the write-ahead log, then log every further mutation.
+    // The snapshot at snapshot_path (if any) is mapped, and log entries written after it are
+    // replayed into the tree, so a restart needs neither the CSV nor a rebuild from MySQL.
+    bool enable_durability(const std::string& snapshot_path, const std::string& wal_path) {
+        WriteLock lock(mutex_);
+        wal_.reset();
+
+        uint64_t covered = 0;
+        if (std::ifstream(snapshot_path).good()) {
+            if (!map_snapshot(snapshot_path)) {
+                return false;
+            }
+            covered = std::atomic_load(&snapshot_)->GetHeader().m_tag;
+        }
+
+        size_t replayed = 0;
+        std::unique_ptr<CafeLog> wal(new CafeLog());
+        bool ok = wal->Open(wal_path.c_str(), covered, [&](uint32_t op, uint64_t, const CafeRecord& record) {
+            thaw_snapshot();
+            if (op == CAFE_LOG_UPSERT) {
+                upsert_into_tree(record.id, record.lon, record.lat, {record.rating, record.price_level, record.current_crowd});
+            } else if (op == CAFE_LOG_MOVE) {
+                move_in_tree(record.id, record.lon, record.lat);
+            } else if (op == CAFE_LOG_REMOVE) {
+                remove_from_tree(record.id);
+            }
+            ++replayed;
+        });
+        if (!ok) {
+            std::cout << "❌ Failed to open log " << wal_path << "\n";
+            return false;
+        }
+        maybe_start_rebuild();
+
+        std::cout << "[Recovery] replayed " << replayed << " log entries after " << covered << "\n";
+        wal_ = std::move(wal);
+        checkpoint_path_ = snapshot_path;
+        return true;
+    }
+
+    // Write a snapshot covering everything logged so far and empty the log
+    bool checkpoint() {
+        WriteLock lock(mutex_);
+        if (!wal_) {
+            std::cout << "❌ Durability is not enabled\n";
+            return false;
+        }
+        return write_snapshot(checkpoint_path_) && wal_->Truncate();
+    }
+
+    // Writes + fdatasyncs of the log so far. Mutations committing at the same time share one, so
+    // under concurrent writers this stays below the number of mutations.
+    uint64_t log_flushes() const {
+        ReadLock lock(mutex_);
+        return wal_ ? wal_->Flushes() : 0;
     }
 
 private:
-    std::string mode_ = "trimmed_mean";
+    std::string mode_;
+
+    // Lets the public calls come from several threads at once (the Python bindings release the
+    // GIL): calls that only read the tree and the attribute store take it shared, everything else
+    // exclusive. The private members below expect their caller to hold it.
+    mutable std::shared_timed_mutex mutex_;
+    typedef std::unique_lock<std::shared_timed_mutex> WriteLock;
+    typedef std::shared_lock<std::shared_timed_mutex> ReadLock;
+
+    // What a search does besides reading, which decides how it holds mutex_
+    enum SearchAccess {
+        READS_ONLY,
+        READS_BOUNDS,       // Prunes by the node bounds, which have to be fresh
+        WRITES_TREE,        // Labels nodes
+    };
+
+    // mutex_ for one search: exclusive if the search writes, shared otherwise. Searches of a mapped
+    // snapshot only read, so while one is mapped every search shares the lock. A search that finds
+    // the bounds stale (after a mutation) refreshes them and runs holding the lock exclusively; the
+    // searches after it share it again.
+    class SearchLock {
+    public:
+        SearchLock(RTreeEngine& engine, SearchAccess access) {
+            for (;;) {
+                bool mapped = std::atomic_load(&engine.snapshot_) != nullptr;
+                if (access == WRITES_TREE && !mapped) {
+                    write_ = WriteLock(engine.mutex_);
+                } else {
+                    read_ = ReadLock(engine.mutex_);
+                }
+                // A snapshot mapped or thawed while waiting for the lock calls for the other kind
+                if (access != READS_ONLY && mapped != (std::atomic_load(&engine.snapshot_) != nullptr)) {
+                    write_ = WriteLock();
+                    read_ = ReadLock();
+                    continue;
+                }
+                if (access != READS_BOUNDS || mapped || !engine.bounds_stale()) {
+                    return;
+                }
+
+                read_ = ReadLock();
+                write_ = WriteLock(engine.mutex_);
+                if (!std::atomic_load(&engine.snapshot_)) {
+                    engine.refresh_tree_bounds();
+                    return;
+                }
+                write_ = WriteLock();
+            }
+        }
+
+    private:
+        WriteLock write_;
+        ReadLock read_;
+    };
+
+    // LabelNodeWeight instantiated for mode_, picked once in the constructor
+    void (RTreeEngine::*label_nodes_)(double, double, double, const std::function<double (const CafeRef&)>&, const std::function<bool ()>&);
+
+    template<class AGGREGATE>
+    void label_nodes(double lon, double lat, double r_meters, const std::function<double (const CafeRef&)>& score,
+                     const std::function<bool ()>& interrupt) {
+        swap_in_rebuild();
+        tree.LabelNodeWeight<AGGREGATE>(lon, lat, r_meters, {}, nullptr, score, interrupt);
+    }
+
+    // Deadlines are taken on the monotonic clock, wall clock jumps must not end or extend a search
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    // Nodes a traversal visits between two reads of the clock
+    static const int DEADLINE_POLL = 8;
+
+    // When a search starting now with a budget of budget_ms has to end; max() for no budget
+    static TimePoint deadline_after(double budget_ms) {
+        if (budget_ms <= 0) {
+            return TimePoint::max();
+        }
+        return std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(budget_ms));
+    }
+
+    // What the tree traversals poll (once per node) to end a search early: cancel being cancelled,
+    // or the clock passing deadline. nullptr when there is nothing to poll.
+    static std::function<bool ()> interrupt_for(const std::shared_ptr<SearchCancel>& cancel, TimePoint deadline = TimePoint::max()) {
+        bool timed = deadline != TimePoint::max();
+        if (!cancel && !timed) {
+            return nullptr;
+        }
+        int polls = 0;
+        return [cancel, timed, deadline, polls]() mutable {
+            if (cancel && cancel->cancelled()) {
+                return true;
+            }
+            return timed && ++polls % DEADLINE_POLL == 0 && std::chrono::steady_clock::now() >= deadline;
+        };
+    }
+
+    enum Phase {
+        PHASE_TOTAL,
+        PHASE_FETCH,
+        PHASE_SCORING,
+        PHASE_TRAVERSAL,
+        PHASE_CALLBACK,
+        PHASE_COUNT
+    };
+
+    static const char* phase_name(int phase) {
+        static const char* const names[PHASE_COUNT] = {"total", "fetch", "scoring", "traversal", "callback"};
+        return names[phase];
+    }
+
+    // Latency of every search phase, in us, over all searches (search, stream_search*)
+    RTreeLatencyHistogram latency_[PHASE_COUNT];
+
+    // Time spent in a call made once per entry or hit, extrapolated from every SAMPLE_EVERY-th
+    // call so the clock is not read around each of them. The stride is not a power of two, so the
+    // sample does not line up with the reallocations of containers the calls fill.
+    class SampledTimer {
+    public:
+        static const uint64_t SAMPLE_EVERY = 31;
+
+        template<class F>
+        auto operator()(F f) -> decltype(f()) {
+            if (calls_++ % SAMPLE_EVERY != 0) {
+                return f();
+            }
+            auto start = std::chrono::steady_clock::now();
+            auto result = f();
+            sampled_ += std::chrono::steady_clock::now() - start;
+            ++timed_;
+            return result;
+        }
+
+        double ms() const {
+            return timed_ ? std::chrono::duration<double, std::milli>(sampled_).count() * calls_ / timed_ : 0.0;
+        }
+
+    private:
+        uint64_t calls_ = 0;
+        uint64_t timed_ = 0;
+        std::chrono::steady_clock::duration sampled_ = std::chrono::steady_clock::duration::zero();
+    };
+
+    // Instrumentation of one search: tree work counters, phase times and allocations, put into its
+    // SearchStatus and the engine's latency histograms by finish(). Phases timed as a whole add to
+    // the *_ms fields; the sampled timers are for calls made inside the traversal.
+    class QueryTrace {
+    public:
+        explicit QueryTrace(RTreeEngine& engine)
+            : engine_(engine), start_(std::chrono::steady_clock::now()), allocations_(thread_allocation_count()) {}
+
+        template<class F>
+        void time(double& ms, F f) {
+            auto start = std::chrono::steady_clock::now();
+            f();
+            ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        void finish(SearchStatus& status, size_t hits) {
+            SearchStats& stats = status.stats;
+            stats.nodes_visited = counters.m_nodesVisited;
+            stats.nodes_pruned = counters.m_nodesPruned;
+            stats.leaves_scanned = counters.m_leavesScanned;
+            stats.overlap_tests = counters.m_overlapTests;
+            stats.hits = hits;
+            stats.fetch_ms = fetch_ms + fetch.ms();
+            stats.scoring_ms = scoring_ms + scoring.ms();
+            stats.callback_ms = callback.ms();
+            stats.traversal_ms = std::max(0.0, traversal_ms - fetch.ms() - scoring.ms() - callback.ms());
+            stats.total_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_).count();
+            stats.allocations = thread_allocation_count() - allocations_;
+
+            const double phases[PHASE_COUNT] = {stats.total_ms, stats.fetch_ms, stats.scoring_ms, stats.traversal_ms, stats.callback_ms};
+            for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+                if (phases[phase] > 0) {
+                    engine_.latency_[phase].Record(phases[phase] * 1000.0);
+                }
+            }
+        }
+
+        CafeTree::SearchCounters counters = CafeTree::SearchCounters();
+        double fetch_ms = 0;
+        double scoring_ms = 0;
+        double traversal_ms = 0;
+        SampledTimer fetch;
+        SampledTimer scoring;
+        SampledTimer callback;
+
+    private:
+        RTreeEngine& engine_;
+        std::chrono::steady_clock::time_point start_;
+        uint64_t allocations_;
+    };
+
+    // Status of a search cancelled before it could tell how far it got
+    static SearchStatus cancelled_status() {
+        SearchStatus status;
+        status.partial = true;
+        status.coverage = 0;
+        return status;
+    }
+
+    // Early end of a streamed search: after limit hits, after the first hit stop_when returns true
+    // for, or at the first check after cancel was cancelled
+    class StreamStop {
+    public:
+        StreamStop(size_t limit, std::function<bool (const CafeLoc&)> stop_when, std::shared_ptr<SearchCancel> cancel)
+            : limit_(limit), stop_when_(std::move(stop_when)), cancel_(std::move(cancel)) {}
+
+        bool cancelled() {
+            if (cancel_ && cancel_->cancelled()) {
+                cancelled_ = ended_ = true;
+            }
+            return ended_;
+        }
+
+        // Counts a hit that was just passed on; false once the stream has to end
+        bool count(const CafeLoc& cafe) {
+            ++emitted_;
+            if ((limit_ > 0 && emitted_ >= limit_) || (stop_when_ && stop_when_(cafe)) || cancelled()) {
+                ended_ = true;
+            }
+            return !ended_;
+        }
+
+        bool ended() const { return ended_; }
+        size_t emitted() const { return emitted_; }
+
+        // Ending at the limit or at stop_when is a complete result, a cancelled one is partial
+        SearchStatus status(double min_score) const {
+            if (cancelled_) {
+                return cancelled_status();
+            }
+            SearchStatus status;
+            status.complete_above = min_score;
+            return status;
+        }
+
+    private:
+        size_t limit_;
+        std::function<bool (const CafeLoc&)> stop_when_;
+        std::shared_ptr<SearchCancel> cancel_;
+        size_t emitted_ = 0;
+        bool ended_ = false;
+        bool cancelled_ = false;
+    };
+
+    // Mapped, read-only snapshot being served instead of the tree, if any. Searches take their
+    // own reference, so swapping in a new generation never unmaps one that is still in use.
+    std::shared_ptr<const CafeSnapshot> snapshot_;
+
+    // Shared index state (attach_shared)
+    RTreeSnapshotGeneration shared_generation_;
+    std::string shared_prefix_;
+    std::atomic<uint64_t> mapped_generation_{0};
+    std::mutex remap_mutex_;
+
+    // Crowd readings applied while a snapshot is mapped (update_crowd), by cafe id, starting from
+    // the crowd in the snapshot's records. Only valid for the snapshot it was built from: a newly
+    // published generation comes with current records.
+    std::weak_ptr<const CafeSnapshot> crowd_snapshot_;
+    std::unordered_map<int, int32_t> snapshot_crowd_;
+
+    // Durability state (enable_durability). Shared with mutations committing after they released
+    // mutex_, so that enable_durability can replace it meanwhile.
+    std::shared_ptr<CafeLog> wal_;
+    std::string checkpoint_path_;
+
+    // A mutation's log entries and MySQL write, made durable after it released mutex_ (persist)
+    struct PendingWrite {
+        std::shared_ptr<CafeLog> wal;
+        uint64_t lsn = 0;
+        uint64_t ticket = 0;        // Position among the mutations' MySQL writes
+    };
+
+    // MySQL writes go out in the order the mutations took mutex_, so that the table ends up as the
+    // tree does: each takes a ticket under mutex_ and waits for its turn.
+    uint64_t mysql_tickets_ = 0;
+    std::mutex mysql_mutex_;
+    std::condition_variable mysql_turn_;
+    uint64_t mysql_serving_ = 0;    // Guarded by mysql_mutex_
+
+    // A tree mutation, recorded for a running rebuild to replay
+    struct TreeOp {
+        enum Kind { INSERT, MOVE, REMOVE, REMOVE_ALL, MARK_DIRTY, INVALIDATE_BOUNDS } kind;
+        CafeRef ref;
+        double lon, lat;
+    };
+
+    // A rebuild in progress (start_rebuild)
+    struct Rebuild {
+        std::thread worker;
+        CafeTree tree;
+        std::mutex mutex;                       // Guards pending and ready
+        std::vector<TreeOp> pending;            // Mutations not replayed onto tree yet
+        bool ready = false;                     // Built, and pending is short enough to replay on a swap
+    };
+
+    // Mutations a rebuild may leave for finish_rebuild() to replay
+    static const size_t REBUILD_BACKLOG = 64;
+    // Share of each node a bulk load (rebuilds, load_csv) fills, leaving room for inserts before nodes split
+    static constexpr double PACKED_FILL = 0.75;
+
+    std::unique_ptr<Rebuild> rebuild_;
+    std::thread retire_worker_;             // Frees the tree the last rebuild replaced, joined by the destructor
+    size_t rebuilds_ = 0;
+    size_t auto_rebuild_every_ = 0;
+    double auto_rebuild_overlap_ = 0.25;
+    double auto_rebuild_fill_ = 0.5;
+    size_t mutations_since_check_ = 0;
+    // Levels of the tree an auto rebuild check measures overlap in: MAXNODES^4 nodes at most
+    static const int AUTO_REBUILD_LEVELS = 4;
+
+    // Every cafe in the tree, in one contiguous array. Slots are stable while the cafe exists, so
+    // leaves can refer to them by index; slots of removed cafes are reused by later inserts.
+    std::vector<CafeLoc> store_;
+    std::vector<CafeAttributes> attributes_;    // Same slots as store_
+    std::vector<uint32_t> free_slots_;
+    uint64_t attribute_epoch_ = 0;
+    std::unordered_map<int, uint32_t> slots_;   // Cafe id to slot
+
+    // Static score part of every slot under one weight profile
+    struct ProfileScores {
+        uint64_t hash;
+        ScoreProfile profile;
+        std::vector<double> static_scores;      // Same slots as store_
+        double peak;                            // >= static part + crowd term of every cafe; only raised between rebuilds
+    };
+
+    static const size_t MAX_PROFILES = 4;
+
+    std::shared_ptr<ProfileScores> bound_profile_;              // The node bounds are kept for this one
+    std::vector<std::shared_ptr<ProfileScores>> profiles_;      // Others recently queried, most recent first
+    // Guards profiles_ against searches sharing mutex_, which add to it; calls holding mutex_
+    // exclusively have it to themselves
+    std::mutex profiles_mutex_;
+
+    // Results of search / stream_search on the tree, tagged with attribute_epoch_
+    SearchCache cache_;
+
+    static void hash_bytes(uint64_t& hash, const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+    }
+
+    static uint64_t weights_hash(const std::unordered_map<std::string, double>& weights) {
+        std::vector<std::pair<std::string, double>> sorted(weights.begin(), weights.end());
+        std::sort(sorted.begin(), sorted.end());
+
+        uint64_t hash = 14695981039346656037ull;
+        for (const auto& weight : sorted) {
+            hash_bytes(hash, weight.first.data(), weight.first.size() + 1);
+            hash_bytes(hash, &weight.second, sizeof(double));
+        }
+        return hash;
+    }
+
+    // Everything besides the query circle that changes a search result. ranked: the hits come from
+    // the best-first pass (search_ranked_pass) rather than the labelled traversal, which prunes by
+    // the aggregated node weights and so may not find the same cafes.
+    uint64_t profile_hash(const std::unordered_map<std::string, double>& weights, double min_score, size_t limit, bool ranked) const {
+        uint64_t hash = weights_hash(weights);
+        hash_bytes(hash, &min_score, sizeof(double));
+        uint64_t top = limit;
+        hash_bytes(hash, &top, sizeof(top));
+        hash_bytes(hash, &ranked, sizeof(ranked));
+        hash_bytes(hash, mode_.data(), mode_.size());
+        return hash;
+    }
+
+    std::shared_ptr<ProfileScores> make_profile_scores(const std::unordered_map<std::string, double>& weights, bool fill = true) const {
+        std::shared_ptr<ProfileScores> scores = std::make_shared<ProfileScores>();
+        scores->hash = weights_hash(weights);
+        scores->profile = ScoreProfile(weights);
+        scores->peak = std::numeric_limits<double>::lowest();
+        if (fill) {
+            scores->static_scores.resize(store_.size());
+            for (const auto& entry : slots_) {
+                const CafeAttributes& attributes = attributes_[entry.second];
+                scores->static_scores[entry.second] = scores->profile.static_part(attributes.rating, attributes.price_level);
+                scores->peak = std::max(scores->peak, scores->static_scores[entry.second] + scores->profile.crowd_part(attributes.current_crowd));
+            }
+        }
+        return scores;
+    }
+
+    // Static parts for this profile, computed once and then kept up to date with the attribute store
+    std::shared_ptr<const ProfileScores> scores_for(const std::unordered_map<std::string, double>& weights) {
+        uint64_t hash = weights_hash(weights);
+        if (bound_profile_->hash == hash) {
+            return bound_profile_;
+        }
+        std::lock_guard<std::mutex> lock(profiles_mutex_);
+        for (size_t i = 0; i < profiles_.size(); ++i) {
+            if (profiles_[i]->hash == hash) {
+                std::rotate(profiles_.begin(), profiles_.begin() + i, profiles_.begin() + i + 1);
+                return profiles_.front();
+            }
+        }
+
+        profiles_.insert(profiles_.begin(), make_profile_scores(weights));
+        if (profiles_.size() > MAX_PROFILES) {
+            profiles_.pop_back();
+        }
+        return profiles_.front();
+    }
+
+    // Upper bound on the score of any cafe in a node for a query at (lon, lat): the node's stored max
+    // of static part plus crowd term (see refresh_bounds), plus the best distance term any point of
+    // the node's cover can get. The stored max is only valid for the bound profile with fresh bounds;
+    // for other profiles (use_stored = false) the profile's peak over all cafes stands in for it.
+    CafeTree::NodeBoundFunc score_bound(const ProfileScores& scores, double lon, double lat, double r_meters, bool use_stored = true) const {
+        double weight = scores.profile.distance;
+        double peak = scores.peak;
+        return [=](const double* min, const double* max, double stored) {
+            if (!use_stored) {
+                stored = peak;
+            }
+            double distance;
+            if (weight >= 0) {
+                // Nearest point of the cover; hit distances are rounded to meters, so allow a meter
+                double near_lon = std::min(std::max(lon, min[0]), max[0]);
+                double near_lat = std::min(std::max(lat, min[1]), max[1]);
+                distance = std::max(0.0, haversine(lat, lon, near_lat, near_lon) - 1.0);
+            } else {
+                // A negative weight favours far cafes: farthest corner instead
+                double far_lon = (lon - min[0] > max[0] - lon) ? min[0] : max[0];
+                double far_lat = (lat - min[1] > max[1] - lat) ? min[1] : max[1];
+                distance = haversine(lat, lon, far_lat, far_lon) + 1.0;
+            }
+            // Plus the most the final rounding to 3 decimals can add
+            return stored + weight * (1 - distance / (r_meters * 2)) + 0.0005;
+        };
+    }
+
+    void update_static_scores(uint32_t slot) {
+        const CafeAttributes& attributes = attributes_[slot];
+        auto update = [&](ProfileScores& scores) {
+            if (scores.static_scores.size() <= slot) {
+                scores.static_scores.resize(slot + 1);
+            }
+            scores.static_scores[slot] = scores.profile.static_part(attributes.rating, attributes.price_level);
+        };
+        update(*bound_profile_);
+        for (auto& scores : profiles_) {
+            update(*scores);
+        }
+        raise_peaks(slot);
+    }
+
+    // Keep every profile's peak an upper bound after the attributes in `slot` changed
+    void raise_peaks(uint32_t slot) {
+        auto raise = [&](ProfileScores& scores) {
+            scores.peak = std::max(scores.peak, scores.static_scores[slot] + scores.profile.crowd_part(attributes_[slot].current_crowd));
+        };
+        raise(*bound_profile_);
+        for (auto& scores : profiles_) {
+            raise(*scores);
+        }
+    }
+
+    // Score of the cafe in `slot` for a query at (lon, lat): precomputed static part plus the
+    // crowd and distance terms
+    double score_of(const ProfileScores& scores, uint32_t slot, double lon, double lat, double r_meters) const {
+        const CafeLoc& cafe = store_[slot];
+        double distance = std::round(haversine(lat, lon, cafe.lat, cafe.lon));
+        return ScoreProfile::finish(scores.static_scores[slot] + scores.profile.crowd_part(attributes_[slot].current_crowd) +
+                                    scores.profile.distance_part(distance, r_meters));
+    }
+
+    // Copy of a stored cafe with the score its leaf entry carries
+    CafeLoc cafe_at(const CafeRef& ref) const {
+        CafeLoc cafe = store_[ref.index];
+        cafe.weight = ref.weight;
+        return cafe;
+    }
+
+    CafeRef ref_to(uint32_t slot) const {
+        return CafeRef{slot, store_[slot].id, 0.0};
+    }
+
+    // Queue a move or remove in the log, with mutex_ held; persist commits it
+    PendingWrite log_mutation(CafeLogOp op, int id, double lon, double lat) {
+        PendingWrite pending;
+        pending.ticket = mysql_tickets_++;
+        if (wal_) {
+            CafeRecord record = {id, 0, 0, 0, lon, lat, 0.0};
+            pending.wal = wal_;
+            pending.lsn = wal_->Append(op, record);
+        }
+        return pending;
+    }
+
+    // Apply a mutation to the tree and record it for a running rebuild
+    bool apply_tree_op(const TreeOp& op) {
+        swap_in_rebuild();
+        bool applied = apply_tree_op(tree, op);
+        if (rebuild_) {
+            std::lock_guard<std::mutex> lock(rebuild_->mutex);
+            rebuild_->pending.push_back(op);
+        }
+        // Crowd changes and bound invalidations leave the tree's shape alone
+        if (op.kind == TreeOp::INSERT || op.kind == TreeOp::MOVE || op.kind == TreeOp::REMOVE) {
+            ++mutations_since_check_;
+        }
+        return applied;
+    }
+
+    // Start a rebuild if the tree has degraded enough for one (see configure_auto_rebuild). Called
+    // by the public mutators once they are done: start_rebuild copies the store, so it must not
+    // run halfway through a mutation, e.g. between taking a cafe out of the tree and freeing its slot.
+    void maybe_start_rebuild() {
+        if (auto_rebuild_every_ == 0 || mutations_since_check_ < auto_rebuild_every_) {
+            return;
+        }
+        mutations_since_check_ = 0;
+        if (!rebuild_ && degraded()) {
+            begin_rebuild();
+        }
+    }
+
+    static bool apply_tree_op(CafeTree& target, const TreeOp& op) {
+        double point[2] = {op.lon, op.lat};
+        switch (op.kind) {
+        case TreeOp::INSERT:
+            target.Insert(point, point, op.ref);
+            return true;
+        case TreeOp::MOVE:
+            return target.Move(op.ref, point, point);
+        case TreeOp::REMOVE:
+            target.Remove(op.ref);
+            return true;
+        case TreeOp::REMOVE_ALL:
+            target.RemoveAll();
+            return true;
+        case TreeOp::MARK_DIRTY:
+            return target.MarkDirty(op.ref);
+        case TreeOp::INVALIDATE_BOUNDS:
+            target.InvalidateBounds();
+            return true;
+        }
+        return false;
+    }
+
+    // Cheap enough for every check: the fill factor comes from the tree's node count, and the
+    // overlap from its top AUTO_REBUILD_LEVELS levels, where it sends searches down the most subtrees
+    bool degraded() const {
+        if (slots_.empty()) {
+            return false;
+        }
+        // Every node but the root is a branch of its parent
+        double nodes = tree.NodeCount();
+        double fill = (slots_.size() + nodes - 1) / (nodes * CafeTree::MAXNODES);
+        if (fill < auto_rebuild_fill_) {
+            return true;
+        }
+        CafeTree::TreeStats top = tree.Stats(AUTO_REBUILD_LEVELS);
+        return top.m_overlapArea > auto_rebuild_overlap_ * top.m_coverArea;
+    }
+
+    // start_rebuild, with mutex_ held
+    bool begin_rebuild() {
+        if (rebuild_ || std::atomic_load(&snapshot_)) {
+            return false;
+        }
+
+        // Copied here, since the store keeps changing under the worker
+        std::vector<CafeTree::BulkEntry> entries;
+        entries.reserve(slots_.size());
+        std::vector<double> bounds(store_.size());
+        for (const auto& slot : slots_) {
+            const CafeLoc& cafe = store_[slot.second];
+            CafeTree::BulkEntry entry = {{cafe.lon, cafe.lat}, {cafe.lon, cafe.lat}, ref_to(slot.second)};
+            entries.push_back(entry);
+            bounds[slot.second] = bound_value(slot.second);
+        }
+
+        rebuild_.reset(new Rebuild());
+        rebuild_->tree.EnableDataIndex();
+        rebuild_->worker = std::thread(&RTreeEngine::run_rebuild, rebuild_.get(), std::move(entries), std::move(bounds));
+        return true;
+    }
+
+    // finish_rebuild, with mutex_ held: every call that changes the tree starts with this
+    bool swap_in_rebuild(bool wait = false) {
+        if (!rebuild_) {
+            return false;
+        }
+        if (!wait) {
+            std::lock_guard<std::mutex> lock(rebuild_->mutex);
+            if (!rebuild_->ready) {
+                return false;
+            }
+        }
+        rebuild_->worker.join();
+
+        // The worker is gone, so what it left to replay is ours
+        for (const TreeOp& op : rebuild_->pending) {
+            apply_tree_op(rebuild_->tree, op);
+        }
+        tree.Swap(rebuild_->tree);
+        ++rebuilds_;
+
+        // Freeing the old tree's nodes takes as long as building them did, so not on this thread. The
+        // previous one finished long ago: a rebuild takes longer than freeing a tree.
+        if (retire_worker_.joinable()) {
+            retire_worker_.join();
+        }
+        retire_worker_ = std::thread([](std::unique_ptr<Rebuild>) {}, std::move(rebuild_));
+        return true;
+    }
+
+    // Worker of start_rebuild(): pack the entries, then replay the mutations made meanwhile until
+    // few enough are left for finish_rebuild()
+    static void run_rebuild(Rebuild* rebuild, std::vector<CafeTree::BulkEntry> entries, std::vector<double> bounds) {
+        rebuild->tree.BulkLoad(std::move(entries), PACKED_FILL);
+        rebuild->tree.RefreshBounds([&bounds](const CafeRef& ref) {
+            return bounds[ref.index];
+        });
+
+        for (;;) {
+            std::vector<TreeOp> ops;
+            {
+                std::lock_guard<std::mutex> lock(rebuild->mutex);
+                if (rebuild->pending.size() <= REBUILD_BACKLOG) {
+                    rebuild->ready = true;
+                    return;
+                }
+                ops.swap(rebuild->pending);
+            }
+            for (const TreeOp& op : ops) {
+                apply_tree_op(rebuild->tree, op);
+            }
+        }
+    }
+
+    // Whether a search by the bounds has to refresh them first (which also puts a finished rebuild
+    // in place, as every call changing the tree does)
+    bool bounds_stale() const {
+        if (!tree.BoundsFresh()) {
+            return true;
+        }
+        if (!rebuild_) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(rebuild_->mutex);
+        return rebuild_->ready;
+    }
+
+    // refresh_bounds, with mutex_ held
+    void refresh_tree_bounds() {
+        swap_in_rebuild();
+        tree.RefreshBounds([this](const CafeRef& ref) {
+            return bound_value(ref.index);
+        });
+    }
+
+    // Best query-independent score of a slot under the bound profile, see refresh_bounds
+    double bound_value(uint32_t slot) const {
+        return bound_profile_->static_scores[slot] + bound_profile_->profile.crowd_part(attributes_[slot].current_crowd);
+    }
+
+    void upsert_into_tree(int id, double lon, double lat, const CafeAttributes& attributes) {
+        ++attribute_epoch_;
+
+        auto it = slots_.find(id);
+        if (it != slots_.end()) {
+            attributes_[it->second] = attributes;
+            update_static_scores(it->second);
+            apply_tree_op({TreeOp::MARK_DIRTY, ref_to(it->second), 0, 0});
+            move_in_tree(id, lon, lat);
+            return;
+        }
+
+        uint32_t slot = place_in_store(id, lon, lat, attributes);
+        update_static_scores(slot);
+
+        apply_tree_op({TreeOp::INSERT, ref_to(slot), lon, lat});
+    }
+
+    // Store a cafe in its slot, or in a free one if it is new; the tree is left to the caller
+    uint32_t place_in_store(int id, double lon, double lat, const CafeAttributes& attributes) {
+        auto it = slots_.find(id);
+        if (it != slots_.end()) {
+            store_[it->second] = CafeLoc(id, lon, lat);
+            attributes_[it->second] = attributes;
+            return it->second;
+        }
+
+        uint32_t slot;
+        if (!free_slots_.empty()) {
+            slot = free_slots_.back();
+            free_slots_.pop_back();
+            store_[slot] = CafeLoc(id, lon, lat);
+            attributes_[slot] = attributes;
+        } else {
+            slot = static_cast<uint32_t>(store_.size());
+            store_.emplace_back(id, lon, lat);
+            attributes_.push_back(attributes);
+        }
+        slots_[id] = slot;
+        return slot;
+    }
+
+    void reserve_store(size_t count) {
+        slots_.reserve(count);
+        store_.reserve(count);
+        attributes_.reserve(count);
+    }
+
+    // Fill the empty tree with every stored cafe in one packed build (see RTree::BulkLoad)
+    // instead of inserting them one by one
+    void bulk_load_store() {
+        std::vector<CafeTree::BulkEntry> entries;
+        entries.reserve(slots_.size());
+        for (const auto& entry : slots_) {
+            const CafeLoc& cafe = store_[entry.second];
+            entries.push_back(CafeTree::BulkEntry{{cafe.lon, cafe.lat}, {cafe.lon, cafe.lat}, ref_to(entry.second)});
+        }
+        tree.BulkLoad(std::move(entries), PACKED_FILL);
+    }
+
+    // Queue upserted cafes in the log, with mutex_ held; persist commits the whole batch at once
+    PendingWrite log_cafes(const std::vector<Cafe>& cafes) {
+        PendingWrite pending;
+        pending.ticket = mysql_tickets_++;
+        if (wal_) {
+            pending.wal = wal_;
+            for (const auto& cafe : cafes) {
+                CafeRecord record = {cafe.id, cafe.price_level, cafe.current_crowd, 0, cafe.lon, cafe.lat, cafe.rating};
+                pending.lsn = wal_->Append(CAFE_LOG_UPSERT, record);
+            }
+        }
+        return pending;
+    }
+
+    // Commit a mutation's log entries and make its MySQL write, without mutex_: writers arriving
+    // meanwhile join the same fdatasync (see RTreeWAL::Commit), and searches go on.
+    void persist(const PendingWrite& pending, const std::function<bool ()>& write_mysql, const char* mysql_failed) {
+        if (pending.wal && !pending.wal->Commit(pending.lsn)) {
+            std::cout << "❌ Failed to write to the log\n";
+        }
+
+        std::unique_lock<std::mutex> lock(mysql_mutex_);
+        mysql_turn_.wait(lock, [&] { return mysql_serving_ == pending.ticket; });
+        if (!write_mysql()) {
+            std::cout << mysql_failed;
+        }
+        ++mysql_serving_;
+        mysql_turn_.notify_all();
+    }
+
+    bool move_in_tree(int id, double lon, double lat) {
+        auto it = slots_.find(id);
+        if (it == slots_.end()) return false;
+
+        store_[it->second].lon = lon;
+        store_[it->second].lat = lat;
+        ++attribute_epoch_;
+        return apply_tree_op({TreeOp::MOVE, ref_to(it->second), lon, lat});
+    }
+
+    bool remove_from_tree(int id) {
+        auto it = slots_.find(id);
+        if (it == slots_.end()) return false;
+
+        apply_tree_op({TreeOp::REMOVE, ref_to(it->second), 0, 0});
+        store_[it->second].id = -1;
+        ++attribute_epoch_;
+        free_slots_.push_back(it->second);
+        slots_.erase(it);
+        return true;
+    }
+
+    void clear_tree() {
+        apply_tree_op({TreeOp::REMOVE_ALL, CafeRef(), 0, 0});
+        std::vector<CafeLoc>().swap(store_);
+        std::vector<CafeAttributes>().swap(attributes_);
+        std::vector<uint32_t>().swap(free_slots_);
+        slots_.clear();
+        bound_profile_->static_scores.clear();
+        profiles_.clear();
+        ++attribute_epoch_;
+    }
+
+    // Attribute row of a hit in the shape GetAllCafeData returns, with its distance to (lon, lat)
+    // and the score from the last LabelNodeWeight
+    std::unordered_map<std::string, double> hit_row(const CafeRef& ref, double lon, double lat) const {
+        const CafeLoc& cafe = store_[ref.index];
+        const CafeAttributes& attributes = attributes_[ref.index];
+        return {
+            {"id", cafe.id}, {"lon", cafe.lon}, {"lat", cafe.lat}, {"rating", attributes.rating},
+            {"price_level", attributes.price_level}, {"current_crowd", attributes.current_crowd},
+            {"distance", std::round(haversine(lat, lon, cafe.lat, cafe.lon))}, {"score", ref.weight}};
+    }
+
+    // save_snapshot, with mutex_ held
+    bool write_snapshot(const std::string& path) {
+        thaw_snapshot();
+
+        // With a log, record how far into it the snapshot goes so that recovery replays only the rest
+        uint64_t lsn = wal_ ? wal_->LastLsn() : 0;
+
+        return CafeSnapshot::Write(path.c_str(), tree, [this](const CafeRef& ref) {
+            const CafeLoc& cafe = store_[ref.index];
+            const CafeAttributes& attributes = attributes_[ref.index];
+            CafeRecord record = {cafe.id, attributes.price_level, attributes.current_crowd, 0, cafe.lon, cafe.lat, attributes.rating};
+            return record;
+        }, lsn);
+    }
+
+    // open_snapshot, with mutex_ held
+    bool map_snapshot(const std::string& path) {
+        auto snapshot = std::make_shared<CafeSnapshot>();
+        if (!snapshot->Open(path.c_str())) {
+            std::cout << "❌ Failed to open snapshot " << path << "\n";
+            return false;
+        }
+        detach_shared();
+        std::atomic_store(&snapshot_, std::shared_ptr<const CafeSnapshot>(snapshot));
+        clear_snapshot_crowd();
+        clear_tree();
+        return true;
+    }
+
+    static std::string shared_snapshot_path(const std::string& prefix, uint64_t generation) {
+        return prefix + "." + std::to_string(generation) + ".snapshot";
+    }
+
+    // The snapshot to search, after picking up a newer shared generation if one was published
+    std::shared_ptr<const CafeSnapshot> current_snapshot() {
+        if (shared_generation_.IsOpen()) {
+            uint64_t published = shared_generation_.Load();
+            if (published != mapped_generation_.load()) {
+                std::lock_guard<std::mutex> lock(remap_mutex_);
+                if (published != mapped_generation_.load()) {
+                    auto snapshot = std::make_shared<CafeSnapshot>();
+                    if (snapshot->Open(shared_snapshot_path(shared_prefix_, published).c_str())) {
+                        std::atomic_store(&snapshot_, std::shared_ptr<const CafeSnapshot>(snapshot));
+                        mapped_generation_ = published;
+                    }
+                }
+            }
+        }
+        return std::atomic_load(&snapshot_);
+    }
+
+    void detach_shared() {
+        shared_generation_.Close();
+        shared_prefix_.clear();
+        mapped_generation_ = 0;
+    }
+
+    void thaw_snapshot() {
+        std::shared_ptr<const CafeSnapshot> snapshot = std::atomic_load(&snapshot_);
+        if (!snapshot) return;
+
+        const std::unordered_map<int, int32_t>* crowd = snapshot_crowd(snapshot);
+        if (slots_.empty() && !rebuild_) {
+            ++attribute_epoch_;
+            reserve_store(snapshot->Count());
+            snapshot->ForEach([&](const double*, const double*, const CafeRecord& stored) {
+                CafeRecord record = with_crowd(stored, crowd);
+                uint32_t slot = place_in_store(record.id, record.lon, record.lat, {record.rating, record.price_level, record.current_crowd});
+                update_static_scores(slot);
+            });
+            bulk_load_store();
+        } else {
+            snapshot->ForEach([&](const double*, const double*, const CafeRecord& stored) {
+                CafeRecord record = with_crowd(stored, crowd);
+                upsert_into_tree(record.id, record.lon, record.lat, {record.rating, record.price_level, record.current_crowd});
+            });
+        }
+        detach_shared();
+        std::atomic_store(&snapshot_, std::shared_ptr<const CafeSnapshot>());
+        clear_snapshot_crowd();
+    }
+
+    // update_crowd on a mapped snapshot: the records are read-only, so the readings are kept
+    // aside, in an overlay holding every cafe of the snapshot (which also tells unknown ids apart)
+    size_t update_snapshot_crowd(const std::shared_ptr<const CafeSnapshot>& snapshot, const std::vector<CrowdUpdate>& updates) {
+        if (!snapshot_crowd(snapshot)) {
+            snapshot_crowd_.clear();
+            snapshot_crowd_.reserve(snapshot->Count());
+            snapshot->ForEach([this](const double*, const double*, const CafeRecord& record) {
+                snapshot_crowd_[record.id] = record.current_crowd;
+            });
+            crowd_snapshot_ = snapshot;
+        }
+
+        size_t applied = 0;
+        for (const CrowdUpdate& update : updates) {
+            auto it = snapshot_crowd_.find(update.first);
+            if (it == snapshot_crowd_.end()) continue;
+
+            it->second = update.second;
+            ++applied;
+        }
+        if (applied > 0) {
+            ++attribute_epoch_;
+        }
+        return applied;
+    }
+
+    // The crowd overlay of this snapshot, nullptr if update_crowd has not touched it
+    const std::unordered_map<int, int32_t>* snapshot_crowd(const std::shared_ptr<const CafeSnapshot>& snapshot) const {
+        return crowd_snapshot_.lock() == snapshot ? &snapshot_crowd_ : nullptr;
+    }
+
+    void clear_snapshot_crowd() {
+        crowd_snapshot_.reset();
+        std::unordered_map<int, int32_t>().swap(snapshot_crowd_);
+    }
+
+    // A snapshot record with its crowd taken from the overlay, if there is one
+    static CafeRecord with_crowd(const CafeRecord& record, const std::unordered_map<int, int32_t>* crowd) {
+        CafeRecord result = record;
+        if (crowd) {
+            auto it = crowd->find(record.id);
+            if (it != crowd->end()) {
+                result.current_crowd = it->second;
+            }
+        }
+        return result;
+    }
+
+    // Attributes stored in a snapshot record, for cafes MySQL has no row for
+    static std::unordered_map<std::string, double> record_data(const CafeRecord& record) {
+        return {
+            {"id", record.id}, {"lon", record.lon}, {"lat", record.lat}, {"rating", record.rating},
+            {"price_level", record.price_level}, {"current_crowd", record.current_crowd}};
+    }
+
+    // stream_search_ranked, with mutex_ held; the budget ends at deadline
+    SearchStatus ranked_stream(double lon, double lat, double r_meters, double min_score,
+                               const std::unordered_map<std::string, double>& weights,
+                               const std::function<void(const CafeLoc&, const std::unordered_map<std::string, double>&)>& callback,
+                               size_t limit, const std::function<bool (const CafeLoc&)>& stop_when,
+                               const std::shared_ptr<SearchCancel>& cancel, TimePoint deadline) {
+        QueryTrace trace(*this);
+        StreamStop stop(limit, stop_when, cancel);
+        SearchStatus status;
+
+        if (std::shared_ptr<const CafeSnapshot> snapshot = current_snapshot()) {
+            // search_snapshot scores everything and sorts, which gives the same order
+            std::unordered_map<int, std::unordered_map<std::string, double>> cafeDatas;
+            trace.time(trace.fetch_ms, [&] { cafeDatas = GetAllCafeData(lon, lat, r_meters); });
+            std::vector<CafeLoc> result;
+            SearchStatus scan;
+            trace.time(trace.traversal_ms, [&] {
+                result = search_snapshot(snapshot, lon, lat, r_meters, min_score, weights, cafeDatas, interrupt_for(cancel, deadline), scan);
+            });
+            for (const CafeLoc& cafe : result) {
+                if (stop.cancelled()) break;
+                trace.callback([&] {
+                    callback(cafe, cafeDatas[cafe.id]);
+                    return true;
+                });
+                if (!stop.count(cafe)) break;
+            }
+            status = scan.partial ? scan : stop.status(min_score);
+        } else {
+            status = search_ranked_pass(lon, lat, r_meters, min_score, weights, interrupt_for(cancel, deadline), trace,
+                                        [&](const CafeRef& scored) {
+                CafeLoc cafe = cafe_at(scored);
+                std::unordered_map<std::string, double> row = trace.fetch([&] { return hit_row(scored, lon, lat); });
+                trace.callback([&] {
+                    callback(cafe, row);
+                    return true;
+                });
+                return stop.count(cafe);
+            });
+        }
+
+        trace.finish(status, stop.emitted());
+        return status;
+    }
+
+    // Best-first traversal behind stream_search_ranked and search with a limit or budget: hit gets
+    // each cafe reaching min_score, best first, with its score in weight, and returns false to end
+    // the search. Interrupted, the hits so far are the best ones and the status says how far it got.
+    SearchStatus search_ranked_pass(double lon, double lat, double r_meters, double min_score,
+                                    const std::unordered_map<std::string, double>& weights, const std::function<bool ()>& interrupt,
+                                    QueryTrace& trace, const std::function<bool (const CafeRef&)>& hit) {
+        double min[2], max[2];
+        bounding_box(lon, lat, r_meters, min, max);
+
+        // Bounds are fresh, see SearchLock
+        std::shared_ptr<const ProfileScores> scores = scores_for(weights);
+        CafeTree::NodeBoundFunc bound = score_bound(*scores, lon, lat, r_meters, scores == bound_profile_);
+
+        CafeTree::BestFirstProgress progress;
+        trace.time(trace.traversal_ms, [&] {
+            tree.SearchBestFirst(min, max, bound, [&](const CafeRef& ref) {
+                return trace.scoring([&] { return score_of(*scores, ref.index, lon, lat, r_meters); });
+            }, min_score, [&](const CafeRef& ref, double score) {
+                CafeRef scored = ref;
+                scored.weight = score;
+                return hit(scored);
+            }, interrupt, &progress, &trace.counters);
+        });
+
+        SearchStatus status;
+        status.complete_above = min_score;
+        if (progress.m_interrupted) {
+            status.partial = true;
+            status.complete_above = std::max(min_score, progress.m_boundLeft);
+            status.coverage = progress.m_leavesScanned / std::max(1.0, progress.m_leavesScanned + progress.m_leavesLeft);
+        }
+        return status;
+    }
+
+    // The traversal behind search_profiles: calls `hit` for every cafe in the query box that reaches
+    // min_score under at least one profile
+    void search_profiles_pass(double lon, double lat, double r_meters, double min_score,
+                              const std::vector<std::unordered_map<std::string, double>>& profiles,
+                              const std::function<void(const CafeLoc&, const CafeAttributes&, double, const std::vector<double>&)>& hit) {
+        if (profiles.empty()) return;
+
+        SearchLock lock(*this, READS_BOUNDS);
+        double min[2], max[2];
+        bounding_box(lon, lat, r_meters, min, max);
+
+        std::vector<ScoreProfile> score_profiles;
+        for (const auto& weights : profiles) {
+            score_profiles.emplace_back(weights);
+        }
+
+        // On entry scores[p] holds the static part under profile p; the dynamic parts are added here
+        std::vector<double> scores(profiles.size());
+        auto add_hit = [&](int id, double cafe_lon, double cafe_lat, const CafeAttributes& attributes) {
+            double distance = std::round(haversine(lat, lon, cafe_lat, cafe_lon));
+            bool reached = false;
+            for (size_t p = 0; p < scores.size(); ++p) {
+                const ScoreProfile& profile = score_profiles[p];
+                scores[p] = ScoreProfile::finish(scores[p] + profile.crowd_part(attributes.current_crowd) + profile.distance_part(distance, r_meters));
+                reached = reached || scores[p] >= min_score;
+            }
+            if (reached) {
+                CafeLoc cafe(id, cafe_lon, cafe_lat);
+                cafe.weight = scores[0];
+                hit(cafe, attributes, distance, scores);
+            }
+        };
+
+        if (std::shared_ptr<const CafeSnapshot> snapshot = current_snapshot()) {
+            // No attribute store: MySQL rows, else the attributes stored in the snapshot
+            std::unordered_map<int, std::unordered_map<std::string, double>> cafeDatas = GetAllCafeData(lon, lat, r_meters);
+            const std::unordered_map<int, int32_t>* crowd = snapshot_crowd(snapshot);
+            snapshot->Search(min, max, [&](const CafeRecord& stored) {
+                CafeRecord record = with_crowd(stored, crowd);
+                CafeAttributes attributes = {record.rating, record.price_level, record.current_crowd};
+                auto it = cafeDatas.find(record.id);
+                if (it != cafeDatas.end()) {
+                    auto field = [&it](const char* key) {
+                        auto value = it->second.find(key);
+                        return value != it->second.end() ? value->second : 0.0;
+                    };
+                    attributes = {field("rating"), static_cast<int32_t>(field("price_level")), static_cast<int32_t>(field("current_crowd"))};
+                }
+                for (size_t p = 0; p < scores.size(); ++p) {
+                    scores[p] = score_profiles[p].static_part(attributes.rating, attributes.price_level);
+                }
+                add_hit(record.id, record.lon, record.lat, attributes);
+                return true;
+            });
+            return;
+        }
+
+        std::vector<std::shared_ptr<const ProfileScores>> profile_scores;
+        std::vector<CafeTree::NodeBoundFunc> bounds;
+        for (const auto& weights : profiles) {
+            profile_scores.push_back(scores_for(weights));
+            bounds.push_back(score_bound(*profile_scores.back(), lon, lat, r_meters, profile_scores.back() == bound_profile_));
+        }
+
+        // A subtree is worth visiting if any profile may reach min_score in it
+        CafeTree::NodeBoundFunc any_bound = [&bounds](const double* min, const double* max, double stored) {
+            double best = std::numeric_limits<double>::lowest();
+            for (const auto& bound : bounds) {
+                best = std::max(best, bound(min, max, stored));
+            }
+            return best;
+        };
+
+        tree.SearchBounded(min, max, any_bound, min_score, [&](const CafeRef& ref) {
+            for (size_t p = 0; p < scores.size(); ++p) {
+                scores[p] = profile_scores[p]->static_scores[ref.index];
+            }
+            const CafeLoc& cafe = store_[ref.index];
+            add_hit(ref.id, cafe.lon, cafe.lat, attributes_[ref.index]);
+            return true;
+        });
+    }
+
+    // Search on a mapped snapshot: no node weights there, so every hit is scored and the result sorted
+    // The snapshot scan polls interrupt once per record. Interrupted, it returns the hits scored so
+    // far and marks status partial: they came in file order, not best first, so no score is known
+    // to be complete and coverage is unknown.
+    std::vector<CafeLoc> search_snapshot(const std::shared_ptr<const CafeSnapshot>& snapshot, double lon, double lat, double r_meters, double min_score,
+                                         const std::unordered_map<std::string, double>& weights,
+                                         std::unordered_map<int, std::unordered_map<std::string, double>>& cafeDatas,
+                                         const std::function<bool ()>& interrupt, SearchStatus& status) {
+        double min[2], max[2];
+        bounding_box(lon, lat, r_meters, min, max);
+
+        const std::unordered_map<int, int32_t>* crowd = snapshot_crowd(snapshot);
+        std::vector<CafeLoc> result;
+        bool interrupted = false;
+        snapshot->Search(min, max, [&](const CafeRecord& record) {
+            if (interrupt && interrupt()) {
+                interrupted = true;
+                return false;
+            }
+            auto it = cafeDatas.find(record.id);
+            if (it == cafeDatas.end()) {
+                it = cafeDatas.emplace(record.id, record_data(with_crowd(record, crowd))).first;
+            }
+
+            double distance = std::round(haversine(lat, lon, record.lat, record.lon));
+            CafeLoc cafe(record.id, record.lon, record.lat);
+            cafe.weight = GetCafeScore(it->second, distance, r_meters, weights);
+            it->second["distance"] = distance;
+            it->second["score"] = cafe.weight;
+
+            if (cafe.weight >= min_score) {
+                result.push_back(cafe);
+            }
+            return true;
+        });
+        if (interrupted) {
+            status.partial = true;
+            status.coverage = 0;
+            status.complete_above = std::numeric_limits<double>::infinity();
+        }
+
+        std::sort(result.begin(), result.end(), [](const CafeLoc& a, const CafeLoc& b) {
+            return a.weight > b.weight;
+        });
+        return result;
+    }
+
+    // search_batch scoring from cafeDatas if given, else from the attribute store
+    BatchSearchResult run_search_batch(const std::vector<BatchQuery>& queries, const std::unordered_map<std::string, double>& weights,
+                                       double min_score, const std::unordered_map<int, std::unordered_map<std::string, double>>* cafeDatas,
+                                       int num_threads, int group_size) {
+        struct Hit {
+            int id;
+            double score;
+            double distance;
+        };
+
+        // A score threshold on the attribute store may prune by the bounds, see bounded below
+        SearchLock lock(*this, !cafeDatas && min_score > 0 ? READS_BOUNDS : READS_ONLY);
+        std::shared_ptr<const CafeSnapshot> snapshot = current_snapshot();
+        const std::unordered_map<int, int32_t>* crowd = snapshot ? snapshot_crowd(snapshot) : nullptr;
+
+        // Static parts of the attribute store, only needed when scoring from it
+        std::shared_ptr<const ProfileScores> scores = cafeDatas ? make_profile_scores(weights, false) : scores_for(weights);
+        const ScoreProfile& profile = scores->profile;
+
+        // With a score threshold on the bound profile, queries skip subtrees that cannot reach min_score
+        bool bounded = !cafeDatas && !snapshot && min_score > 0 && scores == bound_profile_;
+        std::vector<CafeTree::NodeBoundFunc> query_bounds;
+        if (bounded) {
+            for (const BatchQuery& query : queries) {
+                query_bounds.push_back(score_bound(*scores, std::get<0>(query), std::get<1>(query), std::get<2>(query)));
+            }
+        }
+
+        group_size = std::max(1, std::min<int>(group_size, CafeTree::MAX_QUERY_GROUP));
+
+        std::vector<size_t> order(queries.size());
+        for (size_t q = 0; q < order.size(); ++q) {
+            order[q] = q;
+        }
+        if (group_size > 1) {
+            sort_by_z_order(queries, order);
+        }
+
+        std::vector<std::vector<Hit>> hits(queries.size());
+        std::atomic<size_t> next_group(0);
+
+        auto add_split_hit = [&](size_t q, int id, double cafe_lon, double cafe_lat, double static_part, double current_crowd) {
+            double lon = std::get<0>(queries[q]);
+            double lat = std::get<1>(queries[q]);
+            double r_meters = std::get<2>(queries[q]);
+            double distance = std::round(haversine(lat, lon, cafe_lat, cafe_lon));
+            double score = ScoreProfile::finish(static_part + profile.crowd_part(current_crowd) + profile.distance_part(distance, r_meters));
+            if (score >= min_score) {
+                hits[q].push_back({id, score, distance});
+            }
+        };
+        auto add_scored_hit = [&](size_t q, int id, double cafe_lon, double cafe_lat, double rating, double price_level, double current_crowd) {
+            add_split_hit(q, id, cafe_lon, cafe_lat, profile.static_part(rating, price_level), current_crowd);
+        };
+        auto add_hit = [&](size_t q, int id, double cafe_lon, double cafe_lat, const std::unordered_map<std::string, double>& cafeData) {
+            auto field = [&cafeData](const char* key) {
+                auto it = cafeData.find(key);
+                return it != cafeData.end() ? it->second : 0.0;
+            };
+            add_scored_hit(q, id, cafe_lon, cafe_lat, field("rating"), field("price_level"), field("current_crowd"));
+        };
+        auto add_tree_hit = [&](size_t q, const CafeRef& ref) {
+            const CafeLoc& cafe = store_[ref.index];
+            if (!cafeDatas) {
+                add_split_hit(q, ref.id, cafe.lon, cafe.lat, scores->static_scores[ref.index], attributes_[ref.index].current_crowd);
+                return;
+            }
+            auto it = cafeDatas->find(ref.id);
+            if (it != cafeDatas->end()) {
+                add_hit(q, ref.id, cafe.lon, cafe.lat, it->second);
+            }
+        };
+
+        auto worker = [&]() {
+            double mins[CafeTree::MAX_QUERY_GROUP][NUMDIMS];
+            double maxs[CafeTree::MAX_QUERY_GROUP][NUMDIMS];
+
+            for (size_t first = group_size * next_group++; first < order.size(); first = group_size * next_group++) {
+                size_t count = std::min<size_t>(group_size, order.size() - first);
+                for (size_t i = 0; i < count; ++i) {
+                    const BatchQuery& query = queries[order[first + i]];
+                    bounding_box(std::get<0>(query), std::get<1>(query), std::get<2>(query), mins[i], maxs[i]);
+                }
+
+                if (snapshot) {
+                    for (size_t i = 0; i < count; ++i) {
+                        size_t q = order[first + i];
+                        snapshot->Search(mins[i], maxs[i], [&](const CafeRecord& record) {
+                            // Attributes as of the snapshot for cafes MySQL has no row for
+                            auto it = cafeDatas->find(record.id);
+                            if (it != cafeDatas->end()) {
+                                add_hit(q, record.id, record.lon, record.lat, it->second);
+                            } else {
+                                add_scored_hit(q, record.id, record.lon, record.lat, record.rating, record.price_level, with_crowd(record, crowd).current_crowd);
+                            }
+                            return true;
+                        });
+                    }
+                } else if (count == 1 && bounded) {
+                    size_t q = order[first];
+                    tree.SearchBounded(mins[0], maxs[0], query_bounds[q], min_score, [&](const CafeRef& ref) {
+                        add_tree_hit(q, ref);
+                        return true;
+                    });
+                } else if (count == 1) {
+                    size_t q = order[first];
+                    tree.Search(mins[0], maxs[0], [&](const CafeRef& ref) {
+                        add_tree_hit(q, ref);
+                        return true;
+                    });
+                } else {
+                    std::function<double (int, const double*, const double*, double)> group_bound;
+                    if (bounded) {
+                        group_bound = [&](int i, const double* min, const double* max, double stored) {
+                            return query_bounds[order[first + i]](min, max, stored);
+                        };
+                    }
+                    tree.SearchGroup(mins, maxs, static_cast<int>(count), [&](int i, const CafeRef& ref) {
+                        add_tree_hit(order[first + i], ref);
+                        return true;
+                    }, group_bound, min_score);
+                }
+
+                for (size_t i = 0; i < count; ++i) {
+                    std::vector<Hit>& result = hits[order[first + i]];
+                    std::sort(result.begin(), result.end(), [](const Hit& a, const Hit& b) {
+                        return a.score > b.score;
+                    });
+                }
+            }
+        };
+
+        size_t num_groups = (order.size() + group_size - 1) / group_size;
+        if (num_threads <= 0) {
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        num_threads = std::min<int>(num_threads, std::max<size_t>(1, num_groups));
+
+        std::vector<std::thread> workers;
+        for (int t = 1; t < num_threads; ++t) {
+            workers.emplace_back(worker);
+        }
+        worker();
+        for (auto& w : workers) {
+            w.join();
+        }
+
+        BatchSearchResult result;
+        result.offsets.reserve(queries.size() + 1);
+        result.offsets.push_back(0);
+        for (const auto& h : hits) {
+            result.offsets.push_back(result.offsets.back() + static_cast<int>(h.size()));
+        }
+        result.ids.reserve(result.offsets.back());
+        result.scores.reserve(result.offsets.back());
+        result.distances.reserve(result.offsets.back());
+        for (const auto& h : hits) {
+            for (const Hit& hit : h) {
+                result.ids.push_back(hit.id);
+                result.scores.push_back(hit.score);
+                result.distances.push_back(hit.distance);
+            }
+        }
+        return result;
+    }
+
+    // Reorder query indices along a Z-order curve over the batch's bounding box, so that
+    // consecutive groups hold queries that touch mostly the same nodes.
+    static void sort_by_z_order(const std::vector<BatchQuery>& queries, std::vector<size_t>& order) {
+        if (queries.empty()) return;
+
+        double min_lon = std::get<0>(queries[0]), max_lon = min_lon;
+        double min_lat = std::get<1>(queries[0]), max_lat = min_lat;
+        for (const auto& query : queries) {
+            min_lon = std::min(min_lon, std::get<0>(query));
+            max_lon = std::max(max_lon, std::get<0>(query));
+            min_lat = std::min(min_lat, std::get<1>(query));
+            max_lat = std::max(max_lat, std::get<1>(query));
+        }
+
+        auto interleave = [](uint32_t v) {
+            uint64_t x = v;
+            x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+            x = (x | (x << 8)) & 0x00FF00FF00FF00FFull;
+            x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0Full;
+            x = (x | (x << 2)) & 0x3333333333333333ull;
+            x = (x | (x << 1)) & 0x5555555555555555ull;
+            return x;
+        };
+        auto quantize = [](double v, double lo, double hi) {
+            return hi > lo ? static_cast<uint32_t>((v - lo) / (hi - lo) * 65535.0) : 0u;
+        };
+
+        std::vector<uint64_t> keys(queries.size());
+        for (size_t q = 0; q < queries.size(); ++q) {
+            keys[q] = interleave(quantize(std::get<0>(queries[q]), min_lon, max_lon)) |
+                      (interleave(quantize(std::get<1>(queries[q]), min_lat, max_lat)) << 1);
+        }
+        std::sort(order.begin(), order.end(), [&keys](size_t a, size_t b) {
+            return keys[a] < keys[b];
+        });
+    }
 };
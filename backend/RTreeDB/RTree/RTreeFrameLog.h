@@ -0,0 +1,571 @@
+#ifndef RTREE_FRAME_LOG_H
+#define RTREE_FRAME_LOG_H
+
+#include <stdint.h>
+#include <string.h>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+//
+// RTreeFrameLog.h
+//
+// Frames of a run (the tree after every operation) stored as a keyframe every K frames plus, in
+// between, only what each operation changed:
+//
+//   <dir>/index.json            {"format": "rtree-frame-log", "version": 1, "keyframeInterval": K, "frames": N,
+//                                "encoding": "json" | "binary", "dims": D}
+//   <dir>/segment_<s>.jsonl     frames s*K .. s*K+K-1, one JSON object per line, or
+//   <dir>/segment_<s>.bin       the same frames in the binary encoding below
+//
+// Each frame holds its own members (operation, operationId, target, ...) and
+//
+//   "keyframe"           true on the first frame of a segment, which lists everything
+//   "root"               key of the root node
+//   "nodes"              nodes added or changed, {"key", "level", "weight", "min", "max", "children" | "dataPointIds"}
+//   "removedNodes"       keys of nodes gone since the previous frame
+//   "dataPoints"         data points added or moved, {"id", "min", "max", ...members written by the caller}
+//   "removedDataPoints"  ids of data points gone since the previous frame
+//
+// Node keys, unlike the ids LabelNodeId renumbers after every change, follow a node for as long as
+// it lives, so an insert writes its path and split nodes instead of the whole tree.  A frame is
+// rebuilt by applying the frames of its segment up to it; node ids, child ids and the order of
+// nodes and data points follow from a breadth-first walk from the root, as in GetTreeStructure.
+//
+// The binary encoding stores each frame as a varint byte count followed by
+//
+//   members    varint length, then the members as JSON text
+//   flags      one byte, bit 0 = keyframe
+//   root       varint key + 1 (0: no root)
+//   nodes      varint count, then per node: varint key, varint level, float32 weight,
+//              float32 min[D], float32 max[D], varint entries, then per entry a varint child key
+//              (internal nodes) or a zigzag varint data point id (leaves)
+//   removed    varint count, varint keys
+//   points     varint count, then per point: zigzag varint id, float32 min[D], float32 max[D],
+//              varint length, then the caller's members as JSON text
+//   removed    varint count, zigzag varint ids
+//
+// Varints are unsigned LEB128 and floats little-endian.
+//
+// Append() only copies the tree (RTree::Snapshot) on the caller's thread, or, given a committed
+// version (RTree::CommitVersion), only queues it and leaves the copy to the writer too.  Comparing
+// with the previous frame, encoding and writing happen on a writer thread, fed by a queue of at most
+// a_queueLimit frames; Append() waits while the queue is full.  Snapshots are recycled, so a steady
+// run allocates nothing per frame.
+//
+
+/// \class RTreeFrameLog
+/// TREE RTree type frames are taken of.  Append from one thread at a time.
+template<class TREE>
+class RTreeFrameLog
+{
+public:
+
+  typedef typename TREE::FrameSnapshot Snapshot;
+  typedef typename TREE::FrameNode FrameNode;
+  typedef typename TREE::FrameEntry FrameEntry;
+  typedef typename TREE::Version Version;
+  typedef decltype(FrameEntry::m_data) Data;
+
+  enum Encoding
+  {
+    JSON,
+    BINARY,
+  };
+
+  enum
+  {
+    VERSION = 1,
+    DIMS = std::extent<decltype(FrameNode::m_min)>::value,
+    DEFAULT_KEYFRAME_INTERVAL = 100,
+    DEFAULT_QUEUE_LIMIT = 16,
+  };
+
+  /// \param a_idOf Id of a data point, unique within a frame
+  /// \param a_writeData Writes a data point's own JSON members, without a leading comma.  Only called when the
+  ///        point first appears or moves; its members must not change otherwise.
+  RTreeFrameLog(std::function<int (const Data&)> a_idOf, std::function<void (std::ostream&, const Data&)> a_writeData)
+    : m_idOf(a_idOf), m_writeData(a_writeData), m_keyframeInterval(DEFAULT_KEYFRAME_INTERVAL), m_encoding(JSON),
+      m_queueLimit(DEFAULT_QUEUE_LIMIT), m_frames(0), m_written(0), m_stopping(false), m_failed(false), m_nextKey(0) {}
+  ~RTreeFrameLog()                                { Close(); }
+
+  RTreeFrameLog(const RTreeFrameLog&) = delete;
+  RTreeFrameLog& operator=(const RTreeFrameLog&) = delete;
+
+  /// Start a log in a_dir, which must exist.  Segments already there are overwritten as frames reach them.
+  bool Open(const std::string& a_dir, int a_keyframeInterval = DEFAULT_KEYFRAME_INTERVAL, Encoding a_encoding = JSON,
+            size_t a_queueLimit = DEFAULT_QUEUE_LIMIT)
+  {
+    Close();
+    m_dir = a_dir;
+    m_keyframeInterval = a_keyframeInterval > 0 ? a_keyframeInterval : (int)DEFAULT_KEYFRAME_INTERVAL;
+    m_encoding = a_encoding;
+    m_queueLimit = a_queueLimit > 0 ? a_queueLimit : 1;
+    m_frames = 0;
+    m_written = 0;
+    m_stopping = false;
+    m_failed = !WriteIndex();
+    m_writer = std::thread(&RTreeFrameLog::Run, this);
+    return !m_failed;
+  }
+
+  /// Write out the queued frames, then record the frame count in index.json
+  /// \return Returns false if any frame failed to write
+  bool Close()
+  {
+    if (m_dir.empty()) {
+      return true;
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+    }
+    m_wake.notify_one();
+    m_writer.join();
+
+    m_segment.close();
+    bool written = WriteIndex() && !m_failed;
+    m_dir.clear();
+    m_previous = Snapshot();
+    m_previousKeys.clear();
+    m_previousIndex.clear();
+    m_pool.clear();
+    return written;
+  }
+
+  bool IsOpen() const                             { return !m_dir.empty(); }
+  int Frames() const                              { return m_frames; }
+
+  /// Queue the tree as the next frame
+  /// \param a_members The frame's own JSON members, without braces, on one line, e.g. "\"operation\": \"insert\", \"operationId\": 3"
+  /// \return Returns false if the log is closed or an earlier frame failed to write
+  bool Append(const TREE& a_tree, const std::string& a_members)
+  {
+    if (m_dir.empty()) {
+      return false;
+    }
+
+    Job job;
+    job.m_members = a_members;
+    Reserve(job);
+    a_tree.Snapshot(job.m_snapshot);
+    return Queue(job);
+  }
+
+  /// Queue a committed version as the next frame.  It is copied on the writer thread, so the tree
+  /// may change meanwhile.
+  bool Append(const Version& a_version, const std::string& a_members)
+  {
+    if (m_dir.empty()) {
+      return false;
+    }
+
+    Job job;
+    job.m_version = a_version;
+    job.m_members = a_members;
+    Reserve(job);
+    return Queue(job);
+  }
+
+protected:
+
+  struct Job
+  {
+    Snapshot m_snapshot;
+    Version m_version;                            ///< To copy into m_snapshot first, if set
+    std::string m_members;
+  };
+
+  /// Wait for room in the queue, and hand a_job a recycled snapshot
+  void Reserve(Job& a_job)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_space.wait(lock, [this] { return m_queue.size() < m_queueLimit; });
+    if (!m_pool.empty()) {
+      a_job.m_snapshot = std::move(m_pool.back());
+      m_pool.pop_back();
+    }
+  }
+
+  bool Queue(Job& a_job)
+  {
+    bool failed;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_queue.push_back(std::move(a_job));
+      failed = m_failed;
+    }
+    m_wake.notify_one();
+    ++m_frames;
+    return !failed;
+  }
+
+  /// What one frame writes
+  struct Changes
+  {
+    std::vector<int> m_keys;                      ///< Per node of the snapshot
+    std::vector<int> m_nodes;                     ///< Indices of added or changed nodes
+    std::vector<int> m_removedNodes;              ///< Keys
+    std::vector<const FrameEntry*> m_dataPoints;  ///< Added or moved
+    std::vector<int> m_removedDataPoints;         ///< Ids
+  };
+
+  void Run()
+  {
+    for (;;) {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wake.wait(lock, [this] { return !m_queue.empty() || m_stopping; });
+        if (m_queue.empty()) {
+          return;
+        }
+        job = std::move(m_queue.front());
+        m_queue.pop_front();
+      }
+      m_space.notify_one();
+
+      if (job.m_version) {
+        TREE::Snapshot(job.m_snapshot, job.m_version);
+        job.m_version.reset();
+      }
+      bool written = Write(job);
+
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_failed = m_failed || !written;
+      if (m_pool.size() < m_queueLimit + 1) {
+        m_pool.push_back(std::move(job.m_snapshot));
+      }
+    }
+  }
+
+  /// Compare with the previous frame and write the differences.  Leaves job.m_snapshot holding
+  /// the frame before, for recycling.
+  bool Write(Job& a_job)
+  {
+    const bool keyframe = m_written % m_keyframeInterval == 0;
+    if (keyframe) {
+      m_segment.close();
+      m_segment.open(m_dir + "/segment_" + std::to_string(m_written / m_keyframeInterval) + (m_encoding == BINARY ? ".bin" : ".jsonl"),
+                     std::ios::trunc | std::ios::binary);
+      m_previous.m_nodes.clear();
+      m_previous.m_entries.clear();
+      m_previousKeys.clear();
+      m_previousIndex.clear();
+    }
+    ++m_written;
+
+    const Snapshot& current = a_job.m_snapshot;
+    Diff(current, m_changes);
+
+    m_buffer.clear();
+    if (m_encoding == BINARY) {
+      EncodeBinary(a_job.m_members, keyframe, current, m_changes);
+    } else {
+      EncodeJson(a_job.m_members, keyframe, current, m_changes);
+    }
+    m_segment.write(m_buffer.data(), m_buffer.size());
+
+    // The frame becomes the one to compare the next with
+    m_previousIndex.clear();
+    for (size_t index = 0; index < current.m_nodes.size(); ++index) {
+      m_previousIndex[current.m_nodes[index].m_node] = (int)index;
+    }
+    m_previousKeys.swap(m_changes.m_keys);
+    std::swap(m_previous, a_job.m_snapshot);
+    return m_segment.good();
+  }
+
+  void Diff(const Snapshot& a_current, Changes& a_changes)
+  {
+    a_changes.m_keys.assign(a_current.m_nodes.size(), -1);
+    a_changes.m_nodes.clear();
+    a_changes.m_removedNodes.clear();
+    a_changes.m_dataPoints.clear();
+    a_changes.m_removedDataPoints.clear();
+
+    // Data points can only appear, move or go in leaves that changed, so only those are compared
+    m_seen.assign(m_previous.m_nodes.size(), 0);
+    m_oldPoints.clear();
+    for (size_t index = 0; index < a_current.m_nodes.size(); ++index) {
+      const FrameNode& node = a_current.m_nodes[index];
+      auto found = m_previousIndex.find(node.m_node);
+      if (found != m_previousIndex.end()) {
+        m_seen[found->second] = 1;
+        a_changes.m_keys[index] = m_previousKeys[found->second];
+        if (SameNode(a_current, node, m_previous.m_nodes[found->second])) {
+          continue;
+        }
+        CollectPoints(m_previous.m_nodes[found->second]);
+      } else {
+        a_changes.m_keys[index] = m_nextKey++;
+      }
+      a_changes.m_nodes.push_back((int)index);
+    }
+    for (size_t index = 0; index < m_previous.m_nodes.size(); ++index) {
+      if (!m_seen[index]) {
+        a_changes.m_removedNodes.push_back(m_previousKeys[index]);
+        CollectPoints(m_previous.m_nodes[index]);
+      }
+    }
+
+    for (int index : a_changes.m_nodes) {
+      const FrameNode& node = a_current.m_nodes[index];
+      if (node.m_level != 0) {
+        continue;
+      }
+      for (int entry = node.m_first; entry < node.m_first + node.m_count; ++entry) {
+        const FrameEntry& point = a_current.m_entries[entry];
+        auto old = m_oldPoints.find(m_idOf(point.m_data));
+        bool moved = old == m_oldPoints.end() || !SameRect(point, *old->second);
+        if (old != m_oldPoints.end()) {
+          m_oldPoints.erase(old);
+        }
+        if (moved) {
+          a_changes.m_dataPoints.push_back(&point);
+        }
+      }
+    }
+    for (const auto& old : m_oldPoints) {
+      a_changes.m_removedDataPoints.push_back(old.first);
+    }
+  }
+
+  void CollectPoints(const FrameNode& a_node)
+  {
+    if (a_node.m_level != 0) {
+      return;
+    }
+    for (int entry = a_node.m_first; entry < a_node.m_first + a_node.m_count; ++entry) {
+      const FrameEntry& point = m_previous.m_entries[entry];
+      m_oldPoints[m_idOf(point.m_data)] = &point;
+    }
+  }
+
+  template<class RECT_A, class RECT_B>
+  static bool SameRect(const RECT_A& a_rectA, const RECT_B& a_rectB)
+  {
+    for (int axis = 0; axis < DIMS; ++axis) {
+      if (a_rectA.m_min[axis] != a_rectB.m_min[axis] || a_rectA.m_max[axis] != a_rectB.m_max[axis]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool SameNode(const Snapshot& a_current, const FrameNode& a_node, const FrameNode& a_old) const
+  {
+    if (a_node.m_level != a_old.m_level || a_node.m_weight != a_old.m_weight || a_node.m_count != a_old.m_count || !SameRect(a_node, a_old)) {
+      return false;
+    }
+    for (int index = 0; index < a_node.m_count; ++index) {
+      const FrameEntry& entry = a_current.m_entries[a_node.m_first + index];
+      const FrameEntry& old = m_previous.m_entries[a_old.m_first + index];
+      if (!SameRect(entry, old)) {
+        return false;
+      }
+      if (a_node.m_level == 0 ? !(entry.m_data == old.m_data)
+                              : a_current.m_nodes[entry.m_child].m_node != m_previous.m_nodes[old.m_child].m_node) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  template<class RECT>
+  static void WriteJsonRect(std::ostream& a_out, const RECT& a_rect)
+  {
+    a_out << ", \"min\": [";
+    for (int axis = 0; axis < DIMS; ++axis) {
+      a_out << (axis ? ", " : "") << a_rect.m_min[axis];
+    }
+    a_out << "], \"max\": [";
+    for (int axis = 0; axis < DIMS; ++axis) {
+      a_out << (axis ? ", " : "") << a_rect.m_max[axis];
+    }
+    a_out << "]";
+  }
+
+  void EncodeJson(const std::string& a_members, bool a_keyframe, const Snapshot& a_current, const Changes& a_changes)
+  {
+    std::ostringstream line;
+    line << "{" << a_members << (a_members.empty() ? "" : ", ")
+         << "\"keyframe\": " << (a_keyframe ? "true" : "false")
+         << ", \"root\": " << (a_current.m_nodes.empty() ? -1 : a_changes.m_keys[0]);
+
+    line << ", \"nodes\": [";
+    for (size_t changed = 0; changed < a_changes.m_nodes.size(); ++changed) {
+      const FrameNode& node = a_current.m_nodes[a_changes.m_nodes[changed]];
+      line << (changed ? ", " : "") << "{\"key\": " << a_changes.m_keys[a_changes.m_nodes[changed]]
+           << ", \"level\": " << node.m_level << ", \"weight\": " << node.m_weight;
+      WriteJsonRect(line, node);
+      line << (node.m_level == 0 ? ", \"dataPointIds\": [" : ", \"children\": [");
+      for (int index = 0; index < node.m_count; ++index) {
+        const FrameEntry& entry = a_current.m_entries[node.m_first + index];
+        line << (index ? ", " : "") << (node.m_level == 0 ? m_idOf(entry.m_data) : a_changes.m_keys[entry.m_child]);
+      }
+      line << "]}";
+    }
+
+    line << "], \"removedNodes\": [";
+    for (size_t index = 0; index < a_changes.m_removedNodes.size(); ++index) {
+      line << (index ? ", " : "") << a_changes.m_removedNodes[index];
+    }
+
+    line << "], \"dataPoints\": [";
+    for (size_t index = 0; index < a_changes.m_dataPoints.size(); ++index) {
+      const FrameEntry& point = *a_changes.m_dataPoints[index];
+      line << (index ? ", " : "") << "{\"id\": " << m_idOf(point.m_data);
+      WriteJsonRect(line, point);
+      line << ", ";
+      m_writeData(line, point.m_data);
+      line << "}";
+    }
+
+    line << "], \"removedDataPoints\": [";
+    for (size_t index = 0; index < a_changes.m_removedDataPoints.size(); ++index) {
+      line << (index ? ", " : "") << a_changes.m_removedDataPoints[index];
+    }
+    line << "]}\n";
+    m_buffer = line.str();
+  }
+
+  void PutVarint(std::string& a_out, uint64_t a_value)
+  {
+    while (a_value >= 0x80) {
+      a_out.push_back((char)(a_value | 0x80));
+      a_value >>= 7;
+    }
+    a_out.push_back((char)a_value);
+  }
+
+  void PutZigzag(std::string& a_out, int64_t a_value)
+  {
+    PutVarint(a_out, ((uint64_t)a_value << 1) ^ (uint64_t)(a_value >> 63));
+  }
+
+  void PutFloat(std::string& a_out, double a_value)
+  {
+    float value = (float)a_value;
+    char bytes[sizeof(float)];
+    memcpy(bytes, &value, sizeof(float));
+    a_out.append(bytes, sizeof(float));
+  }
+
+  void PutText(std::string& a_out, const std::string& a_text)
+  {
+    PutVarint(a_out, a_text.size());
+    a_out += a_text;
+  }
+
+  template<class RECT>
+  void PutRect(std::string& a_out, const RECT& a_rect)
+  {
+    for (int axis = 0; axis < DIMS; ++axis) {
+      PutFloat(a_out, a_rect.m_min[axis]);
+    }
+    for (int axis = 0; axis < DIMS; ++axis) {
+      PutFloat(a_out, a_rect.m_max[axis]);
+    }
+  }
+
+  void EncodeBinary(const std::string& a_members, bool a_keyframe, const Snapshot& a_current, const Changes& a_changes)
+  {
+    std::string& frame = m_frame;
+    frame.clear();
+    PutText(frame, a_members);
+    frame.push_back(a_keyframe ? 1 : 0);
+    PutVarint(frame, a_current.m_nodes.empty() ? 0 : (uint64_t)a_changes.m_keys[0] + 1);
+
+    PutVarint(frame, a_changes.m_nodes.size());
+    for (int changed : a_changes.m_nodes) {
+      const FrameNode& node = a_current.m_nodes[changed];
+      PutVarint(frame, a_changes.m_keys[changed]);
+      PutVarint(frame, node.m_level);
+      PutFloat(frame, node.m_weight);
+      PutRect(frame, node);
+      PutVarint(frame, node.m_count);
+      for (int index = 0; index < node.m_count; ++index) {
+        const FrameEntry& entry = a_current.m_entries[node.m_first + index];
+        if (node.m_level == 0) {
+          PutZigzag(frame, m_idOf(entry.m_data));
+        } else {
+          PutVarint(frame, a_changes.m_keys[entry.m_child]);
+        }
+      }
+    }
+
+    PutVarint(frame, a_changes.m_removedNodes.size());
+    for (int key : a_changes.m_removedNodes) {
+      PutVarint(frame, key);
+    }
+
+    PutVarint(frame, a_changes.m_dataPoints.size());
+    for (const FrameEntry* point : a_changes.m_dataPoints) {
+      PutZigzag(frame, m_idOf(point->m_data));
+      PutRect(frame, *point);
+      m_members.str("");
+      m_writeData(m_members, point->m_data);
+      PutText(frame, m_members.str());
+    }
+
+    PutVarint(frame, a_changes.m_removedDataPoints.size());
+    for (int id : a_changes.m_removedDataPoints) {
+      PutZigzag(frame, id);
+    }
+
+    PutVarint(m_buffer, frame.size());
+    m_buffer += frame;
+  }
+
+  bool WriteIndex()
+  {
+    std::ofstream index(m_dir + "/index.json", std::ios::trunc);
+    index << "{\"format\": \"rtree-frame-log\", \"version\": " << (int)VERSION << ", \"keyframeInterval\": " << m_keyframeInterval
+          << ", \"frames\": " << m_frames << ", \"encoding\": \"" << (m_encoding == BINARY ? "binary" : "json") << "\""
+          << ", \"dims\": " << (int)DIMS << "}\n";
+    return index.good();
+  }
+
+  std::function<int (const Data&)> m_idOf;
+  std::function<void (std::ostream&, const Data&)> m_writeData;
+  std::string m_dir;
+  int m_keyframeInterval;
+  Encoding m_encoding;
+  size_t m_queueLimit;
+  int m_frames;                                   ///< Appended
+  int m_written;                                  ///< Taken by the writer
+
+  // Appender and writer
+  std::mutex m_mutex;
+  std::condition_variable m_wake;                 ///< Writer: a frame was queued, or Close()
+  std::condition_variable m_space;                ///< Appender: the queue has room
+  std::deque<Job> m_queue;
+  std::vector<Snapshot> m_pool;                   ///< Snapshots to reuse
+  bool m_stopping;
+  bool m_failed;
+  std::thread m_writer;
+
+  // Writer only
+  std::ofstream m_segment;
+  Snapshot m_previous;                            ///< Last frame written
+  std::vector<int> m_previousKeys;                ///< Per node of m_previous
+  std::unordered_map<const void*, int> m_previousIndex; ///< Node to its index in m_previous
+  int m_nextKey;
+  Changes m_changes;
+  std::vector<char> m_seen;
+  std::unordered_map<int, const FrameEntry*> m_oldPoints; ///< Data points of the previous frame's changed and removed leaves
+  std::string m_buffer;
+  std::string m_frame;
+  std::ostringstream m_members;
+};
+
+#endif //RTREE_FRAME_LOG_H
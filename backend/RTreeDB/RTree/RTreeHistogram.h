@@ -0,0 +1,117 @@
+#ifndef RTREE_HISTOGRAM_H
+#define RTREE_HISTOGRAM_H
+
+#include <stdint.h>
+#include <math.h>
+#include <atomic>
+
+//
+// RTreeHistogram.h
+//
+// Lock-free latency histogram with log-linear buckets: every power of two of microseconds is split
+// into SUB_BUCKETS equal parts, so a percentile is within 1/SUB_BUCKETS of the true value.
+// Record() is one relaxed atomic increment and may be called from any thread.
+//
+
+/// \class RTreeLatencyHistogram
+class RTreeLatencyHistogram
+{
+public:
+
+  enum
+  {
+    SUB_BUCKETS = 8,
+    OCTAVES = 40,                                 ///< 1 us up to 2^40 us, about 12 days
+    BUCKETS = 1 + OCTAVES * SUB_BUCKETS,          ///< Bucket 0 holds everything below 1 us
+  };
+
+  RTreeLatencyHistogram()                         { Reset(); }
+
+  RTreeLatencyHistogram(const RTreeLatencyHistogram&) = delete;
+  RTreeLatencyHistogram& operator=(const RTreeLatencyHistogram&) = delete;
+
+  void Record(double a_micros)
+  {
+    m_counts[Bucket(a_micros)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  uint64_t Count() const
+  {
+    uint64_t total = 0;
+    for(int bucket = 0; bucket < BUCKETS; ++bucket)
+    {
+      total += m_counts[bucket].load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  /// Upper end of the bucket holding the a_quantile (0..1) of the recorded values, in us; 0 if empty
+  double Percentile(double a_quantile) const
+  {
+    uint64_t counts[BUCKETS];
+    uint64_t total = 0;
+    for(int bucket = 0; bucket < BUCKETS; ++bucket)
+    {
+      counts[bucket] = m_counts[bucket].load(std::memory_order_relaxed);
+      total += counts[bucket];
+    }
+    if(total == 0)
+    {
+      return 0;
+    }
+
+    uint64_t rank = (uint64_t)ceil(a_quantile * total);
+    uint64_t seen = 0;
+    for(int bucket = 0; bucket < BUCKETS; ++bucket)
+    {
+      seen += counts[bucket];
+      if(seen >= rank && seen > 0)
+      {
+        return UpperBound(bucket);
+      }
+    }
+    return UpperBound(BUCKETS - 1);
+  }
+
+  void Reset()
+  {
+    for(int bucket = 0; bucket < BUCKETS; ++bucket)
+    {
+      m_counts[bucket].store(0, std::memory_order_relaxed);
+    }
+  }
+
+protected:
+
+  static int Bucket(double a_micros)
+  {
+    if(!(a_micros >= 1.0))
+    {
+      return 0;
+    }
+    int exponent;
+    double mantissa = frexp(a_micros, &exponent); // a_micros = mantissa * 2^exponent, mantissa in [0.5, 1)
+    int octave = exponent - 1;
+    if(octave >= OCTAVES)
+    {
+      return BUCKETS - 1;
+    }
+    int sub = (int)((mantissa * 2.0 - 1.0) * SUB_BUCKETS);
+    return 1 + octave * SUB_BUCKETS + sub;
+  }
+
+  static double UpperBound(int a_bucket)
+  {
+    if(a_bucket == 0)
+    {
+      return 1.0;
+    }
+    int octave = (a_bucket - 1) / SUB_BUCKETS;
+    int sub = (a_bucket - 1) % SUB_BUCKETS;
+    return ldexp(1.0 + (sub + 1.0) / SUB_BUCKETS, octave);
+  }
+
+  std::atomic<uint64_t> m_counts[BUCKETS];
+};
+
+#endif //RTREE_HISTOGRAM_H
@@ -0,0 +1,204 @@
+#ifndef RTREE_RESULT_CACHE_H
+#define RTREE_RESULT_CACHE_H
+
+#include <stdint.h>
+#include <math.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+//
+// RTreeResultCache.h
+//
+// Bounded LRU cache of query results.  A query is keyed by its point and radius snapped to a grid
+// plus a caller-computed hash of everything else that changes the answer (weights, filters).
+// Every entry is tagged with the epoch of the data it was computed from; a lookup under a newer
+// epoch treats the entry as stale and drops it, so writers only have to bump their epoch.
+//
+
+/// \class RTreeResultCache
+/// VALUE Cached result; handed out as shared_ptr<const VALUE> so hits are not copied under the lock
+template<class VALUE>
+class RTreeResultCache
+{
+public:
+
+  struct Key
+  {
+    int64_t m_lon;                                ///< Query point in grid steps
+    int64_t m_lat;
+    int64_t m_radius;                             ///< Radius in radius steps
+    uint64_t m_profile;                           ///< Hash of weights and other parameters
+
+    bool operator==(const Key& a_other) const
+    {
+      return m_lon == a_other.m_lon && m_lat == a_other.m_lat && m_radius == a_other.m_radius && m_profile == a_other.m_profile;
+    }
+  };
+
+  struct Stats
+  {
+    uint64_t m_hits;
+    uint64_t m_misses;                            ///< Including stale entries
+    uint64_t m_stale;                             ///< Found, but computed under an older epoch
+    uint64_t m_evictions;                         ///< Dropped to stay within the bounds
+    uint64_t m_entries;
+    uint64_t m_cost;                              ///< Sum of entry costs
+  };
+
+  /// \param a_maxEntries Entry count bound, 0 disables the cache
+  /// \param a_maxCost Bound on the sum of entry costs (e.g. number of hits cached), 0 for none
+  /// \param a_coordStep Grid step of the query point; queries in one cell share an entry
+  /// \param a_radiusStep Grid step of the radius
+  RTreeResultCache(size_t a_maxEntries = 256, size_t a_maxCost = 0, double a_coordStep = 1e-5, double a_radiusStep = 1.0)
+  {
+    Configure(a_maxEntries, a_maxCost, a_coordStep, a_radiusStep);
+  }
+
+  RTreeResultCache(const RTreeResultCache&) = delete;
+  RTreeResultCache& operator=(const RTreeResultCache&) = delete;
+
+  /// Change the bounds and grid.  Drops every entry.
+  void Configure(size_t a_maxEntries, size_t a_maxCost, double a_coordStep, double a_radiusStep)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_maxEntries = a_maxEntries;
+    m_maxCost = a_maxCost;
+    m_coordStep = a_coordStep > 0 ? a_coordStep : 1e-5;
+    m_radiusStep = a_radiusStep > 0 ? a_radiusStep : 1.0;
+    ClearLocked();
+  }
+
+  bool IsEnabled() const                          { std::lock_guard<std::mutex> lock(m_mutex); return m_maxEntries > 0; }
+
+  Key MakeKey(double a_lon, double a_lat, double a_radius, uint64_t a_profile) const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Key key = {Quantize(a_lon, m_coordStep), Quantize(a_lat, m_coordStep), Quantize(a_radius, m_radiusStep), a_profile};
+    return key;
+  }
+
+  /// The entry for a_key if it was computed under a_epoch, else NULL
+  std::shared_ptr<const VALUE> Find(const Key& a_key, uint64_t a_epoch)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_index.find(a_key);
+    if (it == m_index.end()) {
+      ++m_stats.m_misses;
+      return std::shared_ptr<const VALUE>();
+    }
+    if (it->second->m_epoch != a_epoch) {
+      ++m_stats.m_misses;
+      ++m_stats.m_stale;
+      EraseLocked(it);
+      return std::shared_ptr<const VALUE>();
+    }
+
+    m_lru.splice(m_lru.begin(), m_lru, it->second);
+    ++m_stats.m_hits;
+    return it->second->m_value;
+  }
+
+  /// Insert or replace the entry for a_key, evicting least recently used entries to stay in bounds
+  void Store(const Key& a_key, uint64_t a_epoch, std::shared_ptr<const VALUE> a_value, size_t a_cost)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_maxEntries == 0 || (m_maxCost > 0 && a_cost > m_maxCost)) {
+      return;
+    }
+
+    auto it = m_index.find(a_key);
+    if (it != m_index.end()) {
+      EraseLocked(it);
+    }
+
+    Entry entry = {a_key, a_epoch, a_cost, std::move(a_value)};
+    m_lru.push_front(std::move(entry));
+    m_index[a_key] = m_lru.begin();
+    m_stats.m_cost += a_cost;
+
+    while (m_lru.size() > m_maxEntries || (m_maxCost > 0 && m_stats.m_cost > m_maxCost)) {
+      EraseLocked(m_index.find(m_lru.back().m_key));
+      ++m_stats.m_evictions;
+    }
+  }
+
+  void Clear()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ClearLocked();
+  }
+
+  Stats GetStats()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Stats stats = m_stats;
+    stats.m_entries = m_lru.size();
+    return stats;
+  }
+
+  void ResetStats()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint64_t cost = m_stats.m_cost;
+    m_stats = Stats();
+    m_stats.m_cost = cost;
+  }
+
+protected:
+
+  struct Entry
+  {
+    Key m_key;
+    uint64_t m_epoch;
+    size_t m_cost;
+    std::shared_ptr<const VALUE> m_value;
+  };
+
+  struct KeyHash
+  {
+    size_t operator()(const Key& a_key) const
+    {
+      uint64_t hash = a_key.m_profile;
+      hash = (hash ^ (uint64_t)a_key.m_lon) * 1099511628211ull;
+      hash = (hash ^ (uint64_t)a_key.m_lat) * 1099511628211ull;
+      hash = (hash ^ (uint64_t)a_key.m_radius) * 1099511628211ull;
+      return (size_t)(hash ^ (hash >> 32));
+    }
+  };
+
+  typedef std::list<Entry> EntryList;
+  typedef std::unordered_map<Key, typename EntryList::iterator, KeyHash> EntryIndex;
+
+  static int64_t Quantize(double a_value, double a_step)
+  {
+    return (int64_t)llround(a_value / a_step);
+  }
+
+  void EraseLocked(typename EntryIndex::iterator a_it)
+  {
+    m_stats.m_cost -= a_it->second->m_cost;
+    m_lru.erase(a_it->second);
+    m_index.erase(a_it);
+  }
+
+  void ClearLocked()
+  {
+    m_lru.clear();
+    m_index.clear();
+    m_stats.m_cost = 0;
+  }
+
+  mutable std::mutex m_mutex;                     ///< Guards everything below, also against Configure while others search
+  EntryList m_lru;                                ///< Most recently used first
+  EntryIndex m_index;
+  Stats m_stats = Stats();
+  size_t m_maxEntries;
+  size_t m_maxCost;
+  double m_coordStep;
+  double m_radiusStep;
+};
+
+#endif //RTREE_RESULT_CACHE_H
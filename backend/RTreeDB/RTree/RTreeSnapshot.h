@@ -0,0 +1,468 @@
+#ifndef RTREE_SNAPSHOT_H
+#define RTREE_SNAPSHOT_H
+
+#include "RTree.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <type_traits>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//
+// RTreeSnapshot.h
+//
+// A frozen copy of an RTree in a single position-independent file:
+//
+//   [ header | pad ][ node pages ... ][ records ... ]
+//
+// Nodes are fixed-size, cache-line aligned and stored breadth first, root first.  A branch refers
+// to its child by node index (internal nodes) or to its record by record index (leaves), so the
+// file holds no pointers and can be mmap'ed read-only at any address and searched in place.
+// Records are user-defined POD structs written inline, one per data element, in leaf order.
+//
+
+/// \class RTreeSnapshot
+/// Read-only, memory-mapped R-tree.
+/// RECORD Trivially copyable struct stored per data element
+/// ELEMTYPE, NUMDIMS, MAXNODES Must match the tree the snapshot is written from
+template<class RECORD, class ELEMTYPE, int NUMDIMS, int MAXNODES>
+class RTreeSnapshot
+{
+  static_assert(std::is_trivially_copyable<RECORD>::value, "'RECORD' is written to disk as raw bytes");
+  static_assert(std::is_trivially_copyable<ELEMTYPE>::value, "'ELEMTYPE' is written to disk as raw bytes");
+
+public:
+
+  enum
+  {
+    VERSION = 2,
+    PAGE_ALIGN = 64,                              ///< Alignment of sections and node pages
+  };
+
+  struct Header
+  {
+    char m_magic[8];                              ///< "RTSNAP\0\0"
+    uint32_t m_version;
+    uint32_t m_numDims;
+    uint32_t m_maxNodes;
+    uint32_t m_elemSize;
+    uint32_t m_recordSize;
+    uint32_t m_nodeSize;
+    uint64_t m_nodeCount;
+    uint64_t m_recordCount;
+    uint64_t m_nodesOffset;                       ///< From start of file
+    uint64_t m_recordsOffset;                     ///< From start of file
+    uint64_t m_fileSize;
+    uint64_t m_tag;                               ///< Caller-defined, e.g. the last log entry the snapshot includes
+  };
+
+  struct alignas(PAGE_ALIGN) Node
+  {
+    bool IsInternalNode() const                   { return (m_level > 0); }
+    bool IsLeaf() const                           { return (m_level == 0); }
+
+    int32_t m_level;                              ///< Leaf is zero, others positive
+    int32_t m_count;                              ///< Branches in use
+    ELEMTYPE m_min[MAXNODES][NUMDIMS];            ///< Branch bounds
+    ELEMTYPE m_max[MAXNODES][NUMDIMS];
+    uint32_t m_ref[MAXNODES];                     ///< Child node index, or record index in leaves
+  };
+
+  RTreeSnapshot() : m_base(NULL), m_size(0) {}
+  ~RTreeSnapshot()                                { Close(); }
+
+  RTreeSnapshot(const RTreeSnapshot&) = delete;
+  RTreeSnapshot& operator=(const RTreeSnapshot&) = delete;
+
+  /// Write a snapshot of a_tree.  The file is written next to a_fileName and renamed into place,
+  /// so readers never see a half-written snapshot.
+  /// \param a_record Converts a data element of the tree into its RECORD
+  /// \param a_tag Stored in the header as is
+  template<class TREE, class RECORDFUNC>
+  static bool Write(const char* a_fileName, const TREE& a_tree, RECORDFUNC a_record, uint64_t a_tag = 0);
+
+  /// Map a snapshot file read-only.  Fails if the file is missing, truncated, was written
+  /// with a different layout or holds a node whose branches point outside the file.
+  bool Open(const char* a_fileName);
+
+  /// Unmap the current snapshot, if any
+  void Close();
+
+  bool IsOpen() const                             { return m_base != NULL; }
+
+  /// Number of records
+  size_t Count() const                            { return IsOpen() ? (size_t)GetHeader().m_recordCount : 0; }
+
+  /// Find all records whose rect overlaps the search rectangle.  Read-only, safe from several threads.
+  /// \param a_resultCallback Callback should return 'true' to continue searching
+  /// \return Returns the number of entries found
+  int Search(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], std::function<bool (const RECORD&)> a_callback) const;
+
+  /// Visit every record with its rect, in leaf order
+  void ForEach(std::function<void (const ELEMTYPE*, const ELEMTYPE*, const RECORD&)> a_callback) const;
+
+  const Header& GetHeader() const                 { return *reinterpret_cast<const Header*>(m_base); }
+
+protected:
+
+  static uint64_t AlignUp(uint64_t a_offset)      { return (a_offset + PAGE_ALIGN - 1) / PAGE_ALIGN * PAGE_ALIGN; }
+  static void InitHeader(Header* a_header);
+  bool ValidNodes() const;
+
+  const Node* GetNodes() const                    { return reinterpret_cast<const Node*>(m_base + GetHeader().m_nodesOffset); }
+  const RECORD* GetRecords() const                { return reinterpret_cast<const RECORD*>(m_base + GetHeader().m_recordsOffset); }
+
+  const char* m_base;                             ///< Start of the mapping
+  size_t m_size;                                  ///< Length of the mapping
+};
+
+
+#define RTREE_SNAPSHOT_TEMPLATE template<class RECORD, class ELEMTYPE, int NUMDIMS, int MAXNODES>
+#define RTREE_SNAPSHOT_QUAL RTreeSnapshot<RECORD, ELEMTYPE, NUMDIMS, MAXNODES>
+
+
+RTREE_SNAPSHOT_TEMPLATE
+void RTREE_SNAPSHOT_QUAL::InitHeader(Header* a_header)
+{
+  memset(a_header, 0, sizeof(Header));
+  memcpy(a_header->m_magic, "RTSNAP", 6);
+  a_header->m_version = VERSION;
+  a_header->m_numDims = NUMDIMS;
+  a_header->m_maxNodes = MAXNODES;
+  a_header->m_elemSize = sizeof(ELEMTYPE);
+  a_header->m_recordSize = sizeof(RECORD);
+  a_header->m_nodeSize = sizeof(Node);
+}
+
+
+RTREE_SNAPSHOT_TEMPLATE
+template<class TREE, class RECORDFUNC>
+bool RTREE_SNAPSHOT_QUAL::Write(const char* a_fileName, const TREE& a_tree, RECORDFUNC a_record, uint64_t a_tag)
+{
+  static_assert(TREE::MAXNODES == MAXNODES, "snapshot and tree must have the same node size");
+
+  typedef typename TREE::Node TreeNode;
+
+  std::vector<Node> nodes;
+  std::vector<RECORD> records;
+
+  // Breadth first, so a node's index is known before its children are queued
+  std::queue<const TreeNode*> nodeQueue;
+  nodeQueue.push(a_tree.m_root);
+  uint32_t nextIndex = 1;
+
+  while (!nodeQueue.empty()) {
+    const TreeNode* treeNode = nodeQueue.front();
+    nodeQueue.pop();
+
+    Node node;
+    memset(&node, 0, sizeof(Node));
+    node.m_level = treeNode->m_level;
+    node.m_count = treeNode->m_count;
+
+    for (int i = 0; i < treeNode->m_count; ++i) {
+      const auto& branch = treeNode->m_branch[i];
+      for (int d = 0; d < NUMDIMS; ++d) {
+        node.m_min[i][d] = branch.m_rect.m_min[d];
+        node.m_max[i][d] = branch.m_rect.m_max[d];
+      }
+
+      if (treeNode->m_level > 0) {
+        node.m_ref[i] = nextIndex++;
+        nodeQueue.push(branch.m_child);
+      } else {
+        node.m_ref[i] = static_cast<uint32_t>(records.size());
+        records.push_back(a_record(branch.m_data));
+      }
+    }
+
+    nodes.push_back(node);
+  }
+
+  Header header;
+  InitHeader(&header);
+  header.m_nodeCount = nodes.size();
+  header.m_recordCount = records.size();
+  header.m_nodesOffset = AlignUp(sizeof(Header));
+  header.m_recordsOffset = AlignUp(header.m_nodesOffset + nodes.size() * sizeof(Node));
+  header.m_fileSize = header.m_recordsOffset + records.size() * sizeof(RECORD);
+  header.m_tag = a_tag;
+
+  // Unique per process and call, so concurrent writers of the same file never share a temp file
+  static std::atomic<uint64_t> s_writeCount(0);
+  std::string tempName = std::string(a_fileName) + ".tmp." + std::to_string(getpid()) + "." + std::to_string(s_writeCount++);
+  RTFileStream stream;
+  if (!stream.OpenWrite(tempName.c_str())) {
+    return false;
+  }
+
+  const char zeros[PAGE_ALIGN] = {0};
+  const int nodesPad = (int)(header.m_nodesOffset - sizeof(Header));
+  const int recordsPad = (int)(header.m_recordsOffset - header.m_nodesOffset - nodes.size() * sizeof(Node));
+  bool ok = stream.Write(header) == 1;
+  ok = ok && (nodesPad == 0 || stream.WriteArray(zeros, nodesPad) == 1);
+  ok = ok && (nodes.empty() || stream.WriteArray(nodes.data(), (int)nodes.size()) == 1);
+  ok = ok && (recordsPad == 0 || stream.WriteArray(zeros, recordsPad) == 1);
+  ok = ok && (records.empty() || stream.WriteArray(records.data(), (int)records.size()) == 1);
+  ok = ok && stream.Sync();
+  stream.Close();
+
+  if (!ok || rename(tempName.c_str(), a_fileName) != 0) {
+    remove(tempName.c_str());
+    return false;
+  }
+  return true;
+}
+
+
+RTREE_SNAPSHOT_TEMPLATE
+bool RTREE_SNAPSHOT_QUAL::Open(const char* a_fileName)
+{
+  Close();
+
+  int fd = open(a_fileName, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+    close(fd);
+    return false;
+  }
+
+  void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // The mapping stays valid
+  if (base == MAP_FAILED) {
+    return false;
+  }
+
+  m_base = static_cast<const char*>(base);
+  m_size = st.st_size;
+
+  Header expected;
+  InitHeader(&expected);
+  const Header& header = GetHeader();
+
+  bool valid = memcmp(header.m_magic, expected.m_magic, sizeof(header.m_magic)) == 0
+      && header.m_version == expected.m_version
+      && header.m_numDims == expected.m_numDims
+      && header.m_maxNodes == expected.m_maxNodes
+      && header.m_elemSize == expected.m_elemSize
+      && header.m_recordSize == expected.m_recordSize
+      && header.m_nodeSize == expected.m_nodeSize
+      && header.m_nodeCount > 0
+      && header.m_fileSize == m_size
+      && header.m_nodesOffset + header.m_nodeCount * sizeof(Node) <= header.m_recordsOffset
+      && header.m_recordsOffset + header.m_recordCount * sizeof(RECORD) <= m_size
+      && ValidNodes();
+
+  if (!valid) {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+
+// Searches follow branch refs without checking them, so a corrupt file must be refused here.
+// Nodes are breadth first, so a child always comes after its parent; requiring that also rules
+// out cycles.
+RTREE_SNAPSHOT_TEMPLATE
+bool RTREE_SNAPSHOT_QUAL::ValidNodes() const
+{
+  const Header& header = GetHeader();
+  const Node* nodes = GetNodes();
+
+  for (uint64_t n = 0; n < header.m_nodeCount; ++n) {
+    const Node& node = nodes[n];
+    if (node.m_level < 0 || node.m_count < 0 || node.m_count > MAXNODES) {
+      return false;
+    }
+    for (int i = 0; i < node.m_count; ++i) {
+      const uint64_t ref = node.m_ref[i];
+      if (node.IsInternalNode()) {
+        if (ref <= n || ref >= header.m_nodeCount || nodes[ref].m_level != node.m_level - 1) {
+          return false;
+        }
+      } else if (ref >= header.m_recordCount) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+
+RTREE_SNAPSHOT_TEMPLATE
+void RTREE_SNAPSHOT_QUAL::Close()
+{
+  if (m_base) {
+    munmap(const_cast<char*>(m_base), m_size);
+    m_base = NULL;
+    m_size = 0;
+  }
+}
+
+
+RTREE_SNAPSHOT_TEMPLATE
+int RTREE_SNAPSHOT_QUAL::Search(const ELEMTYPE a_min[NUMDIMS], const ELEMTYPE a_max[NUMDIMS], std::function<bool (const RECORD&)> a_callback) const
+{
+  if (!IsOpen()) {
+    return 0;
+  }
+
+  const Node* nodes = GetNodes();
+  const RECORD* records = GetRecords();
+
+  int foundCount = 0;
+  std::vector<uint32_t> toVisit;
+  toVisit.push_back(0);
+
+  while (!toVisit.empty()) {
+    const Node& node = nodes[toVisit.back()];
+    toVisit.pop_back();
+
+    for (int i = 0; i < node.m_count; ++i) {
+      bool overlap = true;
+      for (int d = 0; d < NUMDIMS && overlap; ++d) {
+        overlap = !(a_min[d] > node.m_max[i][d] || node.m_min[i][d] > a_max[d]);
+      }
+      if (!overlap) {
+        continue;
+      }
+
+      if (node.IsInternalNode()) {
+        RTREE_PREFETCH(&nodes[node.m_ref[i]]);
+        toVisit.push_back(node.m_ref[i]);
+      } else {
+        ++foundCount;
+        if (a_callback && !a_callback(records[node.m_ref[i]])) {
+          return foundCount; // Don't continue searching
+        }
+      }
+    }
+  }
+
+  return foundCount;
+}
+
+
+RTREE_SNAPSHOT_TEMPLATE
+void RTREE_SNAPSHOT_QUAL::ForEach(std::function<void (const ELEMTYPE*, const ELEMTYPE*, const RECORD&)> a_callback) const
+{
+  if (!IsOpen()) {
+    return;
+  }
+
+  const Node* nodes = GetNodes();
+  const RECORD* records = GetRecords();
+
+  for (uint64_t n = 0; n < GetHeader().m_nodeCount; ++n) {
+    const Node& node = nodes[n];
+    if (!node.IsLeaf()) {
+      continue;
+    }
+    for (int i = 0; i < node.m_count; ++i) {
+      a_callback(node.m_min[i], node.m_max[i], records[node.m_ref[i]]);
+    }
+  }
+}
+
+#undef RTREE_SNAPSHOT_TEMPLATE
+#undef RTREE_SNAPSHOT_QUAL
+
+
+/// \class RTreeSnapshotGeneration
+/// Generation counter shared by every process serving the same published snapshot, kept in a
+/// small mapped file (put it on /dev/shm for a pure shared-memory setup).  The writer bumps it once
+/// a new snapshot file is in place; readers compare it with the generation they have mapped.
+/// Writers in different processes serialise on Lock().
+class RTreeSnapshotGeneration
+{
+  static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the counter must be lock free to be shared across processes");
+
+public:
+
+  RTreeSnapshotGeneration() : m_counter(NULL), m_fd(-1) {}
+  ~RTreeSnapshotGeneration()                      { Close(); }
+
+  RTreeSnapshotGeneration(const RTreeSnapshotGeneration&) = delete;
+  RTreeSnapshotGeneration& operator=(const RTreeSnapshotGeneration&) = delete;
+
+  /// Map the counter file, creating it (at generation 0) if a_writable and missing
+  bool Open(const char* a_fileName, bool a_writable)
+  {
+    Close();
+
+    int fd = open(a_fileName, a_writable ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    if (fd < 0) {
+      return false;
+    }
+    if (a_writable && ftruncate(fd, sizeof(std::atomic<uint64_t>)) != 0) {
+      close(fd);
+      return false;
+    }
+
+    void* base = mmap(NULL, sizeof(std::atomic<uint64_t>), a_writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+
+    m_counter = static_cast<std::atomic<uint64_t>*>(base);
+    if (a_writable) {
+      m_fd = fd; // Kept for Lock()
+    } else {
+      close(fd); // The mapping stays valid
+    }
+    return true;
+  }
+
+  void Close()
+  {
+    if (m_counter) {
+      munmap(m_counter, sizeof(std::atomic<uint64_t>));
+      m_counter = NULL;
+    }
+    if (m_fd >= 0) {
+      close(m_fd); // Releases the lock
+      m_fd = -1;
+    }
+  }
+
+  /// Take an exclusive lock on the counter file, blocking while another writer (in any process)
+  /// holds it.  Held until Close, so a writer locks before Load and keeps the lock across writing
+  /// its snapshot and Store.  Only for a counter opened writable.
+  bool Lock()
+  {
+    if (m_fd < 0) {
+      return false;
+    }
+    int result;
+    do {
+      result = flock(m_fd, LOCK_EX);
+    } while (result != 0 && errno == EINTR);
+    return result == 0;
+  }
+
+  bool IsOpen() const                             { return m_counter != NULL; }
+
+  uint64_t Load() const                           { return m_counter ? m_counter->load(std::memory_order_acquire) : 0; }
+
+  /// Only the writer may call this
+  void Store(uint64_t a_generation)               { m_counter->store(a_generation, std::memory_order_release); }
+
+protected:
+
+  std::atomic<uint64_t>* m_counter;               ///< Lives in the shared mapping
+  int m_fd;                                       ///< Open while writable, for Lock()
+};
+
+#endif //RTREE_SNAPSHOT_H
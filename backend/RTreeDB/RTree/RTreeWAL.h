@@ -0,0 +1,296 @@
+#ifndef RTREE_WAL_H
+#define RTREE_WAL_H
+
+#include "RTree.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+
+//
+// RTreeWAL.h
+//
+// Append-only write-ahead log of tree mutations:
+//
+//   [ header ][ entry ][ entry ] ...
+//
+// Every entry carries an operation code, a log sequence number (LSN), a checksum and a fixed-size,
+// user-defined RECORD.  Entries are appended in memory and made durable by Commit(); concurrent
+// committers share one write + fdatasync (group commit).  On open, a torn or corrupt tail left by
+// a crash is cut off and the intact prefix is handed back for replay.
+//
+
+/// \class RTreeWAL
+/// RECORD Trivially copyable struct describing one mutation
+template<class RECORD>
+class RTreeWAL
+{
+  static_assert(std::is_trivially_copyable<RECORD>::value, "'RECORD' is written to disk as raw bytes");
+
+public:
+
+  enum
+  {
+    VERSION = 1,
+  };
+
+  struct Header
+  {
+    char m_magic[8];                              ///< "RTWAL\0\0\0"
+    uint32_t m_version;
+    uint32_t m_recordSize;
+  };
+
+  struct Entry
+  {
+    uint32_t m_op;                                ///< Caller-defined operation code
+    uint32_t m_checksum;                          ///< Over everything but this field
+    uint64_t m_lsn;                               ///< Increasing by one per entry
+    RECORD m_record;
+  };
+
+  RTreeWAL() : m_fd(-1), m_lastLsn(0), m_durableLsn(0), m_flushing(false), m_failed(false), m_flushes(0) {}
+  ~RTreeWAL()                                     { Close(); }
+
+  RTreeWAL(const RTreeWAL&) = delete;
+  RTreeWAL& operator=(const RTreeWAL&) = delete;
+
+  /// Open or create the log and replay it.
+  /// \param a_minLsn Entries up to this LSN are already reflected elsewhere (e.g. in a snapshot) and are skipped.
+  ///                 New entries continue after max(a_minLsn, last LSN in the log).
+  /// \param a_replay Called for every intact entry after a_minLsn, in log order
+  bool Open(const char* a_fileName, uint64_t a_minLsn, std::function<void (uint32_t, uint64_t, const RECORD&)> a_replay);
+
+  void Close();
+
+  bool IsOpen() const                             { return m_fd >= 0; }
+
+  /// Queue an entry, returns its LSN.  Not durable until Commit() for this or a later LSN returns true.
+  uint64_t Append(uint32_t a_op, const RECORD& a_record);
+
+  /// Block until every entry up to a_lsn is on disk.  The first committer to arrive writes and syncs
+  /// everything queued so far; the others wait for it instead of issuing their own fdatasync.
+  bool Commit(uint64_t a_lsn);
+
+  /// Commit everything queued, then drop all entries (after a checkpoint made them redundant).
+  /// LSNs keep increasing across truncation.
+  bool Truncate();
+
+  uint64_t LastLsn()                              { std::lock_guard<std::mutex> lock(m_mutex); return m_lastLsn; }
+
+  /// Group writes (each with its fdatasync) done so far
+  uint64_t Flushes()                              { std::lock_guard<std::mutex> lock(m_mutex); return m_flushes; }
+
+protected:
+
+  static void InitHeader(Header* a_header);
+  static uint32_t Checksum(const Entry& a_entry);
+  bool WriteAll(const std::vector<Entry>& a_entries);
+
+  int m_fd;                                       ///< Append-only descriptor
+  std::mutex m_mutex;                             ///< Guards everything below
+  std::condition_variable m_flushed;              ///< Signalled after every group flush
+  std::vector<Entry> m_pending;                   ///< Appended, not yet written
+  uint64_t m_lastLsn;                             ///< Last LSN handed out
+  uint64_t m_durableLsn;                          ///< Last LSN known to be on disk
+  bool m_flushing;                                ///< A committer is writing a group
+  bool m_failed;                                  ///< A write or sync failed, the log is unusable
+  uint64_t m_flushes;                             ///< Group writes so far
+};
+
+
+#define RTREE_WAL_TEMPLATE template<class RECORD>
+#define RTREE_WAL_QUAL RTreeWAL<RECORD>
+
+
+RTREE_WAL_TEMPLATE
+void RTREE_WAL_QUAL::InitHeader(Header* a_header)
+{
+  memset(a_header, 0, sizeof(Header));
+  memcpy(a_header->m_magic, "RTWAL", 5);
+  a_header->m_version = VERSION;
+  a_header->m_recordSize = sizeof(RECORD);
+}
+
+
+// FNV-1a over the entry with the checksum field zeroed
+RTREE_WAL_TEMPLATE
+uint32_t RTREE_WAL_QUAL::Checksum(const Entry& a_entry)
+{
+  Entry copy = a_entry;
+  copy.m_checksum = 0;
+
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&copy);
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < sizeof(Entry); ++i) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+
+RTREE_WAL_TEMPLATE
+bool RTREE_WAL_QUAL::Open(const char* a_fileName, uint64_t a_minLsn, std::function<void (uint32_t, uint64_t, const RECORD&)> a_replay)
+{
+  Close();
+
+  Header expected;
+  InitHeader(&expected);
+
+  // Replay the intact prefix
+  long validLength = 0;
+  uint64_t lastLsn = a_minLsn;
+  RTFileStream stream;
+  if (stream.OpenRead(a_fileName)) {
+    Header header;
+    if (stream.Read(header) == 1) {
+      if (memcmp(&header, &expected, sizeof(Header)) != 0) {
+        return false; // Some other file, or a log written with a different RECORD
+      }
+      validLength = sizeof(Header);
+
+      Entry entry;
+      while (stream.Read(entry) == 1 && entry.m_checksum == Checksum(entry)) {
+        if (entry.m_lsn > a_minLsn) {
+          if (a_replay) {
+            a_replay(entry.m_op, entry.m_lsn, entry.m_record);
+          }
+        }
+        lastLsn = RTREE_MAX(lastLsn, entry.m_lsn);
+        validLength += sizeof(Entry);
+      }
+    }
+    stream.Close();
+  }
+
+  m_fd = open(a_fileName, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (m_fd < 0) {
+    return false;
+  }
+
+  // Cut a torn tail (or a missing header) so that new entries follow intact data
+  bool ok = ftruncate(m_fd, validLength) == 0;
+  if (ok && validLength == 0) {
+    ok = write(m_fd, &expected, sizeof(Header)) == (ssize_t)sizeof(Header);
+  }
+  ok = ok && fdatasync(m_fd) == 0;
+  if (!ok) {
+    Close();
+    return false;
+  }
+
+  m_lastLsn = m_durableLsn = lastLsn;
+  m_pending.clear();
+  m_flushing = false;
+  m_failed = false;
+  return true;
+}
+
+
+RTREE_WAL_TEMPLATE
+void RTREE_WAL_QUAL::Close()
+{
+  if (m_fd >= 0) {
+    Commit(LastLsn());
+    close(m_fd);
+    m_fd = -1;
+  }
+}
+
+
+RTREE_WAL_TEMPLATE
+uint64_t RTREE_WAL_QUAL::Append(uint32_t a_op, const RECORD& a_record)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  Entry entry;
+  memset(&entry, 0, sizeof(Entry));
+  entry.m_op = a_op;
+  entry.m_lsn = ++m_lastLsn;
+  entry.m_record = a_record;
+  entry.m_checksum = Checksum(entry);
+
+  m_pending.push_back(entry);
+  return entry.m_lsn;
+}
+
+
+RTREE_WAL_TEMPLATE
+bool RTREE_WAL_QUAL::Commit(uint64_t a_lsn)
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  while (m_durableLsn < a_lsn && !m_failed) {
+    if (m_flushing) {
+      // Someone else is writing; our entries are either in that group or the next one
+      m_flushed.wait(lock);
+      continue;
+    }
+
+    // Become the leader for everything queued so far
+    std::vector<Entry> group;
+    group.swap(m_pending);
+    uint64_t groupLsn = m_lastLsn;
+    m_flushing = true;
+
+    lock.unlock();
+    bool ok = WriteAll(group) && fdatasync(m_fd) == 0;
+    lock.lock();
+
+    m_flushing = false;
+    ++m_flushes;
+    if (ok) {
+      m_durableLsn = groupLsn;
+    } else {
+      m_failed = true;
+    }
+    m_flushed.notify_all();
+  }
+
+  return !m_failed;
+}
+
+
+RTREE_WAL_TEMPLATE
+bool RTREE_WAL_QUAL::Truncate()
+{
+  if (!Commit(LastLsn())) {
+    return false;
+  }
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (m_flushing) {
+    m_flushed.wait(lock);
+  }
+  if (!m_pending.empty()) {
+    return false; // Entries arrived meanwhile, they are not covered by the checkpoint
+  }
+  return ftruncate(m_fd, sizeof(Header)) == 0 && fdatasync(m_fd) == 0;
+}
+
+
+RTREE_WAL_TEMPLATE
+bool RTREE_WAL_QUAL::WriteAll(const std::vector<Entry>& a_entries)
+{
+  const char* data = reinterpret_cast<const char*>(a_entries.data());
+  size_t remaining = a_entries.size() * sizeof(Entry);
+
+  while (remaining > 0) {
+    ssize_t written = write(m_fd, data, remaining);
+    if (written < 0) {
+      return false;
+    }
+    data += written;
+    remaining -= written;
+  }
+  return true;
+}
+
+#undef RTREE_WAL_TEMPLATE
+#undef RTREE_WAL_QUAL
+
+#endif //RTREE_WAL_H
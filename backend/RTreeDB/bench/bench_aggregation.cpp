@@ -0,0 +1,146 @@
+// Benchmark of node weight aggregation in LabelNodeWeight: the compile-time policies
+// (RTreeAggregate*) against the previous implementation, which compared the mode string at every
+// node, collected values into a fresh vector and sorted it. Both label the same tree with the same
+// precomputed scores, so the difference is the aggregation alone. Also reports the largest root
+// weight difference; for "mean" that is the old integer truncation of child weights.
+//
+// Usage: ./bench_aggregation [num_cafes] [repeats]
+#include "RTreeEngine.h"
+#include <random>
+
+// The string-dispatched labelling as it was, kept here as the baseline
+class LegacyTree : public CafeTree {
+public:
+  double Label(const std::string& mode, const std::function<double (const CafeRef&)>& score) {
+    std::function<double(Node*)> calculateWeight = [&](Node* node) -> double {
+      if (node->IsLeaf()) {
+        std::vector<double> scores;
+        for (int i = 0; i < node->m_count; ++i) {
+          scores.push_back(score(node->m_branch[i].m_data));
+        }
+        for (int i = 0; i < node->m_count; ++i) {
+          node->m_branch[i].m_data->weight = scores[i];
+        }
+
+        if (mode == "mean") {
+          double sum = 0;
+          for (double c : scores) sum += c;
+          node->m_weight = sum / static_cast<int>(scores.size());
+        } else if (mode == "median") {
+          std::sort(scores.begin(), scores.end());
+          size_t mid = scores.size() / 2;
+          node->m_weight = (scores.size() % 2 == 0) ? (scores[mid - 1] + scores[mid]) / 2 : scores[mid];
+        } else if (mode == "trimmed_mean") {
+          std::sort(scores.begin(), scores.end());
+          double sum = 0;
+          if (scores.size() <= 2) {
+            for (double c : scores) sum += c;
+            node->m_weight = sum / static_cast<int>(scores.size());
+          } else {
+            for (size_t i = 1; i < scores.size() - 1; ++i) sum += scores[i];
+            node->m_weight = sum / static_cast<int>(scores.size() - 2);
+          }
+        } else {
+          throw std::invalid_argument("Unsupported mode: " + mode);
+        }
+        return node->m_weight;
+      }
+
+      std::vector<double> childWeights;
+      for (int i = 0; i < node->m_count; ++i) {
+        childWeights.push_back(calculateWeight(node->m_branch[i].m_child));
+      }
+      if (mode == "mean") {
+        double sum = 0;
+        for (int w : childWeights) sum += w;
+        node->m_weight = sum / static_cast<int>(childWeights.size());
+      } else if (mode == "median") {
+        std::sort(childWeights.begin(), childWeights.end());
+        size_t mid = childWeights.size() / 2;
+        node->m_weight = (childWeights.size() % 2 == 0) ? (childWeights[mid - 1] + childWeights[mid]) / 2 : childWeights[mid];
+      } else if (mode == "trimmed_mean") {
+        std::sort(childWeights.begin(), childWeights.end());
+        double sum = 0;
+        if (childWeights.size() <= 2) {
+          for (double w : childWeights) sum += w;
+          node->m_weight = sum / static_cast<int>(childWeights.size());
+        } else {
+          for (size_t i = 1; i < childWeights.size() - 1; ++i) sum += childWeights[i];
+          node->m_weight = sum / static_cast<int>(childWeights.size() - 2);
+        }
+      } else {
+        throw std::invalid_argument("Unsupported mode: " + mode);
+      }
+      return node->m_weight;
+    };
+    return calculateWeight(m_root);
+  }
+
+  double RootWeight() const { return m_root->m_weight; }
+};
+
+template<class AGGREGATE>
+static double time_policy(LegacyTree& tree, const std::function<double (const CafeRef&)>& score, int repeats) {
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int r = 0; r < repeats; ++r) {
+    tree.LabelNodeWeight<AGGREGATE>(0, 0, 0, {}, nullptr, score);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count() / repeats;
+}
+
+static double time_legacy(LegacyTree& tree, const std::string& mode, const std::function<double (const CafeRef&)>& score, int repeats) {
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int r = 0; r < repeats; ++r) {
+    tree.Label(mode, score);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count() / repeats;
+}
+
+int main(int argc, char* argv[]) {
+  int numCafes = argc > 1 ? std::stoi(argv[1]) : 200000;
+  int repeats = argc > 2 ? std::stoi(argv[2]) : 20;
+
+  std::mt19937 rng(5);
+  std::uniform_real_distribution<double> lonDist(121.50, 121.60);
+  std::uniform_real_distribution<double> latDist(25.02, 25.10);
+  std::uniform_real_distribution<double> scoreDist(0.0, 1.0);
+
+  LegacyTree tree;
+  std::vector<double> scores(numCafes);
+  for (int i = 0; i < numCafes; ++i) {
+    double point[2] = {lonDist(rng), latDist(rng)};
+    tree.Insert(point, point, CafeRef{static_cast<uint32_t>(i), i, 0.0});
+    scores[i] = std::round(scoreDist(rng) * 1000.0) / 1000.0;
+  }
+  std::function<double (const CafeRef&)> score = [&scores](const CafeRef& ref) { return scores[ref.index]; };
+
+  std::cout << "cafes=" << numCafes << " repeats=" << repeats << "\n";
+  std::cout << std::fixed << std::setprecision(3);
+
+  auto report = [&](const char* mode, double legacyMs, double legacyRoot, double policyMs) {
+    std::cout << mode << ": string=" << legacyMs << "ms policy=" << policyMs << "ms speedup=" << std::setprecision(2)
+              << legacyMs / policyMs << "x root_diff=" << std::setprecision(6) << std::abs(legacyRoot - tree.RootWeight())
+              << std::setprecision(3) << "\n";
+  };
+
+  double legacyMs = time_legacy(tree, "mean", score, repeats);
+  double legacyRoot = tree.RootWeight();
+  report("mean", legacyMs, legacyRoot, time_policy<RTreeAggregateMean>(tree, score, repeats));
+
+  legacyMs = time_legacy(tree, "median", score, repeats);
+  legacyRoot = tree.RootWeight();
+  report("median", legacyMs, legacyRoot, time_policy<RTreeAggregateMedian>(tree, score, repeats));
+
+  legacyMs = time_legacy(tree, "trimmed_mean", score, repeats);
+  legacyRoot = tree.RootWeight();
+  report("trimmed_mean", legacyMs, legacyRoot, time_policy<RTreeAggregateTrimmedMean>(tree, score, repeats));
+
+  // No string-dispatched counterpart
+  std::cout << "max: policy=" << time_policy<RTreeAggregateMax>(tree, score, repeats) << "ms\n";
+  std::cout << "min: policy=" << time_policy<RTreeAggregateMin>(tree, score, repeats) << "ms\n";
+  std::cout << "count: policy=" << time_policy<RTreeAggregateCount>(tree, score, repeats) << "ms root=" << tree.RootWeight() << "\n";
+
+  return 0;
+}
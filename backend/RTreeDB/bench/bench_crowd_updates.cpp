@@ -0,0 +1,120 @@
+// Replay benchmark for RTreeEngine::update_crowd: feeds crowd updates in batches, refreshes the
+// per-node bounds after each batch, and runs searches in between, so the table shows sustained
+// updates per second next to the search latency they cost.
+//
+// The feed is either synthetic (random cafes, random crowd) or replayed from a CSV of
+// "cafe_id,current_crowd" lines. The last row is the MySQL event in init.sql: every cafe at once.
+//
+// Usage: ./bench_crowd_updates [num_cafes] [radius_m] [replay.csv]
+#include "RTreeEngine.h"
+#include <random>
+
+static double percentile(std::vector<double> values, double p)
+{
+  if (values.empty()) return 0;
+  size_t k = std::min(values.size() - 1, static_cast<size_t>(p * values.size()));
+  std::nth_element(values.begin(), values.begin() + k, values.end());
+  return values[k];
+}
+
+int main(int argc, char* argv[])
+{
+  int numCafes = argc > 1 ? std::stoi(argv[1]) : 100000;
+  double radius = argc > 2 ? std::stod(argv[2]) : 500.0;
+  const char* replayPath = argc > 3 ? argv[3] : nullptr;
+
+  std::mt19937 rng(11);
+  std::uniform_real_distribution<double> lonDist(121.50, 121.60);
+  std::uniform_real_distribution<double> latDist(25.02, 25.10);
+  std::uniform_real_distribution<double> ratingDist(3.0, 5.0);
+  std::uniform_int_distribution<int> priceDist(1, 4);
+  std::uniform_int_distribution<int> crowdDist(0, 100);
+  std::uniform_int_distribution<int> idDist(0, numCafes - 1);
+
+  RTreeEngine engine;
+  std::vector<Cafe> cafes;
+  for (int id = 0; id < numCafes; ++id)
+  {
+    cafes.push_back(Cafe{id, "", latDist(rng), lonDist(rng), std::round(ratingDist(rng) * 10.0) / 10.0, priceDist(rng), crowdDist(rng)});
+  }
+  engine.upsert(cafes);
+  engine.refresh_bounds();
+
+  std::vector<CrowdUpdate> feed;
+  if (replayPath)
+  {
+    std::ifstream file(replayPath);
+    int id, crowd;
+    char comma;
+    while (file >> id >> comma >> crowd)
+    {
+      feed.emplace_back(id, crowd);
+    }
+    std::cout << "replaying " << feed.size() << " updates from " << replayPath << "\n";
+  }
+
+  std::unordered_map<std::string, double> weights = {
+    {"rating", 0.3}, {"price_level", 0.2}, {"current_crowd", 0.8}, {"distance", 1.2}};
+
+  std::cout << "cafes=" << numCafes << " radius=" << radius << "m\n";
+
+  const int batchSizes[] = {10, 100, 1000, 10000, numCafes};
+  const int rounds = 50;
+  const int searchesPerRound = 5;
+  size_t replayed = 0;
+
+  for (int batchSize : batchSizes)
+  {
+    double updateSeconds = 0, refreshSeconds = 0;
+    long long updates = 0;
+    std::vector<double> searchMicros;
+
+    for (int round = 0; round < rounds; ++round)
+    {
+      std::vector<CrowdUpdate> batch;
+      batch.reserve(batchSize);
+      for (int i = 0; i < batchSize; ++i)
+      {
+        if (!feed.empty())
+        {
+          batch.push_back(feed[replayed++ % feed.size()]);
+        }
+        else if (batchSize == numCafes)
+        {
+          batch.emplace_back(i, crowdDist(rng));
+        }
+        else
+        {
+          batch.emplace_back(idDist(rng), crowdDist(rng));
+        }
+      }
+
+      auto start = std::chrono::high_resolution_clock::now();
+      updates += engine.update_crowd(batch);
+      auto applied = std::chrono::high_resolution_clock::now();
+      engine.refresh_bounds();
+      auto refreshed = std::chrono::high_resolution_clock::now();
+      updateSeconds += std::chrono::duration<double>(applied - start).count();
+      refreshSeconds += std::chrono::duration<double>(refreshed - applied).count();
+
+      for (int s = 0; s < searchesPerRound; ++s)
+      {
+        std::vector<BatchQuery> query = {BatchQuery(lonDist(rng), latDist(rng), radius)};
+        auto searchStart = std::chrono::high_resolution_clock::now();
+        engine.search_batch(query, weights, 0, 1, 1);
+        auto searchEnd = std::chrono::high_resolution_clock::now();
+        searchMicros.push_back(std::chrono::duration<double, std::micro>(searchEnd - searchStart).count());
+      }
+    }
+
+    double totalSeconds = updateSeconds + refreshSeconds;
+    std::cout << std::fixed << "batch=" << batchSize
+              << " updates/s=" << std::setprecision(0) << updates / totalSeconds
+              << " apply=" << std::setprecision(1) << 1e6 * updateSeconds / rounds << "us"
+              << " refresh=" << 1e6 * refreshSeconds / rounds << "us"
+              << " search_p50=" << percentile(searchMicros, 0.50) << "us"
+              << " search_p99=" << percentile(searchMicros, 0.99) << "us\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,124 @@
+// Throughput benchmark for query-grouped traversal (RTree::SearchGroup) against
+// one-query-at-a-time RTree::Search, single threaded, on a large synthetic tree.
+// The first table measures the bare traversal (hits are only counted), the second
+// the full RTreeEngine::search_batch path including scoring.
+//
+// Usage: ./bench_grouped_search [num_cafes] [num_queries] [radius_m]
+#include "RTreeEngine.h"
+#include <random>
+
+int main(int argc, char* argv[])
+{
+  int numCafes = argc > 1 ? std::stoi(argv[1]) : 1000000;
+  int numQueries = argc > 2 ? std::stoi(argv[2]) : 20000;
+  double radius = argc > 3 ? std::stod(argv[3]) : 200.0;
+
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<double> lonDist(121.50, 121.60);
+  std::uniform_real_distribution<double> latDist(25.02, 25.10);
+
+  RTreeEngine engine;
+  std::vector<Cafe> cafes;
+  std::unordered_map<int, std::unordered_map<std::string, double>> cafeDatas;
+
+  // Random insertion order, so nodes end up scattered over the heap as in a long-running server
+  for (int id = 0; id < numCafes; ++id)
+  {
+    double lon = lonDist(rng);
+    double lat = latDist(rng);
+    cafes.push_back(Cafe{id, "", lat, lon, 0.0, 0, 0});
+
+    auto& data = cafeDatas[id];
+    data["rating"] = 4.0;
+    data["price_level"] = 2;
+    data["current_crowd"] = 50;
+  }
+
+  engine.upsert(cafes);
+
+  std::vector<BatchQuery> queries;
+  for (int i = 0; i < numQueries; ++i)
+  {
+    queries.emplace_back(lonDist(rng), latDist(rng), radius);
+  }
+
+  std::cout << "cafes=" << numCafes << " queries=" << numQueries << " radius=" << radius << "m\n";
+
+  // Bare traversal, queries in arrival order vs grouped by location
+  std::vector<std::vector<double>> mins(numQueries, std::vector<double>(NUMDIMS));
+  std::vector<std::vector<double>> maxs(numQueries, std::vector<double>(NUMDIMS));
+  for (int i = 0; i < numQueries; ++i)
+  {
+    engine.bounding_box(std::get<0>(queries[i]), std::get<1>(queries[i]), std::get<2>(queries[i]), mins[i].data(), maxs[i].data());
+  }
+
+  double baseline = 0;
+  const int groupSizes[] = {1, 4, 8, 16, 32, 64};
+  for (int groupSize : groupSizes)
+  {
+    long long hits = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    if (groupSize == 1)
+    {
+      for (int i = 0; i < numQueries; ++i)
+      {
+        hits += engine.tree.Search(mins[i].data(), maxs[i].data(), nullptr);
+      }
+    }
+    else
+    {
+      // Group nearby queries: latitude strips of ~500 m, then by longitude
+      std::vector<size_t> order(numQueries);
+      for (int i = 0; i < numQueries; ++i) order[i] = i;
+      std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return std::make_pair(std::floor(mins[a][1] * 200), mins[a][0]) < std::make_pair(std::floor(mins[b][1] * 200), mins[b][0]);
+      });
+
+      double groupMin[CafeTree::MAX_QUERY_GROUP][NUMDIMS];
+      double groupMax[CafeTree::MAX_QUERY_GROUP][NUMDIMS];
+      for (int first = 0; first < numQueries; first += groupSize)
+      {
+        int count = std::min(groupSize, numQueries - first);
+        for (int i = 0; i < count; ++i)
+        {
+          for (int d = 0; d < NUMDIMS; ++d)
+          {
+            groupMin[i][d] = mins[order[first + i]][d];
+            groupMax[i][d] = maxs[order[first + i]][d];
+          }
+        }
+        hits += engine.tree.SearchGroup(groupMin, groupMax, count, nullptr);
+      }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    if (groupSize == 1) baseline = seconds;
+
+    std::cout << std::fixed << "traversal group=" << groupSize
+              << " time=" << std::setprecision(3) << seconds << "s"
+              << " qps=" << std::setprecision(0) << numQueries / seconds
+              << " speedup=" << std::setprecision(2) << baseline / seconds << "x"
+              << " hits=" << hits << "\n";
+  }
+
+  // End to end, one thread, so the gain is from traversal alone
+  std::unordered_map<std::string, double> weights = {{"rating", 0.3}, {"current_crowd", 0.8}, {"distance", 1.2}};
+  for (int groupSize : {1, 32})
+  {
+    auto start = std::chrono::high_resolution_clock::now();
+    BatchSearchResult result = engine.search_batch(queries, weights, 0, cafeDatas, 1, groupSize);
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    if (groupSize == 1) baseline = seconds;
+
+    std::cout << std::fixed << "search_batch group=" << groupSize
+              << " time=" << std::setprecision(3) << seconds << "s"
+              << " qps=" << std::setprecision(0) << numQueries / seconds
+              << " speedup=" << std::setprecision(2) << baseline / seconds << "x"
+              << " hits=" << result.ids.size() << "\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,297 @@
+// Benchmark suite of the tree and its scoring, for tracking regressions across commits: insert,
+// bulk load, box search, radius search, LabelNodeWeight per aggregation mode, GetLeafNodeScores
+// and nearest neighbours, over the sample sets in backend/csvs and synthetic sets, uniform and
+// clustered (see cafe_generator.h).
+//
+// Prints one JSON document to stdout. Every result names its dataset and operation and gives the
+// number of timed samples with their mean, p50 and p99 in microseconds. A build is one sample of
+// `items` entries; a query is one sample, with `items` the hits summed over all queries.
+//
+// Usage: ./bench_rtree [csv_dir] [synthetic_sizes] [queries] [radius_m]
+//        e.g. ./bench_rtree ../../csvs 100000,1000000 2000 500 > bench.json
+#include "cafe_generator.h"
+#include <sstream>
+#include <deque>
+
+#ifndef RTREE_CSV_DIR
+#define RTREE_CSV_DIR "../csvs"
+#endif
+
+struct Dataset {
+  std::string name;
+  std::vector<Cafe> cafes;
+};
+
+struct Result {
+  std::string dataset;
+  size_t size;
+  std::string op;
+  std::vector<double> micros;   // One per sample
+  size_t items;
+};
+
+static const char* const MODES[] = {"mean", "median", "trimmed_mean", "max", "min", "count"};
+
+static double percentile(std::vector<double> values, double p)
+{
+  if (values.empty()) return 0;
+  size_t k = std::min(values.size() - 1, static_cast<size_t>(p * values.size()));
+  std::nth_element(values.begin(), values.begin() + k, values.end());
+  return values[k];
+}
+
+// Columns as written by the sample sets: id,name,latitude,longitude,rating,price_level,current_crowd
+static bool read_csv(const std::string& path, std::vector<Cafe>& cafes)
+{
+  std::ifstream file(path);
+  if (!file) return false;
+
+  std::string line;
+  std::getline(file, line);
+  while (std::getline(file, line))
+  {
+    std::stringstream row(line);
+    std::string id, name, lat, lon, rating, price, crowd;
+    if (std::getline(row, id, ',') && std::getline(row, name, ',') && std::getline(row, lat, ',') && std::getline(row, lon, ',') &&
+        std::getline(row, rating, ',') && std::getline(row, price, ',') && std::getline(row, crowd, ','))
+    {
+      cafes.push_back(Cafe{std::stoi(id), name, std::stod(lat), std::stod(lon), std::stod(rating), std::stoi(price), std::stoi(crowd)});
+    }
+  }
+  return true;
+}
+
+static std::vector<Cafe> synthetic(int numCafes, unsigned seed)
+{
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<double> lonDist(121.50, 121.60);
+  std::uniform_real_distribution<double> latDist(25.02, 25.10);
+  std::uniform_real_distribution<double> ratingDist(3.0, 5.0);
+  std::uniform_int_distribution<int> priceDist(1, 4);
+  std::uniform_int_distribution<int> crowdDist(0, 100);
+
+  std::vector<Cafe> cafes;
+  for (int id = 0; id < numCafes; ++id)
+  {
+    cafes.push_back(Cafe{id, "", latDist(rng), lonDist(rng), std::round(ratingDist(rng) * 10.0) / 10.0, priceDist(rng), crowdDist(rng)});
+  }
+  return cafes;
+}
+
+template<class F>
+static double micros_of(F f)
+{
+  auto start = std::chrono::high_resolution_clock::now();
+  f();
+  auto end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+static void run_dataset(const Dataset& dataset, int numQueries, double radius, std::deque<Result>& results)
+{
+  const std::vector<Cafe>& cafes = dataset.cafes;
+  const size_t size = cafes.size();
+  auto result = [&](const char* op) -> Result& {
+    results.push_back(Result{dataset.name, size, op, {}, 0});
+    return results.back();
+  };
+
+  std::vector<CafeTree::BulkEntry> entries;
+  double extent[2][2] = {{180, -180}, {90, -90}};
+  for (size_t i = 0; i < size; ++i)
+  {
+    CafeTree::BulkEntry entry = {{cafes[i].lon, cafes[i].lat}, {cafes[i].lon, cafes[i].lat}, CafeRef{static_cast<uint32_t>(i), cafes[i].id, 0.0}};
+    entries.push_back(entry);
+    extent[0][0] = std::min(extent[0][0], cafes[i].lon);
+    extent[0][1] = std::max(extent[0][1], cafes[i].lon);
+    extent[1][0] = std::min(extent[1][0], cafes[i].lat);
+    extent[1][1] = std::max(extent[1][1], cafes[i].lat);
+  }
+
+  // Builds are repeated until about a million entries went in, small sets are too fast to time once
+  const int builds = static_cast<int>(std::max<size_t>(3, std::min<size_t>(1000, 1000000 / std::max<size_t>(size, 1))));
+
+  Result& insert = result("insert");
+  for (int b = 0; b < builds; ++b)
+  {
+    CafeTree tree;
+    insert.micros.push_back(micros_of([&] {
+      for (const CafeTree::BulkEntry& entry : entries)
+      {
+        tree.Insert(entry.m_min, entry.m_max, entry.m_data);
+      }
+    }));
+    insert.items += size;
+  }
+
+  Result& bulkLoad = result("bulk_load");
+  for (int b = 0; b < builds; ++b)
+  {
+    CafeTree tree;
+    bulkLoad.micros.push_back(micros_of([&] { tree.BulkLoad(entries); }));
+    bulkLoad.items += size;
+  }
+
+  // Queries run against an inserted tree, the shape the engine serves from
+  CafeTree tree;
+  for (const CafeTree::BulkEntry& entry : entries)
+  {
+    tree.Insert(entry.m_min, entry.m_max, entry.m_data);
+  }
+
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<double> lonDist(extent[0][0], extent[0][1]);
+  std::uniform_real_distribution<double> latDist(extent[1][0], extent[1][1]);
+  std::vector<std::pair<double, double>> points;
+  for (int q = 0; q < numQueries; ++q)
+  {
+    points.emplace_back(lonDist(rng), latDist(rng));
+  }
+
+  RTreeEngine boxes;
+  std::unordered_map<std::string, double> weights = {
+    {"rating", 0.3}, {"price_level", 0.2}, {"current_crowd", 0.8}, {"distance", 1.2}};
+
+  Result& boxSearch = result("box_search");
+  Result& radiusSearch = result("radius_search");
+  for (const auto& point : points)
+  {
+    double min[2], max[2];
+    boxes.bounding_box(point.first, point.second, radius, min, max);
+
+    size_t hits = 0;
+    boxSearch.micros.push_back(micros_of([&] {
+      tree.Search(min, max, [&](const CafeRef&) {
+        ++hits;
+        return true;
+      });
+    }));
+    boxSearch.items += hits;
+
+    hits = 0;
+    radiusSearch.micros.push_back(micros_of([&] {
+      tree.Search(min, max, [&](const CafeRef& ref) {
+        const Cafe& cafe = cafes[ref.index];
+        if (haversine(point.second, point.first, cafe.lat, cafe.lon) <= radius) {
+          ++hits;
+        }
+        return true;
+      });
+    }));
+    radiusSearch.items += hits;
+  }
+
+  // Labelling scores every entry, so fewer queries are enough
+  const int labelQueries = std::max(1, std::min(numQueries, static_cast<int>(2000000 / std::max<size_t>(size, 1))));
+  for (const char* mode : MODES)
+  {
+    Result& label = result((std::string("label_") + mode).c_str());
+    for (int q = 0; q < labelQueries; ++q)
+    {
+      const auto& point = points[q];
+      std::function<double (const CafeRef&)> score = [&](const CafeRef& ref) {
+        const Cafe& cafe = cafes[ref.index];
+        return GetCafeScore(cafe.rating, cafe.price_level, cafe.current_crowd,
+                            haversine(point.second, point.first, cafe.lat, cafe.lon), radius, weights);
+      };
+      label.micros.push_back(micros_of([&] { tree.LabelNodeWeight(mode, point.first, point.second, radius, {}, nullptr, score); }));
+      label.items += size;
+    }
+  }
+
+  // One call per leaf's worth of ids, as LabelNodeWeight makes them, against rows fetched for one query point
+  std::unordered_map<int, std::unordered_map<std::string, double>> cafeDatas;
+  for (const Cafe& cafe : cafes)
+  {
+    cafeDatas[cafe.id] = {{"rating", cafe.rating}, {"price_level", cafe.price_level}, {"current_crowd", cafe.current_crowd},
+                          {"distance", std::round(haversine(points[0].second, points[0].first, cafe.lat, cafe.lon))}};
+  }
+  Result& leafScores = result("leaf_scores");
+  for (size_t start = 0; start < size; start += CafeTree::MAXNODES)
+  {
+    std::vector<int> dataIds;
+    for (size_t i = start; i < std::min(size, start + CafeTree::MAXNODES); ++i)
+    {
+      dataIds.push_back(cafes[i].id);
+    }
+    leafScores.micros.push_back(micros_of([&] { GetLeafNodeScores(dataIds, points[0].first, points[0].second, radius, weights, cafeDatas); }));
+    leafScores.items += dataIds.size();
+  }
+
+  const size_t k = 10;
+  Result& nearest = result("nn_10");
+  for (const auto& point : points)
+  {
+    double at[2] = {point.first, point.second};
+    size_t found = 0;
+    nearest.micros.push_back(micros_of([&] {
+      tree.NNSearch(at, at, [&](const CafeRef&, double) { return ++found < k; });
+    }));
+    nearest.items += found;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  std::string csvDir = argc > 1 ? argv[1] : RTREE_CSV_DIR;
+  std::string sizes = argc > 2 ? argv[2] : "100000";
+  int numQueries = argc > 3 ? std::stoi(argv[3]) : 1000;
+  double radius = argc > 4 ? std::stod(argv[4]) : 500.0;
+
+  std::vector<Dataset> datasets;
+  for (const char* name : {"cafes_100", "cafes_1000", "cafes_10000"})
+  {
+    Dataset dataset = {name, {}};
+    if (read_csv(csvDir + "/" + name + ".csv", dataset.cafes))
+    {
+      datasets.push_back(std::move(dataset));
+    }
+    else
+    {
+      std::cerr << "skipping " << name << ": no " << csvDir << "/" << name << ".csv\n";
+    }
+  }
+  std::stringstream sizeList(sizes);
+  std::string size;
+  while (std::getline(sizeList, size, ','))
+  {
+    if (!size.empty())
+    {
+      datasets.push_back(Dataset{"uniform_" + size, synthetic(std::stoi(size), 1)});
+
+      CafeGenerator generator;
+      Dataset clustered = {"clustered_" + size, {}};
+      for (int i = std::stoi(size); i > 0; --i)
+      {
+        clustered.cafes.push_back(generator.next());
+      }
+      datasets.push_back(std::move(clustered));
+    }
+  }
+
+  std::deque<Result> results;
+  for (const Dataset& dataset : datasets)
+  {
+    std::cerr << "running " << dataset.name << " (" << dataset.cafes.size() << " cafes)\n";
+    run_dataset(dataset, numQueries, radius, results);
+  }
+
+  std::cout << std::fixed << std::setprecision(3);
+  std::cout << "{\n  \"benchmark\": \"bench_rtree\",\n"
+            << "  \"config\": {\"queries\": " << numQueries << ", \"radius_m\": " << radius
+            << ", \"max_nodes\": " << static_cast<int>(CafeTree::MAXNODES) << "},\n"
+            << "  \"results\": [";
+  for (size_t i = 0; i < results.size(); ++i)
+  {
+    const Result& r = results[i];
+    double total = 0;
+    for (double micros : r.micros) total += micros;
+    std::cout << (i ? ",\n" : "\n")
+              << "    {\"dataset\": \"" << r.dataset << "\", \"size\": " << r.size << ", \"op\": \"" << r.op << "\""
+              << ", \"samples\": " << r.micros.size() << ", \"items\": " << r.items
+              << ", \"mean_us\": " << (r.micros.empty() ? 0 : total / r.micros.size())
+              << ", \"p50_us\": " << percentile(r.micros, 0.50) << ", \"p99_us\": " << percentile(r.micros, 0.99) << "}";
+  }
+  std::cout << "\n  ]\n}\n";
+  return 0;
+}
@@ -0,0 +1,73 @@
+// Scaling benchmark for RTreeEngine::search_batch.
+// Builds a synthetic tree plus an in-memory attribute snapshot (no MySQL server needed)
+// and runs the same query batch with 1, 2, 4, ... worker threads.
+//
+// Usage: ./bench_search_batch [num_cafes] [num_queries] [radius_m]
+#include "RTreeEngine.h"
+#include <random>
+
+int main(int argc, char* argv[])
+{
+  int numCafes = argc > 1 ? std::stoi(argv[1]) : 100000;
+  int numQueries = argc > 2 ? std::stoi(argv[2]) : 5000;
+  double radius = argc > 3 ? std::stod(argv[3]) : 500.0;
+
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<double> lonDist(121.50, 121.60);
+  std::uniform_real_distribution<double> latDist(25.02, 25.10);
+  std::uniform_real_distribution<double> ratingDist(3.0, 5.0);
+  std::uniform_int_distribution<int> priceDist(1, 4);
+  std::uniform_int_distribution<int> crowdDist(0, 100);
+
+  RTreeEngine engine;
+  std::vector<Cafe> cafes;
+  std::unordered_map<int, std::unordered_map<std::string, double>> cafeDatas;
+
+  for (int id = 0; id < numCafes; ++id)
+  {
+    double lon = lonDist(rng);
+    double lat = latDist(rng);
+    cafes.push_back(Cafe{id, "", lat, lon, 0.0, 0, 0});
+
+    auto& data = cafeDatas[id];
+    data["rating"] = std::round(ratingDist(rng) * 10.0) / 10.0;
+    data["price_level"] = priceDist(rng);
+    data["current_crowd"] = crowdDist(rng);
+  }
+
+  engine.upsert(cafes);
+
+  std::vector<BatchQuery> queries;
+  for (int i = 0; i < numQueries; ++i)
+  {
+    queries.emplace_back(lonDist(rng), latDist(rng), radius);
+  }
+
+  std::unordered_map<std::string, double> weights = {
+    {"rating", 0.3}, {"price_level", 0.2}, {"current_crowd", 0.8}, {"distance", 1.2}};
+
+  int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+  double baseline = 0;
+
+  std::cout << "cafes=" << numCafes << " queries=" << numQueries << " radius=" << radius << "m\n";
+  for (int threads = 1; threads <= maxThreads; threads *= 2)
+  {
+    auto start = std::chrono::high_resolution_clock::now();
+    BatchSearchResult result = engine.search_batch(queries, weights, 0, cafeDatas, threads);
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    if (threads == 1) baseline = seconds;
+
+    std::cout << std::fixed << std::setprecision(3)
+              << "threads=" << threads
+              << " time=" << seconds << "s"
+              << " qps=" << std::setprecision(0) << numQueries / seconds
+              << " speedup=" << std::setprecision(2) << baseline / seconds << "x"
+              << " hits=" << result.ids.size() << "\n";
+
+    if (threads < maxThreads && threads * 2 > maxThreads) threads = maxThreads / 2;
+  }
+
+  return 0;
+}
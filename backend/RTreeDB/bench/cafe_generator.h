@@ -0,0 +1,91 @@
+#ifndef CAFE_GENERATOR_H
+#define CAFE_GENERATOR_H
+
+// Synthetic cafes at realistic sizes for the benchmarks (see gen_cafes.cpp): Gaussian hot spots
+// scattered around a city centre over a uniform background, inside the area the sample sets in
+// backend/csvs cover, with their attribute distributions: rating 3.0-5.0 in steps of 0.1, price
+// level 1-5 and crowd 0-100, each uniform. The same seed gives the same cafes.
+#include "RTreeEngine.h"
+#include <random>
+
+struct CafeGeneratorConfig {
+  uint64_t seed = 1;
+  int hotspots = 64;
+  double clustered = 0.8;                     // Share of cafes around hot spots, the rest is uniform
+  double centre_lon = 121.55;                 // Middle of the area below
+  double centre_lat = 25.06;
+  double centre_spread = 0.02;                // Std dev of the hot spots around the centre (degrees)
+  double hotspot_spread = 0.003;              // Median std dev of one hot spot (degrees, ~300 m)
+  double min_lon = 121.50, max_lon = 121.60;
+  double min_lat = 25.02, max_lat = 25.10;
+};
+
+class CafeGenerator {
+public:
+  explicit CafeGenerator(const CafeGeneratorConfig& config = CafeGeneratorConfig())
+    : config_(config), rng_(config.seed), lon_(config.min_lon, config.max_lon), lat_(config.min_lat, config.max_lat),
+      rating_(3.0, 5.0), price_(1, 5), crowd_(0, 100) {
+    // Hot spots get Zipf-like shares, so a few districts hold most of the clustered cafes
+    std::normal_distribution<double> centre(0.0, config.centre_spread);
+    std::lognormal_distribution<double> spread(std::log(config.hotspot_spread), 0.5);
+    std::vector<double> shares;
+    for (int i = 0; i < config.hotspots; ++i) {
+      Hotspot hotspot;
+      hotspot.lon = clamp(config.centre_lon + centre(rng_), config.min_lon, config.max_lon);
+      hotspot.lat = clamp(config.centre_lat + centre(rng_), config.min_lat, config.max_lat);
+      hotspot.spread = spread(rng_);
+      hotspots_.push_back(hotspot);
+      shares.push_back(1.0 / std::pow(i + 1, 0.8));
+    }
+    pick_ = std::discrete_distribution<int>(shares.begin(), shares.end());
+  }
+
+  // The next cafe; ids count up from 0
+  Cafe next() {
+    Cafe cafe;
+    cafe.id = next_id_++;
+    cafe.name = "Cafe_" + std::to_string(cafe.id);
+    place(cafe);
+    cafe.rating = std::round(rating_(rng_) * 10.0) / 10.0;
+    cafe.price_level = price_(rng_);
+    cafe.current_crowd = crowd_(rng_);
+    return cafe;
+  }
+
+private:
+  struct Hotspot {
+    double lon, lat;
+    double spread;
+  };
+
+  static double clamp(double value, double low, double high) {
+    return std::min(high, std::max(low, value));
+  }
+
+  // Points of a hot spot that fall outside the area are drawn again, not piled up on its edge
+  void place(Cafe& cafe) {
+    if (hotspots_.empty() || unit_(rng_) >= config_.clustered) {
+      cafe.lon = lon_(rng_);
+      cafe.lat = lat_(rng_);
+      return;
+    }
+
+    const Hotspot& hotspot = hotspots_[pick_(rng_)];
+    std::normal_distribution<double> offset(0.0, hotspot.spread);
+    do {
+      cafe.lon = hotspot.lon + offset(rng_);
+      cafe.lat = hotspot.lat + offset(rng_);
+    } while (cafe.lon < config_.min_lon || cafe.lon > config_.max_lon || cafe.lat < config_.min_lat || cafe.lat > config_.max_lat);
+  }
+
+  CafeGeneratorConfig config_;
+  std::mt19937_64 rng_;
+  std::vector<Hotspot> hotspots_;
+  std::discrete_distribution<int> pick_;
+  std::uniform_real_distribution<double> unit_{0.0, 1.0};
+  std::uniform_real_distribution<double> lon_, lat_, rating_;
+  std::uniform_int_distribution<int> price_, crowd_;
+  int next_id_ = 0;
+};
+
+#endif // CAFE_GENERATOR_H
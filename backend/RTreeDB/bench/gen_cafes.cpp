@@ -0,0 +1,101 @@
+// Generator of large synthetic cafe sets (see cafe_generator.h), for benchmarking at the sizes the
+// server is meant to run at, written as
+//   - a CSV in the columns of backend/csvs/cafes_*.csv, streamed, so any size fits in memory, and/or
+//   - an engine snapshot: the cafes bulk-loaded into a tree and written as a file that
+//     RTreeEngine::open_snapshot (RTREE_SNAPSHOT for the server) maps and serves directly.
+// Pass "-" to skip an output.
+//
+// Usage: ./gen_cafes num_cafes [seed] [out.csv] [out.snapshot] [hotspots] [clustered_share]
+//        e.g. ./gen_cafes 10000000 1 cafes_10000000.csv cafes_10000000.snapshot
+#include "cafe_generator.h"
+#include <cstdio>
+
+int main(int argc, char* argv[])
+{
+  if (argc < 2)
+  {
+    std::cerr << "usage: " << argv[0] << " num_cafes [seed] [out.csv] [out.snapshot] [hotspots] [clustered_share]\n";
+    return 1;
+  }
+
+  long long numCafes = std::stoll(argv[1]);
+  CafeGeneratorConfig config;
+  config.seed = argc > 2 ? std::stoull(argv[2]) : 1;
+  std::string csvPath = argc > 3 ? argv[3] : "cafes_" + std::to_string(numCafes) + ".csv";
+  std::string snapshotPath = argc > 4 ? argv[4] : "-";
+  config.hotspots = argc > 5 ? std::stoi(argv[5]) : config.hotspots;
+  config.clustered = argc > 6 ? std::stod(argv[6]) : config.clustered;
+
+  if (numCafes <= 0 || numCafes > std::numeric_limits<int32_t>::max())
+  {
+    std::cerr << "num_cafes must be between 1 and " << std::numeric_limits<int32_t>::max() << "\n";
+    return 1;
+  }
+
+  bool writeCsv = csvPath != "-";
+  bool writeSnapshot = snapshotPath != "-";
+  auto start = std::chrono::steady_clock::now();
+
+  FILE* csv = NULL;
+  if (writeCsv)
+  {
+    csv = fopen(csvPath.c_str(), "w");
+    if (!csv)
+    {
+      std::cerr << "cannot write " << csvPath << "\n";
+      return 1;
+    }
+    setvbuf(csv, NULL, _IOFBF, 1 << 20);
+    fputs("id,name,latitude,longitude,rating,price_level,current_crowd\n", csv);
+  }
+
+  std::vector<CafeRecord> records;
+  std::vector<CafeTree::BulkEntry> entries;
+  if (writeSnapshot)
+  {
+    records.reserve(numCafes);
+    entries.reserve(numCafes);
+  }
+
+  CafeGenerator generator(config);
+  for (long long i = 0; i < numCafes; ++i)
+  {
+    Cafe cafe = generator.next();
+    if (csv)
+    {
+      fprintf(csv, "%d,%s,%.6f,%.6f,%.1f,%d,%d\n", cafe.id, cafe.name.c_str(), cafe.lat, cafe.lon, cafe.rating, cafe.price_level, cafe.current_crowd);
+    }
+    if (writeSnapshot)
+    {
+      CafeRecord record = {cafe.id, cafe.price_level, cafe.current_crowd, 0, cafe.lon, cafe.lat, cafe.rating};
+      CafeTree::BulkEntry entry = {{cafe.lon, cafe.lat}, {cafe.lon, cafe.lat}, CafeRef{static_cast<uint32_t>(i), cafe.id, 0.0}};
+      records.push_back(record);
+      entries.push_back(entry);
+    }
+  }
+
+  if (csv && fclose(csv) != 0)
+  {
+    std::cerr << "failed writing " << csvPath << "\n";
+    return 1;
+  }
+
+  if (writeSnapshot)
+  {
+    CafeTree tree;
+    tree.BulkLoad(std::move(entries));
+    bool written = CafeSnapshot::Write(snapshotPath.c_str(), tree, [&records](const CafeRef& ref) {
+      return records[ref.index];
+    });
+    if (!written)
+    {
+      std::cerr << "failed writing " << snapshotPath << "\n";
+      return 1;
+    }
+  }
+
+  std::cerr << "generated " << numCafes << " cafes (seed " << config.seed << ") in "
+            << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s"
+            << (writeCsv ? " -> " + csvPath : "") << (writeSnapshot ? " -> " + snapshotPath : "") << "\n";
+  return 0;
+}
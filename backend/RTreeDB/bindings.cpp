@@ -3,9 +3,65 @@
 #include <pybind11/operators.h>
 #include <pybind11/functional.h>
 #include "RTree/RTreeEngine.h"
+#include <cstdlib>
+#include <new>
 
 namespace py = pybind11;
 
+#ifdef RTREE_COUNT_ALLOCATIONS
+// Count the module's heap allocations per thread for SearchStats::allocations (configure with
+// -DRTREE_COUNT_ALLOCATIONS=ON). malloc / free like the default ones, so memory may still cross
+// between this and other modules' operator new. The other forms go through these two, as the
+// default ones do; over-aligned allocations keep the default functions and are not counted.
+void* operator new(std::size_t size) {
+    ++thread_allocation_count();
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return operator new(size);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return operator new(size, std::nothrow);
+}
+
+void operator delete[](void* p) noexcept {
+    operator delete(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    operator delete(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+    operator delete(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    operator delete(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    operator delete(p);
+}
+#endif
+
 PYBIND11_MODULE(rtree_engine, m) {
     py::class_<Cafe>(m, "Cafe")
         .def(py::init<>())
@@ -21,14 +77,136 @@ PYBIND11_MODULE(rtree_engine, m) {
         .def(py::init<int, double, double>())
         .def_readwrite("id", &CafeLoc::id)
         .def_readwrite("lon", &CafeLoc::lon)
-        .def_readwrite("lat", &CafeLoc::lat);
+        .def_readwrite("lat", &CafeLoc::lat)
+        .def_readwrite("weight", &CafeLoc::weight);
 
-    py::class_<RTreeEngine>(m, "RTreeEngine")
+    py::class_<SearchStats>(m, "SearchStats")
+        .def_readonly("nodes_visited", &SearchStats::nodes_visited)
+        .def_readonly("nodes_pruned", &SearchStats::nodes_pruned)
+        .def_readonly("leaves_scanned", &SearchStats::leaves_scanned)
+        .def_readonly("overlap_tests", &SearchStats::overlap_tests)
+        .def_readonly("hits", &SearchStats::hits)
+        .def_readonly("fetch_ms", &SearchStats::fetch_ms)
+        .def_readonly("scoring_ms", &SearchStats::scoring_ms)
+        .def_readonly("traversal_ms", &SearchStats::traversal_ms)
+        .def_readonly("callback_ms", &SearchStats::callback_ms)
+        .def_readonly("total_ms", &SearchStats::total_ms)
+        .def_readonly("allocations", &SearchStats::allocations)
+        .def_readonly("cached", &SearchStats::cached);
+
+    py::class_<SearchStatus>(m, "SearchStatus")
+        .def_readonly("partial", &SearchStatus::partial)
+        .def_readonly("coverage", &SearchStatus::coverage)
+        .def_readonly("complete_above", &SearchStatus::complete_above)
+        .def_readonly("stats", &SearchStatus::stats);
+
+    py::class_<SearchCancel, std::shared_ptr<SearchCancel>>(m, "SearchCancel")
         .def(py::init<>())
-        .def("init_mysql_connection", &RTreeEngine::init_mysql_connection)
-        .def("insert", &RTreeEngine::insert)
-        .def("search", &RTreeEngine::search)
-        .def("stream_search", &RTreeEngine::stream_search);
+        .def("cancel", &SearchCancel::cancel)
+        .def("cancelled", &SearchCancel::cancelled);
+
+    py::class_<BatchSearchResult>(m, "BatchSearchResult")
+        .def_readonly("offsets", &BatchSearchResult::offsets)
+        .def_readonly("ids", &BatchSearchResult::ids)
+        .def_readonly("scores", &BatchSearchResult::scores)
+        .def_readonly("distances", &BatchSearchResult::distances);
+
+    py::class_<ProfileSearchResult>(m, "ProfileSearchResult")
+        .def_readonly("cafes", &ProfileSearchResult::cafes)
+        .def_readonly("distances", &ProfileSearchResult::distances)
+        .def_readonly("ratings", &ProfileSearchResult::ratings)
+        .def_readonly("price_levels", &ProfileSearchResult::price_levels)
+        .def_readonly("current_crowds", &ProfileSearchResult::current_crowds)
+        .def_readonly("scores", &ProfileSearchResult::scores)
+        .def_readonly("rankings", &ProfileSearchResult::rankings);
+
+    py::class_<SearchCache::Stats>(m, "ResultCacheStats")
+        .def_readonly("hits", &SearchCache::Stats::m_hits)
+        .def_readonly("misses", &SearchCache::Stats::m_misses)
+        .def_readonly("stale", &SearchCache::Stats::m_stale)
+        .def_readonly("evictions", &SearchCache::Stats::m_evictions)
+        .def_readonly("entries", &SearchCache::Stats::m_entries)
+        .def_readonly("cached_hits", &SearchCache::Stats::m_cost);
+
+    py::class_<CafeTree::TreeStats>(m, "TreeStats")
+        .def_readonly("height", &CafeTree::TreeStats::m_height)
+        .def_readonly("nodes", &CafeTree::TreeStats::m_nodes)
+        .def_readonly("entries", &CafeTree::TreeStats::m_entries)
+        .def_readonly("nodes_per_level", &CafeTree::TreeStats::m_nodesPerLevel)
+        .def_readonly("fill_per_level", &CafeTree::TreeStats::m_fillPerLevel)
+        .def_readonly("fill_factor", &CafeTree::TreeStats::m_fillFactor)
+        .def_readonly("cover_area", &CafeTree::TreeStats::m_coverArea)
+        .def_readonly("overlap_area", &CafeTree::TreeStats::m_overlapArea)
+        .def_readonly("pairwise_overlap_area", &CafeTree::TreeStats::m_pairwiseOverlapArea)
+        .def_readonly("dead_space", &CafeTree::TreeStats::m_deadSpace)
+        .def_readonly("node_bytes", &CafeTree::TreeStats::m_nodeBytes)
+        .def_readonly("data_bytes", &CafeTree::TreeStats::m_dataBytes)
+        .def_readonly("index_bytes", &CafeTree::TreeStats::m_indexBytes);
+
+    // Calls that take the engine's lock release the GIL while they run, so that Python threads
+    // search concurrently and none waits for the lock while holding the GIL. The callbacks of the
+    // streams take the GIL back for each call (pybind11/functional.h), so a stream can be cancelled
+    // from another thread while it runs.
+    using release_gil = py::call_guard<py::gil_scoped_release>;
+
+    py::class_<RTreeEngine>(m, "RTreeEngine")
+        .def(py::init<const std::string&>(), py::arg("mode") = "trimmed_mean")
+        .def("init_mysql_connection", &RTreeEngine::init_mysql_connection, release_gil())
+        .def("insert", &RTreeEngine::insert, release_gil())
+        .def("upsert", &RTreeEngine::upsert, release_gil())
+        .def("load_csv", &RTreeEngine::load_csv, py::arg("path"), py::arg("num_threads") = 0, release_gil())
+        .def("move", &RTreeEngine::move, release_gil())
+        .def("remove", &RTreeEngine::remove, release_gil())
+        // Returns (cafes, cafe_datas, status)
+        .def("search", [](RTreeEngine& self, double lon, double lat, double r_meters, double min_score,
+                          std::unordered_map<std::string, double> weights, size_t limit,
+                          std::shared_ptr<SearchCancel> cancel, double budget_ms) {
+                 SearchStatus status;
+                 auto result = self.search(lon, lat, r_meters, min_score, weights, limit, cancel, budget_ms, &status);
+                 return std::make_tuple(std::move(result.first), std::move(result.second), status);
+             },
+             py::arg("lon"), py::arg("lat"), py::arg("r_meters"), py::arg("min_score"),
+             py::arg("weights") = std::unordered_map<std::string, double>{}, py::arg("limit") = 0,
+             py::arg("cancel") = nullptr, py::arg("budget_ms") = 0.0, release_gil())
+        .def("stream_search", &RTreeEngine::stream_search,
+             py::arg("lon"), py::arg("lat"), py::arg("r_meters"), py::arg("min_score"), py::arg("weights"),
+             py::arg("callback"), py::arg("limit") = 0, py::arg("stop_when") = nullptr, py::arg("cancel") = nullptr,
+             py::arg("budget_ms") = 0.0, release_gil())
+        .def("stream_search_ranked", &RTreeEngine::stream_search_ranked,
+             py::arg("lon"), py::arg("lat"), py::arg("r_meters"), py::arg("min_score"), py::arg("weights"),
+             py::arg("callback"), py::arg("limit") = 0, py::arg("stop_when") = nullptr, py::arg("cancel") = nullptr,
+             py::arg("budget_ms") = 0.0, release_gil())
+        .def("search_profiles", &RTreeEngine::search_profiles, release_gil())
+        .def("stream_search_profiles", &RTreeEngine::stream_search_profiles, release_gil())
+        .def("save_snapshot", &RTreeEngine::save_snapshot, release_gil())
+        .def("open_snapshot", &RTreeEngine::open_snapshot, release_gil())
+        .def("publish_shared", &RTreeEngine::publish_shared, release_gil())
+        .def("attach_shared", &RTreeEngine::attach_shared, release_gil())
+        .def("shared_generation", &RTreeEngine::shared_generation, release_gil())
+        .def("enable_durability", &RTreeEngine::enable_durability, release_gil())
+        .def("checkpoint", &RTreeEngine::checkpoint, release_gil())
+        .def("update_crowd", &RTreeEngine::update_crowd, release_gil())
+        .def("sync_crowd", &RTreeEngine::sync_crowd, release_gil())
+        .def("refresh_bounds", &RTreeEngine::refresh_bounds, release_gil())
+        .def("set_bound_profile", &RTreeEngine::set_bound_profile, release_gil())
+        .def("attribute_epoch", &RTreeEngine::attribute_epoch, release_gil())
+        .def("configure_result_cache", &RTreeEngine::configure_result_cache,
+             py::arg("max_entries"), py::arg("max_hits") = 0, py::arg("coord_step") = 1e-5, py::arg("radius_step") = 1.0)
+        .def("result_cache_stats", &RTreeEngine::result_cache_stats)
+        .def("clear_result_cache", &RTreeEngine::clear_result_cache)
+        .def("tree_stats", &RTreeEngine::tree_stats, release_gil())
+        .def("start_rebuild", &RTreeEngine::start_rebuild, release_gil())
+        .def("finish_rebuild", &RTreeEngine::finish_rebuild, py::arg("wait") = false, release_gil())
+        .def("rebuilding", &RTreeEngine::rebuilding, release_gil())
+        .def("rebuild_count", &RTreeEngine::rebuild_count, release_gil())
+        .def("configure_auto_rebuild", &RTreeEngine::configure_auto_rebuild,
+             py::arg("check_every"), py::arg("max_overlap") = 0.25, py::arg("min_fill") = 0.5, release_gil())
+        .def("latency_stats", &RTreeEngine::latency_stats)
+        .def("reset_latency_stats", &RTreeEngine::reset_latency_stats)
+        .def("search_batch",
+             py::overload_cast<const std::vector<BatchQuery>&, std::unordered_map<std::string, double>, double, int, int>(&RTreeEngine::search_batch),
+             py::arg("queries"), py::arg("weights") = std::unordered_map<std::string, double>{},
+             py::arg("min_score") = 0.0, py::arg("num_threads") = 0, py::arg("group_size") = 32, release_gil());
 
 
     // py::class_<CafeSearchIterator>(m, "CafeSearchIterator")
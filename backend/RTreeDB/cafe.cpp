@@ -1,4 +1,5 @@
 #include "RTree/RTree.h" 
+#include "RTree/RTreeFrameLog.h"
 #include <cstdlib>
 #include <ctime>
 #include <filesystem>
@@ -17,19 +18,34 @@ int searchId = 0;
 typedef std::pair<double*, double*> BoundingBox;
 BoundingBox* target = nullptr;
 
-struct Cafe
+// Not the engine's Cafe (Scoring.h): the tree holds pointers and writes each entry's score to weight
+struct CafePoint
 {
   int id;
   std::string name;
   double rating;
   double lat, lon;
+  int price_level;
   int current_crowd;
+  double weight = 0;
 };
-typedef RTree<Cafe *, double, NUMDIMS> CafeTree;
+typedef RTree<CafePoint *, double, NUMDIMS> CafeTree;
+typedef RTreeFrameLog<CafeTree> CafeFrameLog;
 
-std::vector<Cafe *> read_cafes_from_csv(const std::string &filename)
+// Score nodes are labelled with: the crowd of the cafes below them
+double crowdOf(CafePoint *const &cafe)
 {
-  std::vector<Cafe *> cafes;
+  return cafe->current_crowd;
+}
+
+int cafeIdOf(CafePoint *const &cafe)
+{
+  return cafe->id;
+}
+
+std::vector<CafePoint *> read_cafes_from_csv(const std::string &filename)
+{
+  std::vector<CafePoint *> cafes;
   std::ifstream file(filename);
   std::string line;
 
@@ -45,7 +61,7 @@ std::vector<Cafe *> read_cafes_from_csv(const std::string &filename)
   {
     std::stringstream ss(line);
     std::string item;
-    Cafe *cafe = new Cafe();
+    CafePoint *cafe = new CafePoint();
 
     std::getline(ss, item, ',');
     cafe->id = std::stoi(item);
@@ -58,6 +74,8 @@ std::vector<Cafe *> read_cafes_from_csv(const std::string &filename)
     std::getline(ss, item, ',');
     cafe->rating = std::stod(item);
     std::getline(ss, item, ',');
+    cafe->price_level = std::stoi(item);
+    std::getline(ss, item, ',');
     cafe->current_crowd = std::stoi(item);
 
     cafes.push_back(cafe);
@@ -84,6 +102,45 @@ void exportSearchPath(std::ofstream& outFile, const std::vector<CafeTree::Search
     outFile << "  ]\n";
 }
 
+// The frame's own members, on one line: operation, ids, tree size and target
+std::string frameMembers(CafeTree &tree, const std::string &operation)
+{
+    std::ostringstream out;
+    out << "\"operation\": \"" << operation << "\", ";
+    out << "\"operationId\": " << operationId << ", ";
+    if (operation == "search") {
+        out << "\"searchId\": " << searchId << ", ";
+    }
+    out << "\"treeSize\": " << tree.Count();
+
+    if (target != nullptr) {
+        out << ", \"target\": {\"min\": [";
+        for (int d = 0; d < NUMDIMS; d++) {
+            out << (*target).first[d];
+            if (d < NUMDIMS - 1) out << ", ";
+        }
+        out << "], \"max\": [";
+        for (int d = 0; d < NUMDIMS; d++) {
+            out << (*target).second[d];
+            if (d < NUMDIMS - 1) out << ", ";
+        }
+        out << "]}";
+    }
+    return out.str();
+}
+
+// Members of a data point after its id and rect, as in exportTreeState
+void writeCafe(std::ostream& out, CafePoint *const &cafe)
+{
+    out << "\"level\": -1, ";
+    out << "\"cafeId\": " << cafe->id << ", ";
+    out << "\"name\": \"" << cafe->name << "\", ";
+    out << "\"rating\": " << cafe->rating << ", ";
+    out << "\"lat\": " << cafe->lat << ", ";
+    out << "\"lon\": " << cafe->lon << ", ";
+    out << "\"current_crowd\": " << cafe->current_crowd;
+}
+
 void exportTreeState(CafeTree &tree, const std::string &operation, 
                      const std::vector<CafeTree::SearchPathRecord> &searchPath = {}) {  
     std::string filename;
@@ -108,29 +165,7 @@ void exportTreeState(CafeTree &tree, const std::string &operation,
     auto treeStructure = tree.GetTreeStructure();
 
     outFile << "{\n";
-    outFile << "  \"operation\": \"" << operation << "\",\n";
-    outFile << "  \"operationId\": " << operationId << ",\n";
-    if (operation == "search") {
-        outFile << "  \"searchId\": " << searchId << ",\n";
-    }
-    outFile << "  \"treeSize\": " << tree.Count() << ",\n";
-
-    if (target != nullptr) {
-        outFile << "  \"target\": {\n";
-        outFile << "    \"min\": [";
-        for (int d = 0; d < NUMDIMS; d++) {
-            outFile << (*target).first[d];
-            if (d < NUMDIMS - 1) outFile << ", ";
-        }
-        outFile << "],\n";
-        
-        outFile << "    \"max\": [";
-        for (int d = 0; d < NUMDIMS; d++) {
-            outFile << (*target).second[d];
-            if (d < NUMDIMS - 1) outFile << ", ";
-        }
-        outFile << "]\n  },\n";
-    }
+    outFile << "  " << frameMembers(tree, operation) << ",\n";
 
     // Export tree nodes with exact structure - but NOT data points
     outFile << "  \"treeNodes\": [\n";
@@ -186,7 +221,7 @@ void exportTreeState(CafeTree &tree, const std::string &operation,
     outFile << "  \"dataPoints\": [\n";
     for (size_t i = 0; i < treeStructure.dataPoints.size(); ++i) {
         const auto& dataPoint = treeStructure.dataPoints[i];
-        Cafe* cafe = dataPoint.data;
+        CafePoint* cafe = dataPoint.data;
         
         outFile << "    {\n";
         outFile << "      \"id\": " << dataPoint.id << ",\n";
@@ -230,13 +265,25 @@ void exportTreeState(CafeTree &tree, const std::string &operation,
     outFile.close();
 }
 
-void insert_to_rtree(CafeTree &tree, const std::vector<Cafe *> &cafes, const std::string& weightMode)
+// Insert frames go to a frame log (RTreeFrameLog.h): a keyframe every few inserts and the changes
+// in between, instead of the whole tree again after every insert, written on the log's own thread.
+// Every insert commits a tree version, which copies only the nodes it changed; the log copies out
+// the rest on its thread, and the tree keeps the whole history (GetTreeStructure(version)).
+void insert_to_rtree(CafeTree &tree, const std::vector<CafePoint *> &cafes, const std::string& weightMode,
+                     int keyframeInterval = CafeFrameLog::DEFAULT_KEYFRAME_INTERVAL,
+                     CafeFrameLog::Encoding encoding = CafeFrameLog::JSON)
 {
   double global_lat_min = std::numeric_limits<double>::max();
   double global_lat_max = std::numeric_limits<double>::lowest();
   double global_lon_min = std::numeric_limits<double>::max();
   double global_lon_max = std::numeric_limits<double>::lowest();
 
+  fs::create_directories("frames/insert");
+  CafeFrameLog frames(cafeIdOf, writeCafe);
+  if (!frames.Open("frames/insert", keyframeInterval, encoding)) {
+    std::cerr << "Failed to open frames/insert" << std::endl;
+  }
+
   for (auto cafe : cafes)
   {
     double lat = cafe->lat;
@@ -257,8 +304,8 @@ void insert_to_rtree(CafeTree &tree, const std::vector<Cafe *> &cafes, const std
     
     tree.Insert(min, max, cafe);
     tree.LabelNodeId(); 
-    tree.LabelNodeWeight(weightMode);
-    exportTreeState(tree, "insert");
+    tree.LabelNodeWeight(weightMode, lon, lat, 0, {}, nullptr, crowdOf);
+    frames.Append(tree.GetVersion(tree.CommitVersion()), frameMembers(tree, "insert"));
     operationId++;
     
     // Clean up target
@@ -268,6 +315,10 @@ void insert_to_rtree(CafeTree &tree, const std::vector<Cafe *> &cafes, const std
     target = nullptr;
   }
 
+  if (!frames.Close()) {
+    std::cerr << "Failed to write frames/insert" << std::endl;
+  }
+
   std::cout << "? All cafe locations span:\n";
   std::cout << "Longitude: " << global_lon_min << " ~ " << global_lon_max << "\n";
   std::cout << "Latitude:  " << global_lat_min << " ~ " << global_lat_max << "\n";
@@ -283,7 +334,7 @@ void query_area(CafeTree &tree, double lat_min, double lon_min, double lat_max,
   double* targetMax = new double[2]{max[0], max[1]};
   target = new BoundingBox(targetMin, targetMax);
 
-  auto callback = [min_score](Cafe *cafe)
+  auto callback = [min_score](CafePoint *cafe)
   {
 
     std::cout << "? ID: " << cafe->id
@@ -319,7 +370,12 @@ int main(int argc, char* argv[])
     threshold = std::stoi(argv[2]); 
   }
 
-  std::vector<Cafe *> cafes = read_cafes_from_csv("../cafes_100.csv");
+  // Optional: keyframe interval, "json" or "binary" insert frames, and the cafes to insert
+  int keyframeInterval = argc >= 4 ? std::stoi(argv[3]) : CafeFrameLog::DEFAULT_KEYFRAME_INTERVAL;
+  CafeFrameLog::Encoding encoding = argc >= 5 && std::string(argv[4]) == "binary" ? CafeFrameLog::BINARY : CafeFrameLog::JSON;
+  std::string csvPath = argc >= 6 ? argv[5] : "../cafes_100.csv";
+
+  std::vector<CafePoint *> cafes = read_cafes_from_csv(csvPath);
 
   if (cafes.empty())
   {
@@ -329,7 +385,7 @@ int main(int argc, char* argv[])
 
   CafeTree rtree;
 
-  insert_to_rtree(rtree, cafes, weightMode);
+  insert_to_rtree(rtree, cafes, weightMode, keyframeInterval, encoding);
 
   query_area(rtree, 25.02, 121.5, 25.10, 121.6, threshold);
   
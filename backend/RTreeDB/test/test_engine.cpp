@@ -0,0 +1,466 @@
+// Tests of RTreeEngine without MySQL (see SCORING_NO_MYSQL): after every kind of mutation, an
+// engine answering from its result cache must return what an engine without a cache returns;
+// random upserts, moves and removes with background rebuilds starting all the time must leave
+// the engine holding exactly the cafes a plain map of them holds, also with searches running on
+// other threads meanwhile; writers on several threads must share the log's fdatasyncs.
+//
+// Usage: ./test_engine    (exit status 0 if every check passed)
+#include "RTreeEngine.h"
+#include <map>
+#include <random>
+#include <set>
+
+static std::atomic<int> g_failures(0);
+
+#define CHECK(cond, what) \
+  do { if (!(cond)) { ++g_failures; std::cout << "FAIL " << what << " (" #cond ")\n"; } } while (0)
+
+// The query every check runs: ~500 m around the middle of the generated cafes
+static const double QUERY_LON = 121.55;
+static const double QUERY_LAT = 25.06;
+static const double QUERY_RADIUS = 500.0;
+static const std::unordered_map<std::string, double> WEIGHTS = {
+  {"rating", 0.3}, {"price_level", 0.2}, {"current_crowd", 0.8}, {"distance", 1.2}};
+
+// (id, score, lon, lat, current_crowd) of every hit, ordered by id
+typedef std::vector<std::tuple<int, double, double, double, double>> Hits;
+
+static Hits SearchHits(RTreeEngine& a_engine, size_t a_limit)
+{
+  auto result = a_engine.search(QUERY_LON, QUERY_LAT, QUERY_RADIUS, -1e9, WEIGHTS, a_limit);
+  Hits hits;
+  for (const CafeLoc& cafe : result.first)
+  {
+    hits.emplace_back(cafe.id, cafe.weight, cafe.lon, cafe.lat, result.second.at(cafe.id).at("current_crowd"));
+  }
+  std::sort(hits.begin(), hits.end());
+  return hits;
+}
+
+static Hits StreamHits(RTreeEngine& a_engine, size_t a_limit = 0)
+{
+  Hits hits;
+  a_engine.stream_search(QUERY_LON, QUERY_LAT, QUERY_RADIUS, -1e9, WEIGHTS,
+                         [&](const CafeLoc& cafe, const std::unordered_map<std::string, double>& row) {
+    hits.emplace_back(cafe.id, cafe.weight, cafe.lon, cafe.lat, row.at("current_crowd"));
+  }, a_limit);
+  std::sort(hits.begin(), hits.end());
+  return hits;
+}
+
+static Cafe NearCafe(int a_id, double a_dlon, double a_dlat, int a_crowd)
+{
+  return Cafe{a_id, "", QUERY_LAT + a_dlat, QUERY_LON + a_dlon, 4.0, 2, a_crowd};
+}
+
+static void CheckResultCache()
+{
+  RTreeEngine cached;
+  RTreeEngine uncached;
+  cached.configure_result_cache(64);
+  uncached.configure_result_cache(0);
+
+  std::mt19937 rng(3);
+  std::uniform_real_distribution<double> offset(-0.01, 0.01);
+  std::uniform_int_distribution<int> crowd(0, 100);
+  std::vector<Cafe> cafes;
+  for (int id = 0; id < 3000; ++id)
+  {
+    cafes.push_back(NearCafe(id, offset(rng), offset(rng), crowd(rng)));
+  }
+  cached.upsert(cafes);
+  uncached.upsert(cafes);
+
+  const char* csvPath = "test_engine.csv";
+  {
+    std::ofstream csv(csvPath);
+    csv << "id,name,latitude,longitude,rating,price_level,current_crowd\n";
+    csv << "7000,a," << QUERY_LAT + 0.001 << "," << QUERY_LON << ",4.5,1,5\n";
+    csv << "1," << "b," << QUERY_LAT << "," << QUERY_LON + 0.0005 << ",2.0,3,95\n";
+  }
+
+  // Each may change the hits of the query or their rows
+  struct Mutation
+  {
+    const char* m_name;
+    std::function<void (RTreeEngine&)> m_apply;
+  };
+  const Mutation mutations[] = {
+    {"upsert of a new cafe", [](RTreeEngine& e) { e.upsert({NearCafe(5000, 0.0005, 0.0, 50)}); }},
+    {"upsert of new attributes", [](RTreeEngine& e) { e.upsert({Cafe{5000, "", QUERY_LAT, QUERY_LON + 0.0005, 1.0, 4, 99}}); }},
+    {"upsert of a new location", [](RTreeEngine& e) { e.upsert({NearCafe(5000, 0.05, 0.05, 99)}); }},
+    {"insert", [](RTreeEngine& e) { e.insert({NearCafe(5001, -0.0005, 0.0, 20)}); }},
+    {"move into the query", [](RTreeEngine& e) { e.move(5000, QUERY_LON, QUERY_LAT + 0.0002); }},
+    {"move within the query", [](RTreeEngine& e) { e.move(5000, QUERY_LON + 0.001, QUERY_LAT); }},
+    {"move out of the query", [](RTreeEngine& e) { e.move(5001, QUERY_LON + 0.05, QUERY_LAT); }},
+    {"remove", [](RTreeEngine& e) { e.remove(5000); }},
+    {"update_crowd", [](RTreeEngine& e) { e.update_crowd({{5001, 3}, {1, 100}, {2, 0}}); }},
+    {"load_csv", [csvPath](RTreeEngine& e) { e.load_csv(csvPath, 1); }},
+    {"set_bound_profile", [](RTreeEngine& e) { e.set_bound_profile(WEIGHTS); }},
+  };
+
+  for (const Mutation& mutation : mutations)
+  {
+    // Prime the cache with every kind of cached search
+    for (int round = 0; round < 2; ++round)
+    {
+      SearchHits(cached, 0);
+      SearchHits(cached, 10);
+      StreamHits(cached);
+    }
+
+    mutation.m_apply(cached);
+    mutation.m_apply(uncached);
+
+    CHECK(SearchHits(cached, 0) == SearchHits(uncached, 0), "search after " << mutation.m_name);
+    CHECK(SearchHits(cached, 10) == SearchHits(uncached, 10), "search with a limit after " << mutation.m_name);
+    CHECK(StreamHits(cached) == StreamHits(uncached), "stream_search after " << mutation.m_name);
+    // A limited stream takes the first hits in tree order, also with the full stream cached
+    CHECK(StreamHits(cached, 10) == StreamHits(uncached, 10), "stream_search with a limit after " << mutation.m_name);
+  }
+  CHECK(cached.result_cache_stats().m_hits > 0, "the cache was used");
+
+  // The labelled traversal prunes by the node weights (a trimmed mean by default), a search with a
+  // budget runs the exact best-first pass: neither may be answered from the other's entry
+  Hits all = SearchHits(uncached, 0);
+  std::vector<double> scores;
+  for (const auto& hit : all)
+  {
+    scores.push_back(std::get<1>(hit));
+  }
+  std::sort(scores.begin(), scores.end());
+  const double threshold = scores[scores.size() / 2];
+  auto thresholdIds = [threshold](RTreeEngine& a_engine, double a_budget) {
+    std::set<int> ids;
+    for (const CafeLoc& cafe : a_engine.search(QUERY_LON, QUERY_LAT, QUERY_RADIUS, threshold, WEIGHTS, 0, nullptr, a_budget).first)
+    {
+      ids.insert(cafe.id);
+    }
+    return ids;
+  };
+  std::set<int> labelled = thresholdIds(uncached, 0);
+  std::set<int> ranked = thresholdIds(uncached, 60000.0);
+  CHECK(thresholdIds(cached, 0) == labelled, "labelled search with a threshold");
+  CHECK(thresholdIds(cached, 60000.0) == ranked, "budgeted search after a labelled one");
+  CHECK(thresholdIds(cached, 0) == labelled, "labelled search after a budgeted one");
+
+  std::remove(csvPath);
+}
+
+// Every cafe in the engine's tree and the location its search row reports, by id
+static std::map<int, std::pair<double, double>> EngineCafes(RTreeEngine& a_engine, const char* a_when)
+{
+  std::map<int, std::pair<double, double>> cafes;
+  double min[2] = {121.0, 24.5};
+  double max[2] = {122.0, 25.5};
+  a_engine.tree.Search(min, max, [&](const CafeRef& ref) {
+    CHECK(ref.id >= 0, a_when << ": entry of a removed cafe in slot " << ref.index);
+    CHECK(cafes.emplace(ref.id, std::make_pair(0.0, 0.0)).second, a_when << ": cafe " << ref.id << " in the tree twice");
+    return true;
+  });
+
+  auto result = a_engine.search(QUERY_LON, QUERY_LAT, 50000.0, -1e9, WEIGHTS, 0);
+  CHECK(result.first.size() == cafes.size(), a_when << ": search found " << result.first.size() << " of " << cafes.size());
+  for (const CafeLoc& cafe : result.first)
+  {
+    cafes[cafe.id] = std::make_pair(cafe.lon, cafe.lat);
+  }
+  return cafes;
+}
+
+static void CheckAutoRebuild()
+{
+  RTreeEngine engine;
+  engine.configure_result_cache(0);
+  // Any tree counts as degraded, so a rebuild starts at every check while none is running
+  engine.configure_auto_rebuild(40, 0.0, 1.01);
+
+  std::mt19937 rng(9);
+  std::uniform_real_distribution<double> offset(-0.01, 0.01);
+  std::uniform_int_distribution<int> pickId(0, 799);
+  std::map<int, std::pair<double, double>> truth;
+
+  for (int step = 0; step < 6000; ++step)
+  {
+    int id = pickId(rng);
+    int op = rng() % 10;
+    double lon = QUERY_LON + offset(rng);
+    double lat = QUERY_LAT + offset(rng);
+
+    if (op < 4 || !truth.count(id))
+    {
+      engine.upsert({Cafe{id, "", lat, lon, 4.0, 2, 10}});
+      truth[id] = std::make_pair(lon, lat);
+    }
+    else if (op < 7)
+    {
+      CHECK(engine.move(id, lon, lat), "move of " << id);
+      truth[id] = std::make_pair(lon, lat);
+    }
+    else
+    {
+      CHECK(engine.remove(id), "remove of " << id);
+      truth.erase(id);
+    }
+
+    if (step % 200 == 199)
+    {
+      engine.finish_rebuild(true);
+      CHECK(EngineCafes(engine, "after a rebuild") == truth, "cafes after step " << step);
+    }
+  }
+  CHECK(engine.rebuild_count() > 10, "rebuilds ran (" << engine.rebuild_count() << ")");
+  CHECK(EngineCafes(engine, "at the end") == truth, "cafes at the end");
+}
+
+// Writers on several threads with the log enabled: their commits overlap, so fewer fdatasyncs
+// than mutations run, and recovery from the log alone gives back every cafe
+static void CheckGroupCommit()
+{
+  const char* snapshotPath = "test_engine.snapshot";
+  const char* walPath = "test_engine.wal";
+  std::remove(snapshotPath);
+  std::remove(walPath);
+
+  const int writers = 8;
+  const int cafesPerWriter = 100;
+  std::map<int, std::pair<double, double>> truth;
+  {
+    RTreeEngine engine;
+    CHECK(engine.enable_durability(snapshotPath, walPath), "enable durability");
+
+    std::vector<std::thread> threads;
+    for (int w = 0; w < writers; ++w)
+    {
+      threads.emplace_back([&engine, w]() {
+        for (int i = 0; i < cafesPerWriter; ++i)
+        {
+          int id = w * cafesPerWriter + i;
+          engine.upsert({Cafe{id, "", QUERY_LAT + 0.0001 * w, QUERY_LON + 0.0001 * i, 4.0, 2, 10}});
+          if (i % 4 == 3)
+          {
+            engine.move(id, QUERY_LON - 0.0001 * i, QUERY_LAT - 0.0001 * w);
+          }
+        }
+      });
+    }
+    for (auto& thread : threads)
+    {
+      thread.join();
+    }
+
+    const uint64_t mutations = writers * (cafesPerWriter + cafesPerWriter / 4);
+    CHECK(engine.log_flushes() < mutations, "concurrent writers share fdatasyncs (" << engine.log_flushes() << " for " << mutations << " mutations)");
+    truth = EngineCafes(engine, "after concurrent writers");
+    CHECK(truth.size() == static_cast<size_t>(writers * cafesPerWriter), "cafes written (" << truth.size() << ")");
+  }
+
+  RTreeEngine recovered;
+  CHECK(recovered.enable_durability(snapshotPath, walPath), "recover from the log");
+  CHECK(EngineCafes(recovered, "after recovery") == truth, "cafes after recovery");
+
+  std::remove(snapshotPath);
+  std::remove(walPath);
+}
+
+// Searches of a mapped snapshot keep to their budget and cancel token and say when they did
+static void CheckSnapshotBudget()
+{
+  const char* snapshotPath = "test_engine.snapshot";
+  RTreeEngine engine;
+  std::mt19937 rng(5);
+  std::uniform_real_distribution<double> offset(-0.002, 0.002);
+  std::vector<Cafe> cafes;
+  for (int id = 0; id < 2000; ++id)
+  {
+    cafes.push_back(NearCafe(id, offset(rng), offset(rng), id % 100));
+  }
+  engine.upsert(cafes);
+  CHECK(engine.save_snapshot(snapshotPath) && engine.open_snapshot(snapshotPath), "map a snapshot");
+
+  SearchStatus status;
+  size_t all = engine.search(QUERY_LON, QUERY_LAT, QUERY_RADIUS, -1e9, WEIGHTS, 0, nullptr, 0, &status).first.size();
+  CHECK(all == cafes.size() && !status.partial, "snapshot search without a budget (" << all << " hits)");
+
+  size_t found = engine.search(QUERY_LON, QUERY_LAT, QUERY_RADIUS, -1e9, WEIGHTS, 0, nullptr, 1e-6, &status).first.size();
+  CHECK(status.partial && found < all, "snapshot search out of budget (" << found << " hits)");
+
+  auto cancel = std::make_shared<SearchCancel>();
+  cancel->cancel();
+  found = engine.search(QUERY_LON, QUERY_LAT, QUERY_RADIUS, -1e9, WEIGHTS, 0, cancel, 0, &status).first.size();
+  CHECK(status.partial && found == 0, "cancelled snapshot search (" << found << " hits)");
+
+  size_t streamed = 0;
+  auto count = [&streamed](const CafeLoc&, const std::unordered_map<std::string, double>&) { ++streamed; };
+  status = engine.stream_search(QUERY_LON, QUERY_LAT, QUERY_RADIUS, -1e9, WEIGHTS, count, 0, nullptr, nullptr, 1e-6);
+  CHECK(status.partial && streamed < all, "snapshot stream out of budget (" << streamed << " hits)");
+  streamed = 0;
+  status = engine.stream_search_ranked(QUERY_LON, QUERY_LAT, QUERY_RADIUS, -1e9, WEIGHTS, count, 0, nullptr, nullptr, 1e-6);
+  CHECK(status.partial && streamed < all, "ranked snapshot stream out of budget (" << streamed << " hits)");
+
+  std::remove(snapshotPath);
+}
+
+// Ids of the hits, each once, and their scores never increasing if a_ranked
+static void CheckHits(const std::vector<std::pair<int, double>>& a_hits, bool a_ranked, const char* a_what)
+{
+  std::set<int> ids;
+  for (size_t i = 0; i < a_hits.size(); ++i)
+  {
+    CHECK(ids.insert(a_hits[i].first).second, a_what << ": cafe " << a_hits[i].first << " found twice");
+    CHECK(!a_ranked || i == 0 || a_hits[i - 1].second >= a_hits[i].second, a_what << ": hit " << i << " out of order");
+  }
+}
+
+// Every kind of search on reader threads while the main thread mutates the engine
+static void CheckConcurrency()
+{
+  RTreeEngine engine;
+  engine.configure_auto_rebuild(100, 0.0, 1.01);
+  engine.set_bound_profile(WEIGHTS);
+
+  std::mt19937 rng(5);
+  std::uniform_real_distribution<double> offset(-0.01, 0.01);
+  std::uniform_int_distribution<int> pickId(0, 1999);
+  std::map<int, std::pair<double, double>> truth;
+  std::vector<Cafe> cafes;
+  for (int id = 0; id < 1000; ++id)
+  {
+    cafes.push_back(NearCafe(id, offset(rng), offset(rng), id % 100));
+    truth[id] = std::make_pair(cafes.back().lon, cafes.back().lat);
+  }
+  engine.upsert(cafes);
+
+  const std::unordered_map<std::string, double> other = {{"rating", 1.0}, {"distance", 0.5}};
+  std::atomic<bool> done(false);
+  auto reader = [&](int a_seed) {
+    std::mt19937 readerRng(a_seed);
+    for (int round = 0; !done; ++round)
+    {
+      double lon = QUERY_LON + offset(readerRng);
+      double lat = QUERY_LAT + offset(readerRng);
+      std::vector<std::pair<int, double>> hits;
+      auto collect = [&](const CafeLoc& cafe, const std::unordered_map<std::string, double>&) {
+        hits.emplace_back(cafe.id, cafe.weight);
+      };
+
+      switch (round % 6)
+      {
+      case 0:
+      case 1:
+        for (const CafeLoc& cafe : engine.search(lon, lat, QUERY_RADIUS, 0.3, round % 2 ? WEIGHTS : other, round % 2 ? 10 : 0).first)
+        {
+          hits.emplace_back(cafe.id, cafe.weight);
+        }
+        CheckHits(hits, true, "search");
+        break;
+      case 2:
+        engine.stream_search(lon, lat, QUERY_RADIUS, 0.3, WEIGHTS, collect);
+        CheckHits(hits, false, "stream_search");
+        break;
+      case 3:
+        engine.stream_search_ranked(lon, lat, QUERY_RADIUS, 0.3, other, collect, 5);
+        CheckHits(hits, true, "stream_search_ranked");
+        break;
+      case 4:
+      {
+        std::vector<BatchQuery> queries;
+        for (int q = 0; q < 8; ++q)
+        {
+          queries.emplace_back(lon + q * 0.001, lat, QUERY_RADIUS);
+        }
+        // Unbounded batches under more profiles than the engine keeps, so they keep adding them
+        bool bounded = round % 12 == 4;
+        std::unordered_map<std::string, double> weights = WEIGHTS;
+        weights["rating"] = bounded ? weights["rating"] : 1.0 + round % 7;
+        BatchSearchResult result = engine.search_batch(queries, weights, bounded ? 0.3 : 0.0, 2, 4);
+        for (size_t q = 0; q < queries.size(); ++q)
+        {
+          hits.clear();
+          for (int i = result.offsets[q]; i < result.offsets[q + 1]; ++i)
+          {
+            hits.emplace_back(result.ids[i], result.scores[i]);
+          }
+          CheckHits(hits, true, "search_batch");
+        }
+        break;
+      }
+      case 5:
+      {
+        ProfileSearchResult result = engine.search_profiles(lon, lat, QUERY_RADIUS, 0.3, {WEIGHTS, other});
+        for (const CafeLoc& cafe : result.cafes)
+        {
+          hits.emplace_back(cafe.id, cafe.weight);
+        }
+        CheckHits(hits, false, "search_profiles");
+        break;
+      }
+      }
+    }
+  };
+
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; ++t)
+  {
+    readers.emplace_back(reader, 100 + t);
+  }
+
+  for (int step = 0; step < 3000; ++step)
+  {
+    int id = pickId(rng);
+    int op = rng() % 10;
+    double lon = QUERY_LON + offset(rng);
+    double lat = QUERY_LAT + offset(rng);
+
+    if (op < 3 || !truth.count(id))
+    {
+      engine.upsert({Cafe{id, "", lat, lon, 3.0 + op * 0.2, 1 + op % 4, op * 10}});
+      truth[id] = std::make_pair(lon, lat);
+    }
+    else if (op < 6)
+    {
+      engine.move(id, lon, lat);
+      truth[id] = std::make_pair(lon, lat);
+    }
+    else if (op < 8)
+    {
+      engine.update_crowd({{id, static_cast<int>(rng() % 100)}, {pickId(rng), 50}});
+    }
+    else if (op < 9)
+    {
+      engine.remove(id);
+      truth.erase(id);
+    }
+    else
+    {
+      engine.refresh_bounds();
+      // Resizing or turning off the result cache under running searches
+      engine.configure_result_cache(step % 2 ? 64 : 0);
+    }
+  }
+
+  done = true;
+  for (auto& thread : readers)
+  {
+    thread.join();
+  }
+  engine.finish_rebuild(true);
+  CHECK(EngineCafes(engine, "after concurrent searches") == truth, "cafes after concurrent searches");
+}
+
+int main()
+{
+  CheckResultCache();
+  CheckAutoRebuild();
+  CheckConcurrency();
+  CheckGroupCommit();
+  CheckSnapshotBudget();
+
+  if (g_failures)
+  {
+    std::cout << g_failures << " checks failed\n";
+    return 1;
+  }
+  std::cout << "all checks passed\n";
+  return 0;
+}
@@ -0,0 +1,453 @@
+// Randomised test of the mutable RTree against a brute-force model: inserts, removes by data
+// (through the data index and parent links) and by rect, moves in place and by reinsertion,
+// bulk loads and RemoveAll, checking Count, Search, Locate and the tree shape as it goes.
+// Every step is committed as a version, which must read back as the live tree was at the time.
+// A write-ahead log of the same mutations is then replayed into a fresh tree.
+//
+// Usage: ./test_rtree [seed]    (exit status 0 if every check passed)
+#include "RTree.h"
+#include "RTreeWAL.h"
+#include <map>
+#include <random>
+#include <set>
+#include <sys/stat.h>
+
+struct Item
+{
+  int id;
+  double current_crowd;                           // Read by GetTreeStructure()
+  double weight;                                  // Written by LabelNodeWeight()
+};
+
+typedef RTree<Item*, double, 2> ItemTree;
+
+struct Box
+{
+  double m_min[2];
+  double m_max[2];
+};
+
+static bool operator==(const Box& a, const Box& b)
+{
+  return a.m_min[0] == b.m_min[0] && a.m_min[1] == b.m_min[1] && a.m_max[0] == b.m_max[0] && a.m_max[1] == b.m_max[1];
+}
+
+typedef std::map<int, Box> Model;
+
+// One logged mutation; a remove carries no box
+struct LogRecord
+{
+  int32_t m_id;
+  double m_min[2];
+  double m_max[2];
+};
+
+enum LogOp
+{
+  LOG_PUT = 1,                                    // Insert, or move if present
+  LOG_REMOVE = 2,
+};
+
+static int g_failures = 0;
+
+#define CHECK(cond, what) \
+  do { if (!(cond)) { ++g_failures; std::cout << "FAIL " << what << " (" #cond ")\n"; } } while (0)
+
+static bool Overlaps(const Box& a, const double a_min[2], const double a_max[2])
+{
+  return !(a.m_min[0] > a_max[0] || a_min[0] > a.m_max[0] || a.m_min[1] > a_max[1] || a_min[1] > a.m_max[1]);
+}
+
+static bool Inside(const std::vector<double>& a_min, const std::vector<double>& a_max,
+                   const std::vector<double>& a_outerMin, const std::vector<double>& a_outerMax)
+{
+  for (size_t d = 0; d < a_min.size(); ++d)
+  {
+    if (a_min[d] < a_outerMin[d] || a_max[d] > a_outerMax[d])
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void CheckSearch(const ItemTree& a_tree, const Model& a_model, const Box& a_query, const char* a_when)
+{
+  std::set<int> expected;
+  for (const auto& entry : a_model)
+  {
+    if (Overlaps(entry.second, a_query.m_min, a_query.m_max))
+    {
+      expected.insert(entry.first);
+    }
+  }
+
+  std::set<int> found;
+  bool duplicate = false;
+  a_tree.Search(a_query.m_min, a_query.m_max, [&](Item* const& item) {
+    duplicate = duplicate || !found.insert(item->id).second;
+    return true;
+  });
+  CHECK(!duplicate, a_when << ": search reported an entry twice");
+  CHECK(found == expected, a_when << ": search found " << found.size() << ", expected " << expected.size());
+}
+
+// Count, node count, the data index and the node structure against the model
+static void CheckTree(ItemTree& a_tree, const Model& a_model, const std::vector<Item*>& a_items, const char* a_when)
+{
+  CHECK(a_tree.Count() == (int)a_model.size(), a_when << ": count " << a_tree.Count() << ", expected " << a_model.size());
+  CHECK(a_tree.NodeCount() == a_tree.Stats().m_nodes, a_when << ": node count " << a_tree.NodeCount() << ", walked " << a_tree.Stats().m_nodes);
+  CHECK(a_tree.Stats(1).m_nodes == 1, a_when << ": stats of the root level alone");
+
+  for (Item* item : a_items)
+  {
+    double min[2], max[2];
+    bool located = a_tree.Locate(item, min, max);
+    auto it = a_model.find(item->id);
+    CHECK(located == (it != a_model.end()), a_when << ": locate " << item->id);
+    if (located && it != a_model.end())
+    {
+      CHECK(min[0] == it->second.m_min[0] && min[1] == it->second.m_min[1] && max[0] == it->second.m_max[0] && max[1] == it->second.m_max[1],
+            a_when << ": located bounds of " << item->id);
+    }
+  }
+
+  a_tree.LabelNodeId();
+  auto structure = a_tree.GetTreeStructure();
+  std::map<int, size_t> byId;
+  for (size_t i = 0; i < structure.treeNodes.size(); ++i)
+  {
+    byId[structure.treeNodes[i].id] = i;
+  }
+  for (const auto& node : structure.treeNodes)
+  {
+    CHECK(node.childIds.size() + node.dataPointIds.size() <= (size_t)ItemTree::MAXNODES, a_when << ": node " << node.id << " overfull");
+    for (int childId : node.childIds)
+    {
+      const auto& child = structure.treeNodes[byId[childId]];
+      CHECK(child.level == node.level - 1, a_when << ": level of node " << childId);
+      CHECK(child.childIds.size() + child.dataPointIds.size() > 0, a_when << ": empty node " << childId);
+      CHECK(Inside(child.min, child.max, node.min, node.max), a_when << ": node " << childId << " outside its parent");
+    }
+  }
+
+  std::set<int> stored;
+  for (const auto& point : structure.dataPoints)
+  {
+    CHECK(stored.insert(point.id).second, a_when << ": " << point.id << " stored twice");
+    auto it = a_model.find(point.id);
+    CHECK(it != a_model.end() && point.min[0] == it->second.m_min[0] && point.max[1] == it->second.m_max[1], a_when << ": stale entry " << point.id);
+  }
+}
+
+// Two trees as GetTreeStructure() lists them.  Entry weights are read through the data pointer, so
+// they are only comparable between structures taken at the same time.
+template<class STRUCTURE>
+static bool SameStructure(const STRUCTURE& a, const STRUCTURE& b, bool a_entryWeights)
+{
+  if (a.treeNodes.size() != b.treeNodes.size() || a.dataPoints.size() != b.dataPoints.size())
+  {
+    return false;
+  }
+  for (size_t i = 0; i < a.treeNodes.size(); ++i)
+  {
+    const auto& x = a.treeNodes[i];
+    const auto& y = b.treeNodes[i];
+    if (x.id != y.id || x.level != y.level || x.node != y.node || x.weight != y.weight || x.min != y.min || x.max != y.max ||
+        x.childIds != y.childIds || x.dataPointIds != y.dataPointIds)
+    {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < a.dataPoints.size(); ++i)
+  {
+    const auto& x = a.dataPoints[i];
+    const auto& y = b.dataPoints[i];
+    if (x.id != y.id || x.data != y.data || x.min != y.min || x.max != y.max || (a_entryWeights && x.weight != y.weight))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char* argv[])
+{
+  unsigned seed = argc > 1 ? (unsigned)std::stoul(argv[1]) : 5;
+  const int numItems = 1500;
+  const int numSteps = 20000;
+  const char* walPath = "test_rtree.wal";
+
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<double> coord(0.0, 100.0);
+  std::uniform_real_distribution<double> extent(0.0, 2.0);
+  std::uniform_int_distribution<int> pick(0, numItems - 1);
+
+  auto randomBox = [&](double a_size) {
+    Box box;
+    for (int d = 0; d < 2; ++d)
+    {
+      box.m_min[d] = coord(rng);
+      box.m_max[d] = box.m_min[d] + a_size * extent(rng);
+    }
+    return box;
+  };
+
+  std::vector<Item*> items;
+  for (int id = 0; id < numItems; ++id)
+  {
+    items.push_back(new Item{id, 0.0, 0.0});
+  }
+
+  std::remove(walPath);
+  RTreeWAL<LogRecord> wal;
+  CHECK(wal.Open(walPath, 0, nullptr), "open a new log");
+  auto logPut = [&](int a_id, const Box& a_box) {
+    LogRecord record = {a_id, {a_box.m_min[0], a_box.m_min[1]}, {a_box.m_max[0], a_box.m_max[1]}};
+    wal.Append(LOG_PUT, record);
+  };
+  auto logRemove = [&](int a_id) {
+    LogRecord record = {a_id, {0, 0}, {0, 0}};
+    wal.Append(LOG_REMOVE, record);
+  };
+
+  ItemTree tree;
+  tree.EnableDataIndex();
+  Model model;
+
+  // Node weights are part of a version: label them by crowd now and then
+  std::uniform_real_distribution<double> crowd(0.0, 100.0);
+  auto itemCrowd = [](Item* const& a_item) { return a_item->current_crowd; };
+  std::map<int, decltype(tree.GetTreeStructure())> kept; // Versions to read back once the run is over
+
+  for (int step = 0; step < numSteps; ++step)
+  {
+    Item* item = items[pick(rng)];
+    int op = rng() % 100;
+
+    if (step == numSteps / 3)
+    {
+      // Reload everything in place, then carry on mutating the bulk-loaded tree
+      std::vector<ItemTree::BulkEntry> entries;
+      for (const auto& entry : model)
+      {
+        ItemTree::BulkEntry bulk;
+        for (int d = 0; d < 2; ++d)
+        {
+          bulk.m_min[d] = entry.second.m_min[d];
+          bulk.m_max[d] = entry.second.m_max[d];
+        }
+        bulk.m_data = items[entry.first];
+        entries.push_back(bulk);
+      }
+      tree.BulkLoad(entries, 0.7);
+    }
+    else if (step == 2 * numSteps / 3)
+    {
+      tree.RemoveAll();
+      for (const auto& entry : model)
+      {
+        logRemove(entry.first);
+      }
+      model.clear();
+      CheckTree(tree, model, items, "after RemoveAll");
+    }
+    else if (!model.count(item->id) || op < 10)
+    {
+      // Insert, or move through Remove + Insert
+      Box box = randomBox(1.0);
+      if (model.count(item->id))
+      {
+        tree.Remove(item);
+      }
+      tree.Insert(box.m_min, box.m_max, item);
+      model[item->id] = box;
+      logPut(item->id, box);
+    }
+    else if (op < 35)
+    {
+      tree.Remove(item);
+      model.erase(item->id);
+      logRemove(item->id);
+    }
+    else if (op < 45)
+    {
+      // Remove by rect: the rect prunes the descent, so one clear of the whole tree removes nothing
+      Box box = model[item->id];
+      bool covers = op < 42;
+      if (!covers)
+      {
+        box.m_min[0] = 200.0;
+        box.m_max[0] = 201.0;
+      }
+      tree.Remove(box.m_min, box.m_max, item);
+      if (covers)
+      {
+        model.erase(item->id);
+        logRemove(item->id);
+      }
+    }
+    else if (op < 70)
+    {
+      // A short move usually stays inside the leaf cover and is updated in place
+      Box box = model[item->id];
+      double dx = extent(rng) * 0.05 - 0.05;
+      double dy = extent(rng) * 0.05 - 0.05;
+      box.m_min[0] += dx; box.m_max[0] += dx;
+      box.m_min[1] += dy; box.m_max[1] += dy;
+      CHECK(tree.Move(item, box.m_min, box.m_max), "short move of " << item->id);
+      model[item->id] = box;
+      logPut(item->id, box);
+    }
+    else
+    {
+      Box box = randomBox(1.0);
+      CHECK(tree.Move(item, box.m_min, box.m_max), "long move of " << item->id);
+      model[item->id] = box;
+      logPut(item->id, box);
+    }
+
+    if (op < 8)
+    {
+      double min[2] = {0, 0}, max[2] = {0, 0};
+      int absent = -1;
+      for (int tries = 0; tries < 10 && absent < 0; ++tries)
+      {
+        int id = pick(rng);
+        absent = model.count(id) ? -1 : id;
+      }
+      if (absent >= 0)
+      {
+        CHECK(!tree.Move(items[absent], min, max), "move of absent " << absent);
+        CHECK(!tree.Locate(items[absent], min, max), "locate of absent " << absent);
+      }
+    }
+
+    if (op < 2)
+    {
+      item->current_crowd = crowd(rng);
+      tree.LabelNodeWeight("max", 0, 0, 0, {}, nullptr, itemCrowd);
+    }
+
+    tree.LabelNodeId();
+    int version = tree.CommitVersion();
+    CHECK(version == step && tree.Versions() == step + 1, "version number " << version);
+    // Comparing whole structures dominates the run time, so do it for a sample of commits and for
+    // every commit right after the tree was rebuilt from scratch
+    bool afterReload = step % (numSteps / 3) < 50;
+    if (step % 10 == 0 || afterReload)
+    {
+      auto live = tree.GetTreeStructure();
+      CHECK(SameStructure(tree.GetTreeStructure(version), live, true), "version " << version << " matches the live tree");
+      if (step % 250 == 0)
+      {
+        kept[version] = live;
+      }
+    }
+
+    CheckSearch(tree, model, randomBox(15.0), "search");
+    if (step % 500 == 0)
+    {
+      CheckTree(tree, model, items, "step");
+    }
+    if (step % 50 == 0)
+    {
+      wal.Commit(wal.LastLsn());
+    }
+  }
+  CheckTree(tree, model, items, "end");
+
+  // Old versions are unaffected by everything committed after them
+  for (const auto& entry : kept)
+  {
+    CHECK(SameStructure(tree.GetTreeStructure(entry.first), entry.second, false), "version " << entry.first << " read back at the end");
+  }
+  tree.ClearVersions();
+  CHECK(tree.Versions() == 0, "versions cleared");
+  tree.LabelNodeId();
+  CHECK(SameStructure(tree.GetTreeStructure(tree.CommitVersion()), tree.GetTreeStructure(), true), "first version after clearing");
+  Box everything = {{-10, -10}, {110, 110}};
+  CheckSearch(tree, model, everything, "search all");
+
+  // Drain the tree by data until the root has to condense all the way down
+  Model drained = model;
+  for (auto it = drained.begin(); it != drained.end(); it = drained.erase(it))
+  {
+    tree.Remove(items[it->first]);
+    if (drained.size() % 97 == 0)
+    {
+      Model rest(std::next(it), drained.end());
+      CheckTree(tree, rest, items, "drain");
+    }
+  }
+  CHECK(tree.Count() == 0, "drained tree is empty");
+  CheckSearch(tree, Model(), everything, "search drained");
+
+  const uint64_t lastLsn = wal.LastLsn();
+  wal.Close();
+
+  // Replay the log into a fresh tree, the way recovery does without a snapshot
+  auto replay = [&](ItemTree& a_tree, Model& a_model, uint64_t& a_lastLsn) {
+    return [&](uint32_t a_op, uint64_t a_lsn, const LogRecord& a_record) {
+      Item* item = items[a_record.m_id];
+      if (a_op == LOG_PUT)
+      {
+        Box box = {{a_record.m_min[0], a_record.m_min[1]}, {a_record.m_max[0], a_record.m_max[1]}};
+        if (!a_tree.Move(item, box.m_min, box.m_max))
+        {
+          a_tree.Insert(box.m_min, box.m_max, item);
+        }
+        a_model[a_record.m_id] = box;
+      }
+      else
+      {
+        a_tree.Remove(item);
+        a_model.erase(a_record.m_id);
+      }
+      a_lastLsn = a_lsn;
+    };
+  };
+
+  {
+    ItemTree replayed;
+    replayed.EnableDataIndex();
+    Model replayedModel;
+    uint64_t replayedLsn = 0;
+    RTreeWAL<LogRecord> reopened;
+    CHECK(reopened.Open(walPath, 0, replay(replayed, replayedModel, replayedLsn)), "reopen the log");
+    CHECK(replayedLsn == lastLsn, "replayed up to " << replayedLsn << ", logged " << lastLsn);
+    CHECK(replayedModel == model, "replayed model matches");
+    CheckTree(replayed, model, items, "replayed");
+  }
+
+  // A torn last entry is cut off and the rest still replays
+  {
+    struct stat st;
+    stat(walPath, &st);
+    CHECK(truncate(walPath, st.st_size - sizeof(RTreeWAL<LogRecord>::Entry) / 2) == 0, "tear the log");
+
+    ItemTree replayed;
+    replayed.EnableDataIndex();
+    Model replayedModel;
+    uint64_t replayedLsn = 0;
+    RTreeWAL<LogRecord> reopened;
+    CHECK(reopened.Open(walPath, 0, replay(replayed, replayedModel, replayedLsn)), "reopen the torn log");
+    CHECK(replayedLsn == lastLsn - 1, "torn log replayed up to " << replayedLsn);
+    CheckTree(replayed, replayedModel, items, "replayed torn");
+    CHECK(reopened.Append(LOG_REMOVE, LogRecord()) == lastLsn, "appends continue after the intact prefix");
+  }
+  std::remove(walPath);
+
+  for (Item* item : items)
+  {
+    delete item;
+  }
+
+  if (g_failures)
+  {
+    std::cout << g_failures << " checks failed (seed " << seed << ")\n";
+    return 1;
+  }
+  std::cout << "all checks passed (seed " << seed << ")\n";
+  return 0;
+}
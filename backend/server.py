@@ -1,8 +1,9 @@
 from flask import Flask, jsonify, request
-from flask import Response, stream_with_context
+from flask import Response, stream_with_context, send_from_directory
 from flask_cors import CORS
 import os
 import json
+import struct
 import time
 import queue
 import threading
@@ -14,9 +15,200 @@ CORS(app)
 INSERT_FRAMES_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'frames/insert')
 SEARCH_FRAMES_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'frames/search')
 
+class FrameLog:
+    """Reader of a frame log written by RTreeFrameLog (RTreeDB/RTree/RTreeFrameLog.h): rebuilds any
+    frame from the keyframe of its segment and the changes after it, in the layout of the
+    frame_<i>.json files. The last rebuilt frame is kept, so stepping forward applies one frame.
+    Binary logs are converted on the way; their float32 coordinates and weights are rounded to the
+    6 significant digits the JSON encoding writes."""
+
+    _DELTA_KEYS = ('keyframe', 'root', 'nodes', 'removedNodes', 'dataPoints', 'removedDataPoints')
+
+    def __init__(self, directory):
+        self.directory = directory
+        with open(os.path.join(directory, 'index.json')) as f:
+            index = json.load(f)
+        self.interval = index['keyframeInterval']
+        self.frames = index['frames']
+        self.binary = index.get('encoding', 'json') == 'binary'
+        self.dims = index.get('dims', 2)
+        self._lock = threading.Lock()
+        self._position = None    # (segment, line) of the state below
+        self._state = None
+
+    def frame(self, frame_id):
+        if frame_id < 0 or frame_id >= self.frames:
+            return None
+        segment, line = divmod(frame_id, self.interval)
+        with self._lock:
+            start = 0
+            if self._position and self._position[0] == segment and self._position[1] <= line:
+                start = self._position[1] + 1
+            else:
+                self._state = None
+            if start <= line:
+                for number, delta in enumerate(self._segment(segment)):
+                    if number > line:
+                        break
+                    if number >= start:
+                        self._state = self._apply(self._state, delta)
+            self._position = (segment, line)
+            return self._render(self._state)
+
+    def segment_file(self, segment):
+        return f'segment_{segment}.bin' if self.binary else f'segment_{segment}.jsonl'
+
+    def _segment(self, segment):
+        """The frames of a segment as dicts, in the JSON encoding's layout"""
+        path = os.path.join(self.directory, self.segment_file(segment))
+        if not self.binary:
+            with open(path) as f:
+                for text in f:
+                    yield json.loads(text)
+            return
+
+        with open(path, 'rb') as f:
+            data = f.read()
+        position = 0
+        while position < len(data):
+            size, position = _read_varint(data, position)
+            yield self._decode(data[position:position + size])
+            position += size
+
+    def _decode(self, data):
+        position = 0
+
+        def varint():
+            nonlocal position
+            value, position = _read_varint(data, position)
+            return value
+
+        def zigzag():
+            value = varint()
+            return (value >> 1) ^ -(value & 1)
+
+        def real():
+            nonlocal position
+            value, = struct.unpack_from('<f', data, position)
+            position += 4
+            return float('%.6g' % value)
+
+        def text():
+            nonlocal position
+            length = varint()
+            position += length
+            return data[position - length:position].decode('utf-8')
+
+        members = text()
+        delta = json.loads('{' + members + '}')
+        delta['keyframe'] = bool(data[position] & 1)
+        position += 1
+        delta['root'] = varint() - 1
+
+        delta['nodes'] = []
+        for _ in range(varint()):
+            node = {'key': varint(), 'level': varint(), 'weight': real()}
+            node['min'] = [real() for _ in range(self.dims)]
+            node['max'] = [real() for _ in range(self.dims)]
+            count = varint()
+            if node['level'] == 0:
+                node['dataPointIds'] = [zigzag() for _ in range(count)]
+            else:
+                node['children'] = [varint() for _ in range(count)]
+            delta['nodes'].append(node)
+        delta['removedNodes'] = [varint() for _ in range(varint())]
+
+        delta['dataPoints'] = []
+        for _ in range(varint()):
+            point = {'id': zigzag()}
+            point['min'] = [real() for _ in range(self.dims)]
+            point['max'] = [real() for _ in range(self.dims)]
+            point.update(json.loads('{' + text() + '}'))
+            delta['dataPoints'].append(point)
+        delta['removedDataPoints'] = [zigzag() for _ in range(varint())]
+        return delta
+
+    @classmethod
+    def _apply(cls, state, delta):
+        if delta['keyframe'] or state is None:
+            state = {'nodes': {}, 'dataPoints': {}}
+        for key in delta['removedNodes']:
+            state['nodes'].pop(key, None)
+        for point_id in delta['removedDataPoints']:
+            state['dataPoints'].pop(point_id, None)
+        for node in delta['nodes']:
+            state['nodes'][node['key']] = node
+        for point in delta['dataPoints']:
+            state['dataPoints'][point['id']] = point
+        state['root'] = delta['root']
+        state['members'] = {k: v for k, v in delta.items() if k not in cls._DELTA_KEYS}
+        return state
+
+    @staticmethod
+    def _render(state):
+        """Number the nodes breadth-first from the root, as LabelNodeId does"""
+        nodes = state['nodes']
+        order = [state['root']] if state['root'] in nodes else []
+        ids = {}
+        for key in order:
+            ids[key] = len(ids)
+            order.extend(nodes[key].get('children', []))
+
+        tree_nodes, data_points = [], []
+        for key in order:
+            node = nodes[key]
+            entry = {
+                'id': ids[key],
+                'level': node['level'],
+                'isLeaf': node['level'] == 0,
+                'current_crowd': node['weight'],
+                'min': node['min'],
+                'max': node['max'],
+                'childIds': [ids[child] for child in node.get('children', [])],
+            }
+            if node['level'] == 0:
+                entry['dataPointIds'] = node['dataPointIds']
+                data_points.extend(state['dataPoints'][point_id] for point_id in node['dataPointIds'])
+            tree_nodes.append(entry)
+
+        frame = dict(state['members'])
+        frame['treeNodes'] = tree_nodes
+        frame['dataPoints'] = data_points
+        return frame
+
+def _read_varint(data, position):
+    value, shift = 0, 0
+    while True:
+        byte = data[position]
+        position += 1
+        value |= (byte & 0x7f) << shift
+        if byte < 0x80:
+            return value, position
+        shift += 7
+
+_insert_frame_log = None
+
+def insert_frame_log():
+    """The frame log in INSERT_FRAMES_DIR, reopened when it is rewritten; None when there are only frame files"""
+    global _insert_frame_log
+    index_path = os.path.join(INSERT_FRAMES_DIR, 'index.json')
+    if not os.path.exists(index_path):
+        return None
+    written = os.path.getmtime(index_path)
+    if _insert_frame_log is None or _insert_frame_log[0] != written:
+        _insert_frame_log = (written, FrameLog(INSERT_FRAMES_DIR))
+    return _insert_frame_log[1]
+
 @app.route('/api/insert/frames/<int:frame_id>', methods=['GET'])
 def get_insert_frame(frame_id):
     """Return a specific frame by id"""
+    frame_log = insert_frame_log()
+    if frame_log is not None:
+        frame_data = frame_log.frame(frame_id)
+        if frame_data is None:
+            return jsonify({'error': 'Frame not found'}), 404
+        return jsonify(frame_data), 200
+
     frame_path = os.path.join(INSERT_FRAMES_DIR, f'frame_{frame_id}.json')
     
     if not os.path.exists(frame_path):
@@ -27,6 +219,22 @@ def get_insert_frame(frame_id):
     
     return jsonify(frame_data), 200
 
+@app.route('/api/insert/frames/log/index', methods=['GET'])
+def get_insert_frame_log_index():
+    """The frame log's index.json, for clients that decode segments themselves"""
+    if insert_frame_log() is None:
+        return jsonify({'error': 'No frame log'}), 404
+    return send_from_directory(INSERT_FRAMES_DIR, 'index.json')
+
+@app.route('/api/insert/frames/log/<int:segment>', methods=['GET'])
+def get_insert_frame_log_segment(segment):
+    """One segment of the frame log as written, JSON lines or binary (see RTreeFrameLog.h)"""
+    frame_log = insert_frame_log()
+    if frame_log is None or segment < 0 or segment * frame_log.interval >= frame_log.frames:
+        return jsonify({'error': 'Segment not found'}), 404
+    mimetype = 'application/octet-stream' if frame_log.binary else 'application/x-ndjson'
+    return send_from_directory(INSERT_FRAMES_DIR, frame_log.segment_file(segment), mimetype=mimetype)
+
 @app.route('/api/search/frames/<int:search_id>', methods=['GET'])
 def get_search_frame(search_id):
     """Return a specific search path by id"""
@@ -41,11 +249,61 @@ def get_search_frame(search_id):
     return jsonify(search_data), 200
 
 # For real-time demo
-import csv
-from rtree_engine import Cafe, CafeLoc, RTreeEngine
+from rtree_engine import Cafe, CafeLoc, RTreeEngine, SearchCancel
 
-db = RTreeEngine()
+# How nodes are labelled with the scores below them: mean, median, trimmed_mean, max, min or count
+db = RTreeEngine(os.environ.get('RTREE_AGGREGATION', 'trimmed_mean'))
 weights = {"rating": 0.3, "price_level": 0.2, "current_crowd": 0.8, "distance": 1.2}
+# Per-node score bounds are kept for the weights the map queries with
+db.set_bound_profile(weights)
+
+# Serve from the last saved snapshot right away instead of re-importing the CSV
+SNAPSHOT_PATH = os.environ.get('RTREE_SNAPSHOT', os.path.join(os.path.dirname(os.path.abspath(__file__)), 'rtree.snapshot'))
+
+# With several worker processes (e.g. gunicorn), set RTREE_SHARED=/dev/shm/rtree_engine so all of
+# them map one published index instead of each building its own
+SHARED_PREFIX = os.environ.get('RTREE_SHARED')
+
+# Set RTREE_WAL=/path/to/rtree.wal to log every insert; on restart the tree is recovered from
+# SNAPSHOT_PATH plus the log, and /api/snapshot becomes a checkpoint that empties the log
+WAL_PATH = os.environ.get('RTREE_WAL')
+
+if SHARED_PREFIX and os.path.exists(SHARED_PREFIX + '.gen'):
+    db.attach_shared(SHARED_PREFIX)
+elif WAL_PATH:
+    db.enable_durability(SNAPSHOT_PATH, WAL_PATH)
+elif os.path.exists(SNAPSHOT_PATH):
+    db.open_snapshot(SNAPSHOT_PATH)
+
+# Repeated map views are answered from a result cache until the cafes or their attributes change;
+# RTREE_RESULT_CACHE=0 turns it off
+db.configure_result_cache(int(os.environ.get('RTREE_RESULT_CACHE', '256')))
+
+# Rebuild the tree in the background once RTREE_REBUILD_CHECK inserts, moves and removes in a row
+# have left it with too much sibling overlap or too empty nodes (crowd updates do not count);
+# 0 turns the check off
+db.configure_auto_rebuild(int(os.environ.get('RTREE_REBUILD_CHECK', '10000')),
+                          float(os.environ.get('RTREE_REBUILD_OVERLAP', '0.25')),
+                          float(os.environ.get('RTREE_REBUILD_FILL', '0.5')))
+
+# MySQL rewrites current_crowd every 15 seconds (see init.sql); pull it into the engine on the
+# same cadence so searches score from memory and only the changed subtrees get new bounds.
+# Shared workers serve a read-only published index and skip this; while a snapshot is mapped the
+# sync is a no-op, since snapshot searches read the MySQL rows themselves.
+CROWD_SYNC_SECONDS = float(os.environ.get('RTREE_CROWD_SYNC', '15'))
+
+def crowd_sync_loop():
+    while True:
+        time.sleep(CROWD_SYNC_SECONDS)
+        try:
+            updated = db.sync_crowd()
+            if updated:
+                db.refresh_bounds()
+        except Exception as e:
+            print(f"[Crowd Sync] {e}")
+
+if CROWD_SYNC_SECONDS > 0 and not SHARED_PREFIX:
+    threading.Thread(target=crowd_sync_loop, daemon=True).start()
 
 @app.route('/api/initmysql', methods=['POST'])
 def initialize_db():
@@ -60,35 +318,74 @@ def initialize_db():
 @app.route('/api/insert/cafes/<int:num_cafes>', methods=['POST'])
 def insert_cafes_from_csv(num_cafes):
     try:
-        cafes_batch = []
         cafe_file = f'csvs/cafes_{num_cafes}.csv'
-        
-        with open(cafe_file, 'r', encoding='utf-8') as file:
-            csv_reader = csv.DictReader(file)
-            
-            for row in csv_reader:
-                cafe = Cafe()
-                cafe.id = int(row['id'])
-                cafe.name = row['name']
-                cafe.rating = float(row['rating'])
-                cafe.lat = float(row['latitude']) 
-                cafe.lon = float(row['longitude'])
-                cafe.price_level = int(row['price_level'])
-                cafe.current_crowd = int(row['current_crowd'])
-                
-                cafes_batch.append(cafe)
-        
-        # Insert all cafes at once using vector
-        db.insert(cafes_batch)
+
+        # Parsed and bulk-loaded by the engine, no Cafe object per row
+        loaded = db.load_csv(cafe_file)
+        if loaded < 0:
+            return jsonify({'error': f'Error processing CSV: cannot read {cafe_file}'}), 500
+
+        if SHARED_PREFIX:
+            # Publish for the other workers, then drop our private copy and map the shared one too
+            generation = db.publish_shared(SHARED_PREFIX)
+            if generation:
+                db.attach_shared(SHARED_PREFIX)
+                print(f"[Shared Index] published generation {generation}")
         
         return jsonify({
             'status': 'success',
-            'message': f'Imported {len(cafes_batch)} cafes from CSV'
+            'message': f'Imported {loaded} cafes from CSV'
         }), 201
         
     except Exception as e:
         return jsonify({'error': f'Error processing CSV: {str(e)}'}), 500
 
+@app.route('/api/cafes/<int:cafe_id>/location', methods=['PUT'])
+def move_cafe(cafe_id):
+    """Relocate one cafe, body: {"lon": ..., "lat": ...}"""
+    try:
+        body = request.json or {}
+        if not db.move(cafe_id, float(body['lon']), float(body['lat'])):
+            return jsonify({'error': 'Cafe not found'}), 404
+        return jsonify({'status': 'success'}), 200
+    except (KeyError, TypeError, ValueError):
+        return jsonify({'error': 'lon and lat must be numbers.'}), 400
+    except Exception as e:
+        return jsonify({'error': f'Move failed: {str(e)}'}), 500
+
+@app.route('/api/cafes/<int:cafe_id>', methods=['DELETE'])
+def remove_cafe(cafe_id):
+    """Drop one cafe from the tree and MySQL"""
+    try:
+        if not db.remove(cafe_id):
+            return jsonify({'error': 'Cafe not found'}), 404
+        return jsonify({'status': 'success'}), 200
+    except Exception as e:
+        return jsonify({'error': f'Remove failed: {str(e)}'}), 500
+
+@app.route('/api/snapshot', methods=['POST'])
+def save_snapshot():
+    """Write the current tree to SNAPSHOT_PATH for fast restarts"""
+    try:
+        start_time = time.time()
+        saved = db.checkpoint() if WAL_PATH else db.save_snapshot(SNAPSHOT_PATH)
+        if not saved:
+            return jsonify({'status': 'error', 'message': 'Failed to write snapshot'}), 500
+        print(f"[Snapshot Save Time] {time.time() - start_time:.3f}s")
+        return jsonify({'status': 'success', 'path': SNAPSHOT_PATH}), 200
+    except Exception as e:
+        return jsonify({'status': 'error', 'message': str(e)}), 500
+
+def log_search(kind, status):
+    """One line per search from the engine's per-query stats"""
+    stats = status.stats
+    print(f"[Search Stats ({kind})] total {stats.total_ms:.1f}ms = fetch {stats.fetch_ms:.1f} + scoring {stats.scoring_ms:.1f}"
+          f" + traversal {stats.traversal_ms:.1f} + callback {stats.callback_ms:.1f}; nodes {stats.nodes_visited}"
+          f" (pruned {stats.nodes_pruned}), leaves {stats.leaves_scanned}, hits {stats.hits}, allocations {stats.allocations}"
+          f"{', cached' if stats.cached else ''}")
+    if status.partial:
+        print(f"[Partial Result] coverage {status.coverage:.2f}, complete above score {status.complete_above:.3f}")
+
 @app.route('/api/search/cafes', methods=['GET'])
 def search_cafes():
     try:
@@ -102,6 +399,16 @@ def search_cafes():
         radius = float(request.args.get('radius'))
         min_score = 0
 
+        # ranked=1 streams best first: the first N lines are the top N
+        ranked = request.args.get('ranked', '0') in ('1', 'true')
+        # limit=N ends the search after N cafes (the top N when ranked)
+        limit = int(request.args.get('limit', 0))
+        # budget_ms=T streams the best cafes found within T ms instead of running to completion
+        budget_ms = float(request.args.get('budget_ms', 0))
+
+        # Cancelled when the client goes away, which ends the C++ traversal
+        cancel = SearchCancel()
+
         # Create a thread-safe queue
         result_queue = queue.Queue()
         search_complete = threading.Event()
@@ -124,7 +431,10 @@ def search_cafes():
         def search_thread():
             """Run the search in a separate thread"""
             try:
-                db.stream_search(lon, lat, radius, min_score, weights, cafe_callback)
+                stream = db.stream_search_ranked if ranked else db.stream_search
+                status = stream(lon, lat, radius, min_score, weights, cafe_callback,
+                                limit=limit, cancel=cancel, budget_ms=budget_ms)
+                log_search('Optimization', status)
             except Exception as e:
                 result_queue.put({'error': str(e)})
             finally:
@@ -138,29 +448,32 @@ def search_cafes():
             thread.start()
             
             count = 0
-            while True:
-                try:
-                    # Wait for next item with timeout
-                    data = result_queue.get(timeout=1.0)
-                    
-                    if 'error' in data:
-                        yield json.dumps({'error': data['error']}) + '\n'
-                        break
-                    
-                    count += 1
-                    if count == 1:
-                        print(f"[First Result Time (Optimization)] {time.time() - start_time:.3f}s")
-                    
-                    yield json.dumps(data) + '\n'
-                    
-                except queue.Empty:
-                    # Check if search is complete
-                    if search_complete.is_set():
-                        break
-                    # Otherwise continue waiting
-                    continue
-            
-            thread.join()  # Wait for search thread to complete
+            try:
+                while True:
+                    try:
+                        # Wait for next item with timeout
+                        data = result_queue.get(timeout=1.0)
+                        
+                        if 'error' in data:
+                            yield json.dumps({'error': data['error']}) + '\n'
+                            break
+                        
+                        count += 1
+                        if count == 1:
+                            print(f"[First Result Time (Optimization)] {time.time() - start_time:.3f}s")
+                        
+                        yield json.dumps(data) + '\n'
+                        
+                    except queue.Empty:
+                        # Check if search is complete
+                        if search_complete.is_set():
+                            break
+                        # Otherwise continue waiting
+                        continue
+            finally:
+                # Also reached through GeneratorExit when the client disconnects mid-stream
+                cancel.cancel()
+                thread.join()  # Wait for search thread to complete
             print(f"Found and streamed {count} cafes")
 
         response = Response(
@@ -191,12 +504,17 @@ def search_cafes_regular():
         lat = float(request.args.get('lat'))
         radius = float(request.args.get('radius'))
         min_score = 0
+        # limit=N returns the top N only, without scoring and sorting every hit
+        limit = int(request.args.get('limit', 0))
+        # budget_ms=T returns the best cafes found within T ms; the X-Search-* headers say if that cut it short
+        budget_ms = float(request.args.get('budget_ms', 0))
 
         # print(f"[Weights] {weights}")
         start_time = time.time()
         
         # Get all data at once using db.search
-        cafeLocs, cafeDatas = db.search(lon, lat, radius, min_score, weights)
+        cafeLocs, cafeDatas, status = db.search(lon, lat, radius, min_score, weights, limit, budget_ms=budget_ms)
+        log_search('Regular', status)
         
         def generate():
             count = 0
@@ -225,7 +543,9 @@ def search_cafes_regular():
             headers={
                 'Cache-Control': 'no-cache',
                 'Connection': 'keep-alive',
-                'X-Accel-Buffering': 'no' 
+                'X-Accel-Buffering': 'no',
+                'X-Search-Partial': '1' if status.partial else '0',
+                'X-Search-Coverage': f"{status.coverage:.3f}"
             }
         )
         return response
@@ -235,11 +555,133 @@ def search_cafes_regular():
     except Exception as e:
         return jsonify({'error': f'Search failed: {str(e)}'}), 500
 
+@app.route('/api/search/cafes/batch', methods=['POST'])
+def search_cafes_batch():
+    """Score many (lon, lat, radius) points at once, e.g. every MRT exit"""
+    try:
+        body = request.json or {}
+        queries = [(float(q['lon']), float(q['lat']), float(q['radius'])) for q in body.get('queries', [])]
+        min_score = float(body.get('min_score', 0))
+
+        start_time = time.time()
+        result = db.search_batch(queries, body.get('weights', weights), min_score)
+        print(f"[Batch Search Time] {len(queries)} queries in {time.time() - start_time:.3f}s")
+
+        return jsonify({
+            'offsets': result.offsets,
+            'ids': result.ids,
+            'scores': result.scores,
+            'distances': result.distances
+        }), 200
+
+    except (KeyError, TypeError, ValueError):
+        return jsonify({'error': 'Each query needs numeric lon, lat and radius.'}), 400
+    except Exception as e:
+        return jsonify({'error': f'Batch search failed: {str(e)}'}), 500
+
+@app.route('/api/search/cafes/profiles', methods=['POST'])
+def search_cafes_profiles():
+    """Rank one viewport under several weight profiles (e.g. A/B variants) in a single pass"""
+    try:
+        body = request.json or {}
+        lon, lat, radius = float(body['lon']), float(body['lat']), float(body['radius'])
+        min_score = float(body.get('min_score', 0))
+        profiles = body.get('profiles') or [weights]
+
+        start_time = time.time()
+        result = db.search_profiles(lon, lat, radius, min_score, profiles)
+        print(f"[Profile Search Time] {len(profiles)} profiles in {time.time() - start_time:.3f}s")
+
+        def hit(i, p):
+            cafe = result.cafes[i]
+            return {
+                'id': cafe.id,
+                'lon': cafe.lon,
+                'lat': cafe.lat,
+                'name': f"Cafe {cafe.id}",
+                'rating': result.ratings[i],
+                'price_level': result.price_levels[i],
+                'current_crowd': result.current_crowds[i],
+                'score': result.scores[p][i],
+                'distance': result.distances[i]
+            }
+
+        rankings = [[hit(i, p) for i in ranking] for p, ranking in enumerate(result.rankings)]
+        return jsonify({'profiles': rankings}), 200
+
+    except (KeyError, TypeError, ValueError):
+        return jsonify({'error': 'lon, lat and radius must be numbers, profiles a list of weight maps.'}), 400
+    except Exception as e:
+        return jsonify({'error': f'Profile search failed: {str(e)}'}), 500
+
+@app.route('/api/search/stats', methods=['GET'])
+def search_latency_stats():
+    """p50 / p99 latency (ms) per search phase since start or the last reset=1"""
+    stats = db.latency_stats()
+    if request.args.get('reset', '0') in ('1', 'true'):
+        db.reset_latency_stats()
+    return jsonify(stats), 200
+
+@app.route('/api/tree/stats', methods=['GET'])
+def tree_stats():
+    """Shape, overlap and memory of the R-tree, to tell when it needs a rebuild"""
+    stats = db.tree_stats()
+    return jsonify({
+        'height': stats.height,
+        'nodes': stats.nodes,
+        'entries': stats.entries,
+        'nodes_per_level': stats.nodes_per_level,
+        'fill_per_level': stats.fill_per_level,
+        'fill_factor': stats.fill_factor,
+        'cover_area': stats.cover_area,
+        'overlap_area': stats.overlap_area,
+        'pairwise_overlap_area': stats.pairwise_overlap_area,
+        'dead_space': stats.dead_space,
+        'node_bytes': stats.node_bytes,
+        'data_bytes': stats.data_bytes,
+        'index_bytes': stats.index_bytes,
+        'rebuilding': db.rebuilding(),
+        'rebuilds': db.rebuild_count()
+    }), 200
+
+@app.route('/api/tree/rebuild', methods=['POST'])
+def rebuild_tree():
+    """Start a background rebuild of the R-tree; searches keep using the current tree until it is done"""
+    started = db.start_rebuild()
+    return jsonify({'started': started, 'rebuilding': db.rebuilding()}), 202 if started else 409
+
+@app.route('/api/cache/stats', methods=['GET'])
+def result_cache_stats():
+    stats = db.result_cache_stats()
+    return jsonify({
+        'hits': stats.hits,
+        'misses': stats.misses,
+        'stale': stats.stale,
+        'evictions': stats.evictions,
+        'entries': stats.entries,
+        'cached_hits': stats.cached_hits,
+        'epoch': db.attribute_epoch()
+    }), 200
+
+@app.route('/api/update/crowd', methods=['POST'])
+def update_crowd():
+    """Apply a batch of crowd readings, body: [[cafe_id, current_crowd], ...]"""
+    try:
+        updates = [(int(cafe_id), int(crowd)) for cafe_id, crowd in (request.json or [])]
+        updated = db.update_crowd(updates)
+        db.refresh_bounds()
+        return jsonify({'status': 'success', 'updated': updated, 'epoch': db.attribute_epoch()}), 200
+    except (TypeError, ValueError):
+        return jsonify({'error': 'Body must be a list of [cafe_id, current_crowd] pairs.'}), 400
+    except Exception as e:
+        return jsonify({'error': f'Crowd update failed: {str(e)}'}), 500
+
 @app.route('/api/update/weights', methods=['PUT'])
 def update_weights():
     """Update the weights for crowd and rating"""
     global weights
     weights = request.json
+    db.set_bound_profile(weights)
 
     return jsonify({'status': 'success'}), 200
 